@@ -0,0 +1,144 @@
+// Benchmark Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL w/ ENC28J60
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz
+
+// On-target microbenchmarks, built only when BENCHMARK is defined
+// Each case is timed with the DWT cycle counter and reported as
+// min/avg/max cycles; interrupts stay enabled, so max includes any ISR that
+// landed inside a run
+// The tick scan and the ARP/ping/UDP reply latencies are timed live and are
+// reported by the stats command in this build
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+#include "uart0.h"
+#include "checksum.h"
+#include "stats.h"
+#include "bench.h"
+
+#ifdef BENCHMARK
+
+#define CHECKSUM_RUNS 100
+#define ETHER_RUNS    32
+#define PHY_RUNS      32
+
+// Local experimental ethertype, so the frames sent here are ignored by other hosts
+#define BENCH_ETHERTYPE 0x88B5
+
+#define MAX_BENCH_FRAME 1514
+
+// PHSTAT2
+#define BENCH_PHY_REGISTER 0x11
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+uint8_t benchFrame[MAX_BENCH_FRAME];
+const uint16_t checksumSizes[] = { 20, 64, 576, 1500 };
+const uint16_t frameSizes[] = { 64, 590, 1514 };
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void putBenchResult(char* name, uint16_t size, cycleStats* s) {
+	putsUart0(name);
+	if (size > 0) {
+		putcUart0(' ');
+		putUintUart0(size);
+	}
+	putsUart0(": ");
+	putCyclesUart0(s);
+	putsUart0("\r\n");
+}
+
+// Fills the frame with one addressed from and to this host
+void makeBenchFrame() {
+	uint16_t i;
+	etherGetMacAddress(&benchFrame[0]);
+	etherGetMacAddress(&benchFrame[6]);
+	benchFrame[12] = BENCH_ETHERTYPE >> 8;
+	benchFrame[13] = BENCH_ETHERTYPE & 0xFF;
+	for (i = 14; i < MAX_BENCH_FRAME; i++)
+		benchFrame[i] = i;
+}
+
+void benchChecksum() {
+	cycleStats s;
+	uint32_t start;
+	volatile uint32_t sum;
+	uint8_t i, j;
+	for (i = 0; i < sizeof(checksumSizes) / sizeof(checksumSizes[0]); i++) {
+		clearCycles(&s);
+		for (j = 0; j < CHECKSUM_RUNS; j++) {
+			start = getCycles();
+			sum = checksumAdd(0, benchFrame, checksumSizes[i]);
+			addCycles(&s, getCycles() - start);
+		}
+		putBenchResult("checksumAdd", checksumSizes[i], &s);
+	}
+	(void) sum;
+}
+
+// Times queueing a frame (the buffer memory write) with the wire idle, and
+// reading it back (the same buffer memory read that etherGetPacket does)
+void benchPacketCopy() {
+	cycleStats put, get;
+	uint32_t start;
+	uint8_t i, j;
+	for (i = 0; i < sizeof(frameSizes) / sizeof(frameSizes[0]); i++) {
+		clearCycles(&put);
+		clearCycles(&get);
+		for (j = 0; j < ETHER_RUNS; j++) {
+			while (!etherIsTxIdle())
+				;
+			start = getCycles();
+			etherQueuePacket(benchFrame, frameSizes[i]);
+			addCycles(&put, getCycles() - start);
+			start = getCycles();
+			etherReadTxPacket(benchFrame, frameSizes[i]);
+			addCycles(&get, getCycles() - start);
+		}
+		putBenchResult("etherQueuePacket", frameSizes[i], &put);
+		putBenchResult("buffer read", frameSizes[i], &get);
+	}
+	while (!etherIsTxIdle())
+		;
+}
+
+void benchPhy() {
+	cycleStats s;
+	uint32_t start;
+	uint8_t i;
+	clearCycles(&s);
+	for (i = 0; i < PHY_RUNS; i++) {
+		start = getCycles();
+		etherReadPhy(BENCH_PHY_REGISTER);
+		addCycles(&s, getCycles() - start);
+	}
+	putBenchResult("etherReadPhy", 0, &s);
+}
+
+// Runs every case and writes min/avg/max cycles for each
+void runBenchmarks() {
+	makeBenchFrame();
+	putsUart0("cycles min/avg/max\r\n");
+	benchChecksum();
+	benchPacketCopy();
+	benchPhy();
+}
+
+#endif
@@ -0,0 +1,124 @@
+// Internet Checksum Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Implements the RFC 1071 one's complement sum 32 bits at a time, and the
+// RFC 1624 incremental update for headers where only a few fields change
+// All functions are reentrant; partial sums are passed in and returned
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "checksum.h"
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Folds a 32-bit one's complement sum into 16 bits
+static uint16_t checksumFold(uint32_t sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
+
+// Adds a 32-bit word with end-around carry (compiles to ADDS + ADC)
+static inline uint32_t checksumAdd32(uint32_t acc, uint32_t value)
+{
+    acc += value;
+    return acc + (acc < value);
+}
+
+// Adds sizeInBytes of data to a partial sum
+// The first byte of data is treated as the low byte of a 16-bit word, so
+// every call but the last must cover an even number of bytes
+// Since 2^16 = 1 (mod 2^16 - 1), whole 32-bit words can be added at once
+uint32_t checksumAdd(uint32_t sum, const void* data, uint16_t sizeInBytes)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t acc = 0;
+    bool odd = ((uintptr_t)p & 1) != 0;
+    uint16_t folded;
+
+    // an odd start address is summed aligned and byte swapped afterwards
+    if (odd && sizeInBytes > 0)
+    {
+        acc = (uint32_t)*p++ << 8;
+        sizeInBytes--;
+    }
+    if (((uintptr_t)p & 2) != 0 && sizeInBytes >= 2)
+    {
+        acc = checksumAdd32(acc, *(const uint16_t*)p);
+        p += 2;
+        sizeInBytes -= 2;
+    }
+    while (sizeInBytes >= 16)
+    {
+        acc = checksumAdd32(acc, ((const uint32_t*)p)[0]);
+        acc = checksumAdd32(acc, ((const uint32_t*)p)[1]);
+        acc = checksumAdd32(acc, ((const uint32_t*)p)[2]);
+        acc = checksumAdd32(acc, ((const uint32_t*)p)[3]);
+        p += 16;
+        sizeInBytes -= 16;
+    }
+    while (sizeInBytes >= 4)
+    {
+        acc = checksumAdd32(acc, *(const uint32_t*)p);
+        p += 4;
+        sizeInBytes -= 4;
+    }
+    if (sizeInBytes >= 2)
+    {
+        acc = checksumAdd32(acc, *(const uint16_t*)p);
+        p += 2;
+        sizeInBytes -= 2;
+    }
+    if (sizeInBytes > 0)
+        acc = checksumAdd32(acc, *p);
+
+    folded = checksumFold(acc);
+    if (odd)
+        folded = (folded >> 8) | (folded << 8);
+    return checksumAdd32(sum, folded);
+}
+
+// Adds a single 16-bit value in memory order to a partial sum
+uint32_t checksumAddWord(uint32_t sum, uint16_t value)
+{
+    return checksumAdd32(sum, value);
+}
+
+// Completes the sum, returning the value to store in the checksum field
+// Returns 0 when verifying a block that already contains a valid checksum
+uint16_t checksumFinish(uint32_t sum)
+{
+    return ~checksumFold(sum);
+}
+
+// Updates a checksum after a 16-bit field changed from oldValue to newValue
+// RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m')
+uint16_t checksumUpdate16(uint16_t check, uint16_t oldValue, uint16_t newValue)
+{
+    uint32_t sum;
+    sum = (uint16_t)~check;
+    sum += (uint16_t)~oldValue;
+    sum += newValue;
+    return ~checksumFold(sum);
+}
+
+// Updates a checksum after a 32-bit field (in memory order) changed
+uint16_t checksumUpdate32(uint16_t check, uint32_t oldValue, uint32_t newValue)
+{
+    check = checksumUpdate16(check, oldValue & 0xFFFF, newValue & 0xFFFF);
+    return checksumUpdate16(check, oldValue >> 16, newValue >> 16);
+}
@@ -0,0 +1,33 @@
+// Internet Checksum Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef CHECKSUM_H_
+#define CHECKSUM_H_
+
+#include <stdint.h>
+
+// Sums are kept in memory order (the first byte of each 16-bit word is the
+// low byte), so results can be stored straight into a header field
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+uint32_t checksumAdd(uint32_t sum, const void* data, uint16_t sizeInBytes);
+uint32_t checksumAddWord(uint32_t sum, uint16_t value);
+uint16_t checksumFinish(uint32_t sum);
+uint16_t checksumUpdate16(uint16_t check, uint16_t oldValue, uint16_t newValue);
+uint16_t checksumUpdate32(uint16_t check, uint32_t oldValue, uint32_t newValue);
+
+#endif
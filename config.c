@@ -0,0 +1,233 @@
+// Configuration Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz
+
+// Hardware configuration:
+// EEPROM blocks CONFIG_FIRST_BLOCK to CONFIG_FIRST_BLOCK + CONFIG_SLOTS - 1
+
+// Saved network settings and the last DHCP lease
+// The newest valid record is loaded into RAM once at boot and read from
+// there. Changes are committed lazily as one record, written a word per
+// timer tick so the main loop never waits on the EEPROM
+// Each record goes to the slot after the last one and carries a sequence
+// number and a CRC, so a torn write leaves the previous record in charge
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "eprom.h"
+#include "timer.h"
+#include "config.h"
+
+#define CONFIG_MAGIC   0x43464731
+#define CONFIG_VERSION 2
+
+typedef struct _configRecord {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t words;
+	uint32_t sequence;
+	uint8_t dhcpMode;
+	uint8_t reserved[3];
+	uint8_t address[CONFIG_NUM_ADDRESSES][4];
+	uint8_t leaseIp[4];
+	uint8_t leaseServer[4];
+	uint32_t leaseTime;
+	uint32_t crc;
+} configRecord;
+
+#define RECORD_WORDS (sizeof(configRecord) / 4)
+
+// Settings are the fields between the sequence number and the CRC
+#define SETTINGS_START offsetof(configRecord, dhcpMode)
+#define SETTINGS_SIZE  (offsetof(configRecord, crc) - SETTINGS_START)
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+configRecord current;
+configRecord stored;
+configRecord writeRecord;
+uint8_t storedSlot;
+bool storedValid;
+uint8_t writeSlot;
+uint8_t writeWord;
+timerHandle commitTimer = TIMER_INVALID;
+timerHandle writeTimer = TIMER_INVALID;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// CRC-32 of everything before the crc field
+uint32_t configCrc(const configRecord* record) {
+	const uint8_t* data = (const uint8_t*) record;
+	uint32_t crc = 0xFFFFFFFF;
+	uint8_t i, bit;
+	for (i = 0; i < offsetof(configRecord, crc); i++) {
+		crc ^= data[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+bool isRecordValid(const configRecord* record) {
+	return record->magic == CONFIG_MAGIC && record->version == CONFIG_VERSION
+	        && record->words == RECORD_WORDS && record->crc == configCrc(record);
+}
+
+bool isSameSettings(const configRecord* a, const configRecord* b) {
+	return memcmp((const uint8_t*) a + SETTINGS_START, (const uint8_t*) b + SETTINGS_START, SETTINGS_SIZE) == 0;
+}
+
+uint16_t getSlotAddress(uint8_t slot) {
+	return (CONFIG_FIRST_BLOCK + slot) << 4;
+}
+
+// Reads the settings of boards written before the config record existed,
+// kept as one word each with the first address byte in the top byte
+void loadLegacyConfig(configRecord* record) {
+	uint32_t words[1 + CONFIG_NUM_ADDRESSES];
+	uint8_t i, j;
+	readEepromWords(0, words, 1 + CONFIG_NUM_ADDRESSES);
+	record->dhcpMode = words[0] > 0;
+	for (i = 0; i < CONFIG_NUM_ADDRESSES; i++)
+		for (j = 0; j < 4; j++)
+			record->address[i][j] = words[1 + i] >> (24 - 8 * j);
+}
+
+void startConfigWrite();
+
+// Starts the commit delay over, unless the settings match the stored record
+void scheduleCommit() {
+	cancelTimer(commitTimer);
+	commitTimer = TIMER_INVALID;
+	if (storedValid && isSameSettings(&current, &stored))
+		return;
+	commitTimer = startTimer(startConfigWrite, CONFIG_COMMIT_DELAY_MS, false);
+}
+
+// Writes the next word of the record once the previous one has finished,
+// and makes the record current when the last one is done
+void writeConfigWord() {
+	const uint32_t* words = (const uint32_t*) &writeRecord;
+	if (isEepromBusy())
+		return;
+	if (writeWord < RECORD_WORDS) {
+		startEepromWrite(getSlotAddress(writeSlot) + writeWord, words[writeWord]);
+		writeWord++;
+		return;
+	}
+	cancelTimer(writeTimer);
+	writeTimer = TIMER_INVALID;
+	stored = writeRecord;
+	storedSlot = writeSlot;
+	storedValid = true;
+	// Pick up anything that changed while the record was being written
+	if (!isSameSettings(&current, &stored))
+		scheduleCommit();
+}
+
+// Snapshots the settings into a new record for the next slot
+void startConfigWrite() {
+	commitTimer = TIMER_INVALID;
+	if (writeTimer != TIMER_INVALID)
+		return;
+	writeRecord = current;
+	writeRecord.magic = CONFIG_MAGIC;
+	writeRecord.version = CONFIG_VERSION;
+	writeRecord.words = RECORD_WORDS;
+	writeRecord.sequence = stored.sequence + 1;
+	writeRecord.crc = configCrc(&writeRecord);
+	writeSlot = (storedSlot + 1) % CONFIG_SLOTS;
+	writeWord = 0;
+	writeTimer = startTimer(writeConfigWord, TIMER_TICK_MS, true);
+}
+
+// Loads the newest valid record, falling back to the original layout
+// Call after initEeprom and initTimer
+void initConfig() {
+	configRecord record;
+	uint8_t slot;
+	storedValid = false;
+	for (slot = 0; slot < CONFIG_SLOTS; slot++) {
+		readEepromWords(getSlotAddress(slot), (uint32_t*) &record, RECORD_WORDS);
+		if (isRecordValid(&record) && (!storedValid || (int32_t) (record.sequence - stored.sequence) > 0)) {
+			stored = record;
+			storedSlot = slot;
+			storedValid = true;
+		}
+	}
+	if (!storedValid) {
+		memset(&stored, 0, sizeof(stored));
+		loadLegacyConfig(&stored);
+		storedSlot = CONFIG_SLOTS - 1;
+	}
+	current = stored;
+	// Migrate old boards to a record
+	if (!storedValid)
+		scheduleCommit();
+}
+
+bool getConfigDhcpMode() {
+	return current.dhcpMode != 0;
+}
+
+void setConfigDhcpMode(bool enabled) {
+	current.dhcpMode = enabled;
+	scheduleCommit();
+}
+
+void getConfigAddress(uint8_t item, uint8_t ip[4]) {
+	memcpy(ip, current.address[item], 4);
+}
+
+void setConfigAddress(uint8_t item, const uint8_t ip[4]) {
+	memcpy(current.address[item], ip, 4);
+	scheduleCommit();
+}
+
+// Returns the last lease, or false if there is none
+// The board has no clock that survives a reset, so the lease time is kept
+// rather than its expiry, and the server is asked to confirm the address
+bool getConfigLease(uint8_t ip[4], uint8_t server[4], uint32_t* leaseTime) {
+	if (current.leaseTime == 0)
+		return false;
+	memcpy(ip, current.leaseIp, 4);
+	memcpy(server, current.leaseServer, 4);
+	*leaseTime = current.leaseTime;
+	return true;
+}
+
+// Saves a lease; renewals of the same lease do not cause a write
+void setConfigLease(const uint8_t ip[4], const uint8_t server[4], uint32_t leaseTime) {
+	memcpy(current.leaseIp, ip, 4);
+	memcpy(current.leaseServer, server, 4);
+	current.leaseTime = leaseTime;
+	scheduleCommit();
+}
+
+void clearConfigLease() {
+	memset(current.leaseIp, 0, 4);
+	memset(current.leaseServer, 0, 4);
+	current.leaseTime = 0;
+	scheduleCommit();
+}
+
+// Returns true while a change is waiting to be written or being written
+bool isConfigPending() {
+	return commitTimer != TIMER_INVALID || writeTimer != TIMER_INVALID;
+}
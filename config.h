@@ -0,0 +1,58 @@
+// Configuration Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz
+
+// Hardware configuration:
+// EEPROM blocks CONFIG_FIRST_BLOCK to CONFIG_FIRST_BLOCK + CONFIG_SLOTS - 1
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Stored addresses
+#define CONFIG_IP            0
+#define CONFIG_GW            1
+#define CONFIG_DNS           2
+#define CONFIG_SN            3
+#define CONFIG_NUM_ADDRESSES 4
+
+// Changes are written this long after the last one, so a burst of settings
+// costs a single record write
+#ifndef CONFIG_COMMIT_DELAY_MS
+#define CONFIG_COMMIT_DELAY_MS 2000
+#endif
+
+// Each write goes to the next of CONFIG_SLOTS blocks, so wear is spread
+// over all of them
+#define CONFIG_FIRST_BLOCK 1
+#ifndef CONFIG_SLOTS
+#define CONFIG_SLOTS       8
+#endif
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initConfig();
+bool getConfigDhcpMode();
+void setConfigDhcpMode(bool enabled);
+void getConfigAddress(uint8_t item, uint8_t ip[4]);
+void setConfigAddress(uint8_t item, const uint8_t ip[4]);
+bool getConfigLease(uint8_t ip[4], uint8_t server[4], uint32_t* leaseTime);
+void setConfigLease(const uint8_t ip[4], const uint8_t server[4], uint32_t leaseTime);
+void clearConfigLease();
+bool isConfigPending();
+
+#endif
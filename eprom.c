@@ -5,6 +5,7 @@
  *      Author: saeedjassani
  */
 #include <stdint.h>
+#include <stdbool.h>
 #include "tm4c123gh6pm.h"
 
 /*
@@ -15,6 +16,9 @@
  * 2 -> GW
  * 3 -> DNS
  * 4 -> SN
+ *
+ * Words 0-4 are the original layout, now only read to migrate old boards.
+ * Blocks 1-8 hold the configuration records written by config.c
  */
 
 
@@ -40,5 +44,29 @@ uint32_t readEeprom(uint16_t add)
     return EEPROM_EERDWR_R;
 }
 
+// Reads count words starting at add, which must not cross a 16-word block
+void readEepromWords(uint16_t add, uint32_t data[], uint8_t count)
+{
+    uint8_t i;
+    EEPROM_EEBLOCK_R = add >> 4;
+    EEPROM_EEOFFSET_R = add & 0xF;
+    for (i = 0; i < count; i++)
+        data[i] = EEPROM_EERDWRINC_R;
+}
+
+// Starts a word write without waiting for it to finish
+// Poll isEepromBusy before starting the next access
+void startEepromWrite(uint16_t add, uint32_t data)
+{
+    EEPROM_EEBLOCK_R = add >> 4;
+    EEPROM_EEOFFSET_R = add & 0xF;
+    EEPROM_EERDWR_R = data;
+}
+
+bool isEepromBusy()
+{
+    return (EEPROM_EEDONE_R & EEPROM_EEDONE_WORKING) != 0;
+}
+
 
 
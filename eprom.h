@@ -8,9 +8,15 @@
 #ifndef EPROM_H_
 #define EPROM_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+
 void initEeprom();
 void writeEeprom(uint16_t add, uint32_t data);
 uint32_t readEeprom(uint16_t add);
+void readEepromWords(uint16_t add, uint32_t data[], uint8_t count);
+void startEepromWrite(uint16_t add, uint32_t data);
+bool isEepromBusy();
 
 
 #endif /* EPROM_H_ */
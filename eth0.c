@@ -26,19 +26,34 @@
 #include <eth0.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
-#include <stdarg.h>
+#include <string.h>
 #include "tm4c123gh6pm.h"
 #include "wait.h"
 #include "gpio.h"
 #include "spi0.h"
-#include "eprom.h"
+#include "config.h"
+#include "checksum.h"
+#include "timer.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "packet.h"
 
 // Pins
 #define CS PORTA,3
 #define WOL PORTB,3
 #define INT PORTC,6
 
+// SPI clock
+// The ENC28J60 supports up to 20 MHz, which is also the SSI limit at 40 MHz
+// The clock is halved from ETHER_SPI_CLOCK until register read-back passes,
+// stopping at ETHER_SPI_CLOCK_SAFE
+#ifndef ETHER_SPI_CLOCK
+#define ETHER_SPI_CLOCK 20000000
+#endif
+#define ETHER_SPI_CLOCK_SAFE 4000000
+
 // Ether registers
 #define ERDPTL      0x00
 #define ERDPTH      0x01
@@ -56,20 +71,45 @@
 #define ERXRDPTH    0x0D
 #define ERXWRPTL    0x0E
 #define ERXWRPTH    0x0F
+#define EDMASTL     0x10
+#define EDMASTH     0x11
+#define EDMANDL     0x12
+#define EDMANDH     0x13
+#define EDMADSTL    0x14
+#define EDMADSTH    0x15
+#define EDMACSL     0x16
+#define EDMACSH     0x17
 #define EIE         0x1B
+#define INTIE   0x80
+#define PKTIE   0x40
+#define LINKIE  0x10
+#define TXIE    0x08
+#define RXERIE  0x01
 #define EIR         0x1C
 #define RXERIF  0x01
 #define TXERIF  0x02
 #define TXIF    0x08
+#define LINKIF  0x10
 #define PKTIF   0x40
 #define ESTAT       0x1D
 #define CLKRDY  0x01
 #define TXABORT 0x02
+#define RXBUSY  0x04
 #define ECON2       0x1E
+#define VRPS    0x08
+#define PWRSV   0x20
 #define PKTDEC  0x40
 #define ECON1       0x1F
 #define RXEN    0x04
 #define TXRTS   0x08
+#define CSUMEN  0x10
+#define DMAST   0x20
+#define EHT0        0x20
+#define EPMM0       0x28
+#define EPMCSL      0x30
+#define EPMCSH      0x31
+#define EPMOL       0x34
+#define EPMOH       0x35
 #define ERXFCON     0x38
 #define EPKTCNT     0x39
 #define MACON1      0x40
@@ -108,13 +148,85 @@
 #define MIBUSY  0x01
 #define ECOCON      0x75
 
+// Buffer memory layout
+// The tx ring takes ETHER_TX_SLOTS slots at the top of the 8K buffer and the rx
+// buffer takes the rest; a slot holds the control byte, a full 1518-byte frame
+// and the 7-byte tx status vector
+#ifndef ETHER_TX_SLOTS
+#define ETHER_TX_SLOTS  2
+#endif
+#define TX_SLOT_SIZE    0x0600
+#define BUFFER_SIZE     0x2000
+#define RX_BUFFER_START 0x0000
+#define TX_BUFFER_START (BUFFER_SIZE - ETHER_TX_SLOTS * TX_SLOT_SIZE)
+#define RX_BUFFER_END   (TX_BUFFER_START - 1)
+
+// ARP cache
+// Entries are aged against the timer uptime; frames to unresolved hosts wait
+// in a small queue until the reply arrives or the retries run out
+// Queued frames hold a reference to a pool buffer, so a frame that is
+// already in the pool is queued without a copy
+#define ARP_CACHE_SIZE       8
+#define ARP_ENTRY_TIMEOUT    300
+#define ARP_RETRY_TIMEOUT    1
+#define ARP_RETRIES          3
+#define ARP_QUEUE_SIZE       2
+
+#define ARP_FREE     0
+#define ARP_PENDING  1
+#define ARP_RESOLVED 2
+
+// TCP connections
+#define TCP_RECEIVE_WINDOW  1024
+#define TCP_MSS              512
+#define TCP_DEFAULT_MSS      536
+#define TCP_MIN_MSS           64
+#define TCP_SEND_BUFFER_SIZE 1536
+#define TCP_INITIAL_RTO      1000
+#define TCP_MIN_RTO          200
+#define TCP_MAX_RTO          60000
+#define TCP_MAX_RETRIES      6
+
+// UDP port table
+// Open addressed on a hash of the port, so finding the owner of a datagram
+// looks at one slot in the usual case; must be a power of 2
+#define UDP_PORT_TABLE_SIZE 8
+#define UDP_MAX_PAYLOAD     512
+
+// DHCP options
+#define DHCP_MAGIC_COOKIE        0x63825363
+#define DHCP_OPTION_PAD          0
+#define DHCP_OPTION_SUBNET_MASK  1
+#define DHCP_OPTION_ROUTER       3
+#define DHCP_OPTION_DNS          6
+#define DHCP_OPTION_REQUESTED_IP 50
+#define DHCP_OPTION_LEASE_TIME   51
+#define DHCP_OPTION_MESSAGE_TYPE 53
+#define DHCP_OPTION_SERVER_ID    54
+#define DHCP_OPTION_PARAMETERS   55
+#define DHCP_OPTION_CLIENT_ID    61
+#define DHCP_OPTION_END          255
+
+// dhcpOptions.present
+#define DHCP_HAS_TYPE   0x01
+#define DHCP_HAS_SUBNET 0x02
+#define DHCP_HAS_ROUTER 0x04
+#define DHCP_HAS_DNS    0x08
+#define DHCP_HAS_SERVER 0x10
+#define DHCP_HAS_LEASE  0x20
+
 // Ether phy registers
 #define PHCON1      0x00
 #define PDPXMD 0x0100
 #define PHSTAT1     0x01
-#define LSTAT  0x0400
 #define PHCON2      0x10
 #define HDLDIS 0x0100
+#define PHSTAT2     0x11
+#define LSTAT  0x0400
+#define PHIE        0x12
+#define PGEIE  0x0002
+#define PLNKIE 0x0010
+#define PHIR        0x13
 #define PHLCON      0x14
 
 // ------------------------------------------------------------------------------
@@ -175,6 +287,54 @@ typedef struct _arpFrame {
 	uint8_t destIp[4];
 } arpFrame;
 
+typedef struct _arpEntry {
+	uint8_t state;
+	uint8_t retries;
+	uint8_t ip[4];
+	uint8_t mac[6];
+	uint32_t expires;
+} arpEntry;
+
+typedef struct _arpQueueEntry {
+	uint16_t size;
+	uint8_t nextHop[4];
+	uint8_t* frame;
+} arpQueueEntry;
+
+// Port 0 marks a slot that has never been used; an unbound slot keeps its
+// port (with no handler) so that lookups still probe past it
+typedef struct _udpBinding {
+	uint16_t port;
+	_udpHandler handler;
+} udpBinding;
+
+typedef struct _tcpControlBlock {
+	uint8_t state;
+	uint8_t remoteIp[4];
+	uint16_t remotePort;
+	uint16_t localPort;
+	uint32_t sndUna;
+	uint32_t sndNxt;
+	uint32_t rcvNxt;
+	uint16_t sndWnd;
+	uint16_t mss;
+	bool finSent;
+	bool ackPending;
+	// retransmission, times in ms
+	uint8_t retries;
+	bool rttTiming;
+	uint32_t rttSequence;
+	uint32_t rttStart;
+	int32_t srtt8;
+	int32_t rttvar4;
+	uint32_t rto;
+	uint32_t rtoDeadline;
+	// data from sndUna on, kept until acknowledged
+	uint16_t sendStart;
+	uint16_t sendLength;
+	uint8_t sendBuffer[TCP_SEND_BUFFER_SIZE];
+} tcpControlBlock;
+
 typedef struct _udpFrame // 8 bytes
 {
 	uint16_t sourcePort;
@@ -216,17 +376,94 @@ typedef struct _dhcpFrame {
 	uint8_t options[0];
 } dhcpFrame;
 
+// The DHCP options we use, parsed in one pass over the message
+typedef struct _dhcpOptions {
+	uint8_t present;
+	uint8_t messageType;
+	uint8_t subnetMask[4];
+	uint8_t router[4];
+	uint8_t dns[4];
+	uint8_t serverId[4];
+	uint32_t leaseTime;
+} dhcpOptions;
+
+typedef struct _dhcpOptionField {
+	uint8_t number;
+	uint8_t size;
+	uint8_t flag;
+	uint8_t offset;
+} dhcpOptionField;
+
 // ------------------------------------------------------------------------------
 //  Globals
 // ------------------------------------------------------------------------------
 
 uint8_t nextPacketLsb = 0x00;
 uint8_t nextPacketMsb = 0x00;
+uint16_t rxPacketStart = RX_BUFFER_START;
+uint16_t rxPacketSize = 0;
 uint8_t sequenceId = 1;
-uint32_t sum;
+
+uint32_t etherSpiClock = ETHER_SPI_CLOCK_SAFE;
+
+bool etherInterruptMode = false;
+bool etherHwChecksum = false;
+volatile bool etherIntPending = false;
+uint8_t etherLatchedEvents = 0;
+
+// Bank selected in ECON1, so that etherSetBank can skip rewriting it
+// 0xFF until the first selection
+uint8_t etherBank = 0xFF;
+
+// Link state, refreshed only when the PHY reports a change
+bool etherLinkUp = false;
+
+// Copy of EHT0-EHT7, so hash bits can be added without reading them back
+uint8_t etherHashTable[8];
+uint16_t etherFilters = 0;
+// Sends fail from etherPowerDown until a LINKIF reports the link back after
+// etherPowerUp
+bool etherTxHeld = false;
+
+// Last value written to each bank 0 pointer pair (ERDPT to EDMADST, indexed
+// by address / 2), so that etherWritePointer can skip bytes already in place
+// ERDPT and EWRPT also move as buffer memory is read and written, so those
+// shadows are advanced along with each transfer
+uint16_t etherPointers[11];
+uint16_t etherPointerValid = 0;
+
+// tx ring: txCount frames are queued from slot txHead, and the frame in
+// txHead is on the wire whenever txCount is non-zero
+uint16_t txSlotSize[ETHER_TX_SLOTS];
+uint8_t txHead = 0;
+uint8_t txCount = 0;
+bool txLastOk = true;
 
 extern bool dhcpEnabled = false;
 
+// Options kept by etherParseDhcpOptions; only the first address of the
+// router and DNS lists is used
+const dhcpOptionField dhcpOptionFields[] = {
+	{ DHCP_OPTION_MESSAGE_TYPE, 1, DHCP_HAS_TYPE,   offsetof(dhcpOptions, messageType) },
+	{ DHCP_OPTION_SUBNET_MASK,  4, DHCP_HAS_SUBNET, offsetof(dhcpOptions, subnetMask) },
+	{ DHCP_OPTION_ROUTER,       4, DHCP_HAS_ROUTER, offsetof(dhcpOptions, router) },
+	{ DHCP_OPTION_DNS,          4, DHCP_HAS_DNS,    offsetof(dhcpOptions, dns) },
+	{ DHCP_OPTION_SERVER_ID,    4, DHCP_HAS_SERVER, offsetof(dhcpOptions, serverId) },
+	{ DHCP_OPTION_LEASE_TIME,   4, DHCP_HAS_LEASE,  offsetof(dhcpOptions, leaseTime) }
+};
+#define DHCP_OPTION_FIELDS (sizeof(dhcpOptionFields) / sizeof(dhcpOptionField))
+
+// Parameter request list (subnet mask, time offset, router, DNS, lease time)
+const uint8_t dhcpParameters[] = { 1, 2, 3, 6, 51 };
+
+arpEntry arpCache[ARP_CACHE_SIZE];
+arpQueueEntry arpQueue[ARP_QUEUE_SIZE];
+
+udpBinding udpPorts[UDP_PORT_TABLE_SIZE];
+
+tcpControlBlock tcpConnections[TCP_MAX_CONNECTIONS];
+uint16_t tcpIsnCount = 0;
+
 uint8_t macAddress[HW_ADD_LENGTH] = { 2, 3, 4, 5, 6, 136 };
 uint8_t ipAddress[IP_ADD_LENGTH] = { 0, 0, 0, 0 };
 uint8_t tempIpAddress[IP_ADD_LENGTH] = { 0, 0, 0, 0 };
@@ -242,8 +479,15 @@ uint8_t serverMacAddress[HW_ADD_LENGTH] = { 0, 0, 0, 0, 0, 0 };
 //-----------------------------------------------------------------------------
 
 // Buffer is configured as follows
-// Receive buffer starts at 0x0000 (bottom 6666 bytes of 8K space)
-// Transmit buffer at 01A0A (top 1526 bytes of 8K space)
+// Receive buffer starts at 0x0000 (bottom of 8K space, up to RX_BUFFER_END)
+// Transmit ring at TX_BUFFER_START (top ETHER_TX_SLOTS * 1536 bytes of 8K space)
+
+// Wraps an address that has run past the end of the receive buffer
+uint16_t etherRxWrap(uint16_t address) {
+	if (address > RX_BUFFER_END)
+		address -= RX_BUFFER_END - RX_BUFFER_START + 1;
+	return address;
+}
 
 void etherCsOn() {
 	setPinValue(CS, 0);
@@ -297,8 +541,36 @@ void etherClearReg(uint8_t reg, uint8_t mask) {
 }
 
 void etherSetBank(uint8_t reg) {
+	uint8_t bank = (reg >> 5) & 0x03;
+	if (bank == etherBank)
+		return;
 	etherClearReg(ECON1, 0x03);
-	etherSetReg(ECON1, reg >> 5);
+	etherSetReg(ECON1, bank);
+	etherBank = bank;
+}
+
+// Records the value a pointer pair holds without writing it
+void etherTrackPointer(uint8_t reg, uint16_t value) {
+	uint8_t index = (reg & 0x1F) >> 1;
+	etherPointers[index] = value;
+	etherPointerValid |= 1 << index;
+}
+
+// Writes a 16-bit pointer pair (reg is the low byte), skipping any byte that
+// already holds its new value, so a pointer that moves within a 256-byte
+// page costs one chip-select cycle instead of two
+// ERXRDPTL only takes effect once ERXRDPTH is written, so that one always
+// writes its high byte after a low byte change
+void etherWritePointer(uint8_t reg, uint16_t value) {
+	uint8_t index = (reg & 0x1F) >> 1;
+	bool valid = (etherPointerValid & (1 << index)) != 0;
+	bool low = !valid || LOBYTE(etherPointers[index]) != LOBYTE(value);
+	etherSetBank(reg);
+	if (low)
+		etherWriteReg(reg, LOBYTE(value));
+	if (!valid || HIBYTE(etherPointers[index]) != HIBYTE(value) || (low && reg == ERXRDPTL))
+		etherWriteReg(reg + 1, HIBYTE(value));
+	etherTrackPointer(reg, value);
 }
 
 void etherWritePhy(uint8_t reg, uint16_t data) {
@@ -336,6 +608,11 @@ void etherWriteMem(uint8_t data) {
 	readSpi0Data();
 }
 
+// Writes a block to buffer memory (uses the uDMA on long blocks)
+void etherWriteMemBuffer(uint8_t data[], uint16_t size) {
+	writeSpi0Buffer(data, size);
+}
+
 void etherWriteMemStop() {
 	etherCsOff();
 }
@@ -351,17 +628,59 @@ uint8_t etherReadMem() {
 	return readSpi0Data();
 }
 
+// Reads a block from buffer memory (uses the uDMA on long blocks)
+void etherReadMemBuffer(uint8_t data[], uint16_t size) {
+	readSpi0Buffer(data, size);
+}
+
 void etherReadMemStop() {
 	etherCsOff();
 }
 
+// Verifies the SPI link by writing and reading back patterns in ETXSTL
+// ETXSTL is rewritten before each transmission, so this has no side effects
+bool etherTestSpi() {
+	const uint8_t pattern[] = { 0x55, 0xAA, 0x00, 0xFF };
+	uint8_t i;
+	etherSetBank(ETXSTL);
+	for (i = 0; i < sizeof(pattern); i++) {
+		etherWriteReg(ETXSTL, pattern[i]);
+		if (etherReadReg(ETXSTL) != pattern[i])
+			return false;
+	}
+	return true;
+}
+
+// Selects the fastest SPI clock that passes the read-back test
+void etherSelectSpiClock() {
+	uint32_t clock = ETHER_SPI_CLOCK;
+	bool ok = false;
+	while (!ok && clock > ETHER_SPI_CLOCK_SAFE) {
+		setSpi0BaudRate(clock, 40e6);
+		ok = etherTestSpi();
+		if (!ok)
+			clock /= 2;
+	}
+	if (!ok) {
+		clock = ETHER_SPI_CLOCK_SAFE;
+		setSpi0BaudRate(clock, 40e6);
+	}
+	etherSpiClock = clock;
+}
+
+// Returns the SPI clock selected at initialization
+uint32_t etherGetSpiClock() {
+	return etherSpiClock;
+}
+
 // Initializes ethernet device
 // Uses order suggested in Chapter 6 of datasheet except 6.4 OST which is first here
 void etherInit(uint16_t mode) {
 	// Initialize SPI0
 	initSpi0(USE_SSI0_RX);
-	setSpi0BaudRate(4e6, 40e6);
+	setSpi0BaudRate(ETHER_SPI_CLOCK_SAFE, 40e6);
 	setSpi0Mode(0, 0);
+	initSpi0Dma();
 
 	// Enable clocks
 	enablePort(PORTA);
@@ -373,34 +692,41 @@ void etherInit(uint16_t mode) {
 	selectPinDigitalInput(WOL);
 	selectPinDigitalInput(INT);
 
+	// the controller may have been left in any bank by an earlier run
+	etherBank = 0xFF;
+
 	// make sure that oscillator start-up timer has expired
 	while ((etherReadReg(ESTAT) & CLKRDY) == 0) {
 	}
 
+	// raise the SPI clock once the controller is running
+	etherSelectSpiClock();
+
 	// disable transmission and reception of packets
 	etherClearReg(ECON1, RXEN);
 	etherClearReg(ECON1, TXRTS);
 
+	// the clock test wrote ETXSTL, and nothing else is known about the pointers
+	etherPointerValid = 0;
+
 	// initialize receive buffer space
 	etherSetBank(ERXSTL);
-	etherWriteReg(ERXSTL, LOBYTE(0x0000));
-	etherWriteReg(ERXSTH, HIBYTE(0x0000));
-	etherWriteReg(ERXNDL, LOBYTE(0x1A09));
-	etherWriteReg(ERXNDH, HIBYTE(0x1A09));
+	etherWriteReg(ERXSTL, LOBYTE(RX_BUFFER_START));
+	etherWriteReg(ERXSTH, HIBYTE(RX_BUFFER_START));
+	etherWriteReg(ERXNDL, LOBYTE(RX_BUFFER_END));
+	etherWriteReg(ERXNDH, HIBYTE(RX_BUFFER_END));
 
 	// initialize receiver write and read ptrs
-	// at startup, will write from 0 to 1A08 only and will not overwrite rd ptr
-	etherWriteReg(ERXWRPTL, LOBYTE(0x0000));
-	etherWriteReg(ERXWRPTH, HIBYTE(0x0000));
-	etherWriteReg(ERXRDPTL, LOBYTE(0x1A09));
-	etherWriteReg(ERXRDPTH, HIBYTE(0x1A09));
-	etherWriteReg(ERDPTL, LOBYTE(0x0000));
-	etherWriteReg(ERDPTH, HIBYTE(0x0000));
-
-	// setup receive filter
-	// always check CRC, use OR mode
-	etherSetBank(ERXFCON);
-	etherWriteReg(ERXFCON, (mode | ETHER_CHECKCRC) & 0xFF);
+	// at startup, will write up to RX_BUFFER_END - 1 only and will not overwrite rd ptr
+	etherWriteReg(ERXWRPTL, LOBYTE(RX_BUFFER_START));
+	etherWriteReg(ERXWRPTH, HIBYTE(RX_BUFFER_START));
+	etherWritePointer(ERXRDPTL, RX_BUFFER_END);
+	etherWritePointer(ERDPTL, RX_BUFFER_START);
+	rxPacketStart = RX_BUFFER_START;
+
+	// setup receive filter, with no multicast groups until some are added
+	etherClearMulticastHash();
+	etherSetReceiveFilters(mode);
 
 	// bring mac out of reset
 	etherSetBank(MACON2);
@@ -456,12 +782,35 @@ void etherInit(uint16_t mode) {
 	// set LEDA (link status) and LEDB (tx/rx activity)
 	// stretch LED on to 40ms (default)
 	etherWritePhy(PHLCON, 0x0472);
+
+	// report link changes through LINKIF, and start from the current link state
+	etherWritePhy(PHIE, PGEIE | PLNKIE);
+	etherReadPhy(PHIR);
+	etherLinkUp = (etherReadPhy(PHSTAT2) & LSTAT) != 0;
 	// enable reception
 	etherSetReg(ECON1, RXEN);
 
-	// Read DHCP state from EPROM
-	uint32_t tmp = readEeprom(0);
-	dhcpEnabled = tmp > 0;
+	// tx ring is empty
+	txHead = 0;
+	txCount = 0;
+	txLastOk = true;
+	etherLatchedEvents = 0;
+
+	// use the controller DMA engine to checksum and copy large payloads if requested
+	etherHwChecksum = (mode & ETHER_HWCHECKSUM) != 0;
+
+	// route rx, rx error and tx complete events to INT (active low) if requested
+	etherInterruptMode = (mode & ETHER_INTERRUPT) != 0;
+	if (etherInterruptMode) {
+		etherWriteReg(EIE, INTIE | PKTIE | LINKIE | TXIE | RXERIE);
+		selectPinInterruptFallingEdge(INT);
+		clearPinInterrupt(INT);
+		enablePinInterrupt(INT);
+		NVIC_EN0_R |= 1 << (INT_GPIOC - 16);         // turn-on interrupt 18 (GPIOC)
+	}
+
+	// Read DHCP state from the saved configuration
+	dhcpEnabled = getConfigDhcpMode();
 
 	if (!dhcpEnabled) {
 		getDetailsFromEprom();
@@ -469,15 +818,152 @@ void etherInit(uint16_t mode) {
 }
 
 // Returns true if link is up
-bool etherIsLinkUp() {
-	return (etherReadPhy(PHSTAT1) & LSTAT) != 0;
+// The state is cached from the last link change, so no PHY access is needed
+bool etherEncIsLinkUp() {
+	return etherLinkUp;
 }
 
 // Returns TRUE if packet received
+// In interrupt mode, EIR is not read unless INT is asserted
 bool etherIsDataAvailable() {
+	if (etherInterruptMode && getPinValue(INT))
+		return false;
 	return ((etherReadReg(EIR) & PKTIF) != 0);
 }
 
+// Returns the number of received packets waiting in the rx buffer
+uint8_t etherEncGetPacketCount() {
+	etherSetBank(EPKTCNT);
+	return etherReadReg(EPKTCNT);
+}
+
+// Returns true once the unread part of the rx buffer passes ETHER_RX_HIGH_WATER
+// percent of it; only valid between packets
+bool etherEncIsRxCongested() {
+	uint16_t write, used;
+	etherSetBank(ERXWRPTL);
+	write = etherReadReg(ERXWRPTL);
+	write |= etherReadReg(ERXWRPTH) << 8;
+	if (write >= rxPacketStart)
+		used = write - rxPacketStart;
+	else
+		used = write + (RX_BUFFER_END - RX_BUFFER_START + 1) - rxPacketStart;
+	return used > (uint32_t) (RX_BUFFER_END - RX_BUFFER_START + 1) * ETHER_RX_HIGH_WATER / 100;
+}
+
+// Clears out any tx errors before a transmit buffer is reused
+void etherClearTxError() {
+	if ((etherReadReg(EIR) & TXERIF) != 0) {
+		etherClearReg(EIR, TXERIF);
+		etherSetReg(ECON1, TXRTS);
+		etherClearReg(ECON1, TXRTS);
+	}
+}
+
+// Returns the buffer memory address of a tx slot
+uint16_t etherTxSlotAddress(uint8_t slot) {
+	return TX_BUFFER_START + slot * TX_SLOT_SIZE;
+}
+
+// Returns the next free tx slot
+// Only valid while etherIsTxReady() is true
+uint8_t etherTxFreeSlot() {
+	return (txHead + txCount) % ETHER_TX_SLOTS;
+}
+
+// Writes the control byte and the first size bytes of a frame to a tx slot
+void etherWriteTxBuffer(uint8_t slot, uint8_t packet[], uint16_t size) {
+	uint16_t address = etherTxSlotAddress(slot);
+
+	// set DMA start address
+	etherWritePointer(EWRPTL, address);
+
+	// start FIFO buffer write
+	etherWriteMemStart();
+
+	// write control byte
+	etherWriteMem(0);
+
+	// write data
+	etherWriteMemBuffer(packet, size);
+
+	// stop write
+	etherWriteMemStop();
+	etherTrackPointer(EWRPTL, address + 1 + size);
+}
+
+// Requests transmission of the frame in the txHead slot
+void etherStartTx() {
+	uint16_t address = etherTxSlotAddress(txHead);
+	etherClearTxError();
+	etherWritePointer(ETXSTL, address);
+	etherWritePointer(ETXNDL, address + txSlotSize[txHead]);
+	etherClearReg(EIR, TXIF);
+	etherSetReg(ECON1, TXRTS);
+}
+
+// Retires the frame on the wire once TXIF is seen and starts the next one
+void etherTxComplete() {
+	txLastOk = (etherReadReg(ESTAT) & TXABORT) == 0;
+	if (!txLastOk)
+		countStat(STAT_TX_ABORTS);
+	txHead = (txHead + 1) % ETHER_TX_SLOTS;
+	txCount--;
+	if (txCount > 0)
+		etherStartTx();
+}
+
+// INT falling edge handler
+// Only latches and posts the event, since SPI may be in use by the main loop
+void etherIsr() {
+	etherIntPending = true;
+	clearPinInterrupt(INT);
+	postEvent(EVENT_ETHER);
+}
+
+// Returns true if the controller may have events to report, without any SPI access
+// INT stays low while any enabled flag is set, so the pin level is checked as well
+// Always true in polled mode
+bool etherEncIsEventPending() {
+	if (!etherInterruptMode)
+		return true;
+	return etherIntPending || !getPinValue(INT);
+}
+
+// Reads and clears the PKTIF, RXERIF, TXIF and LINKIF flags into the latched events
+// A TXIF retires the frame on the wire and starts the next queued one
+// A LINKIF refreshes the cached link state (reading PHIR clears it)
+void etherLatchEvents() {
+	uint8_t events;
+	etherIntPending = false;
+	events = etherReadReg(EIR) & (PKTIF | LINKIF | TXIF | RXERIF);
+	if ((events & (TXIF | RXERIF)) != 0)
+		etherClearReg(EIR, events & (TXIF | RXERIF));
+	if ((events & LINKIF) != 0) {
+		etherReadPhy(PHIR);
+		etherLinkUp = (etherReadPhy(PHSTAT2) & LSTAT) != 0;
+		if (etherLinkUp)
+			etherTxHeld = false;
+	}
+	if ((events & TXIF) != 0 && txCount > 0) {
+		etherTxComplete();
+		postEvent(EVENT_ETHER_TX);
+	}
+	etherLatchedEvents |= events;
+}
+
+// Returns the pending PKTIF, RXERIF, TXIF and LINKIF events
+// RXERIF, TXIF and LINKIF are cleared here so that INT is released;
+// PKTIF clears itself once all packets have been read
+uint8_t etherEncGetEvents() {
+	uint8_t events;
+	if (etherEncIsEventPending())
+		etherLatchEvents();
+	events = etherLatchedEvents;
+	etherLatchedEvents = 0;
+	return events;
+}
+
 // Returns true if rx buffer overflowed after correcting the problem
 bool etherIsOverflow() {
 	bool err;
@@ -487,11 +973,99 @@ bool etherIsOverflow() {
 	return err;
 }
 
-// Returns up to max_size characters in data buffer
-// Returns number of bytes copied to buffer
-// Contents written are 16-bit size, 16-bit status, payload excl crc
-uint16_t etherGetPacket(uint8_t packet[], uint16_t maxSize) {
-	uint16_t i = 0, size, tmp16, status;
+// Hardware receive filters
+// The controller accepts a frame if any enabled filter accepts it (OR mode),
+// so frames nobody wants never reach the rx buffer, SPI or the classifier
+
+// Enables the ETHER_UNICAST, ETHER_BROADCAST, ETHER_MULTICAST, ETHER_HASHTABLE,
+// ETHER_MAGICPACKET and ETHER_PATTERNMATCH filters given in mode
+// The CRC is always checked
+void etherSetReceiveFilters(uint16_t mode) {
+	etherFilters = mode;
+	etherSetBank(ERXFCON);
+	etherWriteReg(ERXFCON, (mode | ETHER_CHECKCRC) & 0xFF);
+}
+
+// Accepts only Magic Packets for our address, so the board is woken by
+// nothing else; the filters are put back by etherExitWakeOnLan
+// The ENC28J60 has no working WOL output, so the wake-up comes on INT
+void etherEnterWakeOnLan() {
+	etherSetBank(ERXFCON);
+	etherWriteReg(ERXFCON, ETHER_MAGICPACKET | ETHER_CHECKCRC);
+}
+
+void etherExitWakeOnLan() {
+	etherSetReceiveFilters(etherFilters);
+}
+
+// Returns the hash table bit (0-63) that a destination address maps to:
+// bits 28:23 of its Ethernet CRC
+uint8_t etherHashAddress(const uint8_t mac[6]) {
+	uint32_t crc = 0xFFFFFFFF;
+	uint8_t i, bit;
+	for (i = 0; i < HW_ADD_LENGTH; i++) {
+		for (bit = 0; bit < 8; bit++) {
+			if (((crc >> 31) ^ (mac[i] >> bit)) & 1)
+				crc = (crc << 1) ^ 0x04C11DB7;
+			else
+				crc <<= 1;
+		}
+	}
+	return (crc >> 23) & 0x3F;
+}
+
+// Writes the copy of the hash table to EHT0-EHT7
+void etherWriteHashTable() {
+	uint8_t i;
+	etherSetBank(EHT0);
+	for (i = 0; i < 8; i++)
+		etherWriteReg(EHT0 + i, etherHashTable[i]);
+}
+
+// Stops the hash table filter from accepting any address
+void etherClearMulticastHash() {
+	memset(etherHashTable, 0, sizeof(etherHashTable));
+	etherWriteHashTable();
+}
+
+// Lets the hash table filter (ETHER_HASHTABLE) accept frames sent to mac
+// Other addresses that share its hash are accepted too
+void etherAddMulticastAddress(const uint8_t mac[6]) {
+	uint8_t bit = etherHashAddress(mac);
+	etherHashTable[bit >> 3] |= 1 << (bit & 7);
+	etherSetBank(EHT0);
+	etherWriteReg(EHT0 + (bit >> 3), etherHashTable[bit >> 3]);
+}
+
+// Sets up the pattern match filter (ETHER_PATTERNMATCH)
+// A frame matches when the bytes selected by mask (bit n of mask[n / 8] for
+// byte n) in the 64 bytes from offset are the same as those in pattern; the
+// controller compares them by checksum, so unrelated frames very rarely match
+void etherSetPatternMatch(uint16_t offset, const uint8_t pattern[64], const uint8_t mask[8]) {
+	uint8_t selected[64];
+	uint8_t i, count = 0;
+	uint16_t check;
+	for (i = 0; i < 64; i++)
+		if (mask[i >> 3] & (1 << (i & 7)))
+			selected[count++] = pattern[i];
+	check = checksumFinish(checksumAdd(0, selected, count));
+
+	etherSetBank(EPMM0);
+	for (i = 0; i < 8; i++)
+		etherWriteReg(EPMM0 + i, mask[i]);
+	// the checksum is in memory order, so its first byte is the high one
+	etherWriteReg(EPMCSH, check & 0xFF);
+	etherWriteReg(EPMCSL, check >> 8);
+	etherWriteReg(EPMOL, LOBYTE(offset));
+	etherWriteReg(EPMOH, HIBYTE(offset));
+}
+
+// Reads the header of the next packet and up to peekSize bytes of its frame
+// The packet stays in the receive buffer until etherDiscardPacket is called,
+// so the rest of the frame can be read later with etherReadPacket (or never)
+// Returns the full frame size
+uint16_t etherEncPeekPacket(uint8_t packet[], uint16_t peekSize) {
+	uint16_t size, tmp16, status;
 
 	// enable read from FIFO buffers
 	etherReadMemStart();
@@ -511,106 +1085,299 @@ uint16_t etherGetPacket(uint8_t packet[], uint16_t maxSize) {
 	tmp16 = etherReadMem();
 	status |= (tmp16 << 8);
 
+	// frame starts after the 6-byte header, wrapping at the end of the rx buffer
+	rxPacketStart = etherRxWrap(rxPacketStart + 6);
+	rxPacketSize = size;
+
 	// copy data
-	if (size > maxSize)
-		size = maxSize;
-	while (i < size)
-		packet[i++] = etherReadMem();
+	if (peekSize > size)
+		peekSize = size;
+	etherReadMemBuffer(packet, peekSize);
 
 	// end read from FIFO buffers
 	etherReadMemStop();
+	etherTrackPointer(ERDPTL, etherRxWrap(rxPacketStart + peekSize));
+
+	return size;
+}
+
+// Reads size bytes of the current packet frame starting at offset
+// Returns number of bytes copied to buffer
+uint16_t etherEncReadPacket(uint8_t data[], uint16_t offset, uint16_t size) {
+	uint16_t address;
+	if (offset >= rxPacketSize)
+		return 0;
+	if (size > rxPacketSize - offset)
+		size = rxPacketSize - offset;
+	address = etherRxWrap(rxPacketStart + offset);
+
+	etherWritePointer(ERDPTL, address);
+	etherReadMemStart();
+	etherReadMemBuffer(data, size);
+	etherReadMemStop();
+	etherTrackPointer(ERDPTL, etherRxWrap(address + size));
+	return size;
+}
 
+// Frees the current packet by advancing the read pointers to the next packet
+void etherEncDiscardPacket() {
 	// advance read pointer
-	etherSetBank(ERXRDPTL);
-	etherWriteReg(ERXRDPTL, nextPacketLsb); // hw ptr
-	etherWriteReg(ERXRDPTH, nextPacketMsb);
-	etherWriteReg(ERDPTL, nextPacketLsb);   // dma rd ptr
-	etherWriteReg(ERDPTH, nextPacketMsb);
+	rxPacketStart = (nextPacketMsb << 8) | nextPacketLsb;
+	etherWritePointer(ERXRDPTL, rxPacketStart); // hw ptr
+	etherWritePointer(ERDPTL, rxPacketStart);   // dma rd ptr
+	rxPacketSize = 0;
 
 	// decrement packet counter so that PKTIF is maintained correctly
 	etherSetReg(ECON2, PKTDEC);
+}
 
+// Returns up to max_size characters in data buffer
+// Returns number of bytes copied to buffer
+// Contents written are 16-bit size, 16-bit status, payload excl crc
+uint16_t etherGetPacket(uint8_t packet[], uint16_t maxSize) {
+	uint16_t size;
+	size = etherPeekPacket(packet, maxSize);
+	etherDiscardPacket();
+	if (size > maxSize)
+		size = maxSize;
 	return size;
 }
 
-// Writes a packet
-bool etherPutPacket(uint8_t packet[], uint16_t size) {
-	uint16_t i;
+// Reads back up to size bytes of the frame most recently written to the tx ring
+// Lets the buffer memory read path be timed and checked without any traffic
+// Returns number of bytes copied to buffer
+uint16_t etherReadTxPacket(uint8_t packet[], uint16_t size) {
+	uint8_t slot = (txHead + txCount + ETHER_TX_SLOTS - 1) % ETHER_TX_SLOTS;
+	uint16_t address = etherTxSlotAddress(slot) + 1;
+	if (size > txSlotSize[slot])
+		size = txSlotSize[slot];
 
-	// clear out any tx errors
-	if ((etherReadReg(EIR) & TXERIF) != 0) {
-		etherClearReg(EIR, TXERIF);
-		etherSetReg(ECON1, TXRTS);
-		etherClearReg(ECON1, TXRTS);
-	}
+	etherWritePointer(ERDPTL, address);
+	etherReadMemStart();
+	etherReadMemBuffer(packet, size);
+	etherReadMemStop();
+	etherTrackPointer(ERDPTL, address + size);
 
-	// set DMA start address
-	etherSetBank(EWRPTL);
-	etherWriteReg(EWRPTL, LOBYTE(0x1A0A));
-	etherWriteReg(EWRPTH, HIBYTE(0x1A0A));
+	// etherPeekPacket reads the next packet from wherever ERDPT was left
+	if (rxPacketSize == 0)
+		etherWritePointer(ERDPTL, rxPacketStart);
+	return size;
+}
 
-	// start FIFO buffer write
-	etherWriteMemStart();
+// Queues the frame of size bytes written to slot, starting it if the wire is idle
+void etherQueueTx(uint8_t slot, uint16_t size) {
+	txSlotSize[slot] = size;
+	txCount++;
+	if (txCount == 1)
+		etherStartTx();
+}
 
-	// write control byte
-	etherWriteMem(0);
+// Returns true if a tx slot is free, so that etherSendPacket will not fail
+bool etherEncIsTxReady() {
+	if (txCount == ETHER_TX_SLOTS && etherEncIsEventPending())
+		etherLatchEvents();
+	return txCount < ETHER_TX_SLOTS;
+}
 
-	// write data
-	for (i = 0; i < size; i++)
-		etherWriteMem(packet[i]);
+// Returns true once every queued frame has left the wire
+bool etherEncIsTxIdle() {
+	if (txCount > 0 && etherEncIsEventPending())
+		etherLatchEvents();
+	return txCount == 0;
+}
 
-	// stop write
-	etherWriteMemStop();
+// Returns false if the most recently completed frame was aborted
+bool etherWasTxOk() {
+	return txLastOk;
+}
 
-	// request transmit
-	etherWriteReg(ETXSTL, LOBYTE(0x1A0A));
-	etherWriteReg(ETXSTH, HIBYTE(0x1A0A));
-	etherWriteReg(ETXNDL, LOBYTE(0x1A0A + size));
-	etherWriteReg(ETXNDH, HIBYTE(0x1A0A + size));
-	etherClearReg(EIR, TXIF);
-	etherSetReg(ECON1, TXRTS);
+// Queues a packet without waiting
+// Returns false if all tx slots are still in use
+// The packet buffer may be reused as soon as this returns
+bool etherEncSendPacket(uint8_t packet[], uint16_t size) {
+	uint8_t slot;
+	uint32_t start = getCycles();
+	if (!etherEncIsTxReady() || etherTxHeld)
+		return false;
+	slot = etherTxFreeSlot();
+	etherWriteTxBuffer(slot, packet, size);
+	etherQueueTx(slot, size);
+	countStat(STAT_TX_FRAMES);
+	recordCycles(STAGE_TX, start);
+	return true;
+}
 
-	// wait for completion
-	while ((etherReadReg(ECON1) & TXRTS) != 0)
+// Stops the receiver once the frame being received is in and puts the
+// controller in power save; frames are neither received nor sent (sends
+// fail) until etherPowerUp
+void etherPowerDown() {
+	while (!etherEncIsTxIdle())
+		;
+	etherClearReg(ECON1, RXEN);
+	while ((etherReadReg(ESTAT) & RXBUSY) != 0)
+		;
+	etherSetReg(ECON2, VRPS);
+	etherSetReg(ECON2, PWRSV);
+	etherTxHeld = true;
+}
+
+// Leaves power save and restarts the receiver once the oscillator is stable
+// The PHY takes a while to get the link back, so this does not wait for it:
+// sends stay held until the LINKIF that reports the link up, which also
+// reaches main as ETHER_EVENT_LINK
+void etherPowerUp() {
+	etherClearReg(ECON2, PWRSV);
+	while ((etherReadReg(ESTAT) & CLKRDY) == 0)
 		;
+	etherLinkUp = (etherReadPhy(PHSTAT2) & LSTAT) != 0;
+	etherTxHeld = !etherLinkUp;
+	etherSetReg(ECON1, RXEN);
+}
 
-	// determine success
-	return ((etherReadReg(ESTAT) & TXABORT) == 0);
+// Frame operations of the ENC28J60 for the protocol code
+const etherDriver enc28j60Driver = {
+	etherEncGetEvents,
+	etherEncIsEventPending,
+	etherEncGetPacketCount,
+	etherEncIsRxCongested,
+	etherEncPeekPacket,
+	etherEncReadPacket,
+	etherEncDiscardPacket,
+	etherEncIsTxReady,
+	etherEncIsTxIdle,
+	etherEncSendPacket,
+	etherEncIsLinkUp
+};
+
+const etherDriver* etherDriverOps = &enc28j60Driver;
+
+// Plugs a different frame backend in under the protocol code
+// The DMA offloads (in-buffer ping replies) are only used with the ENC28J60
+void etherSetDriver(const etherDriver* driver) {
+	etherDriverOps = driver;
+}
+
+// Returns the pending ETHER_EVENT_* flags
+uint8_t etherGetEvents() {
+	return etherDriverOps->getEvents();
+}
+
+// Returns true if the driver may have events to report, without touching the bus
+bool etherIsEventPending() {
+	return etherDriverOps->isEventPending();
+}
+
+// Returns the number of received packets waiting
+uint8_t etherGetPacketCount() {
+	return etherDriverOps->getPacketCount();
+}
+
+// Returns true if the rx buffer is filling faster than it is being read
+bool etherIsRxCongested() {
+	return etherDriverOps->isRxCongested();
+}
+
+// Reads the header of the next packet and up to peekSize bytes of its frame
+// Returns the full frame size
+uint16_t etherPeekPacket(uint8_t packet[], uint16_t peekSize) {
+	return etherDriverOps->peekPacket(packet, peekSize);
+}
+
+// Reads size bytes of the current packet frame starting at offset
+uint16_t etherReadPacket(uint8_t data[], uint16_t offset, uint16_t size) {
+	return etherDriverOps->readPacket(data, offset, size);
+}
+
+// Frees the current packet
+void etherDiscardPacket() {
+	etherDriverOps->discardPacket();
 }
 
-// Calculate sum of words
-// Must use getEtherChecksum to complete 1's compliment addition
-void etherSumWords(void* data, uint16_t sizeInBytes) {
-	uint8_t* pData = (uint8_t*) data;
-	uint16_t i;
-	uint8_t phase = 0;
-	uint16_t data_temp;
-	for (i = 0; i < sizeInBytes; i++) {
-		if (phase) {
-			data_temp = *pData;
-			sum += data_temp << 8;
-		} else sum += *pData;
-		phase = 1 - phase;
-		pData++;
+// Returns true if etherSendPacket will not fail
+bool etherIsTxReady() {
+	return etherDriverOps->isTxReady();
+}
+
+// Returns true once every queued frame has left the wire
+bool etherIsTxIdle() {
+	return etherDriverOps->isTxIdle();
+}
+
+// Queues a packet without waiting
+// Returns false if the driver has no room for it
+bool etherSendPacket(uint8_t packet[], uint16_t size) {
+	return etherDriverOps->sendPacket(packet, size);
+}
+
+// Returns true if link is up
+bool etherIsLinkUp() {
+	return etherDriverOps->isLinkUp();
+}
+
+// Queues a packet, waiting only while every tx slot is in use
+// Returns true once the frame is in a tx slot, not once it has been sent; it
+// is false only if the driver refuses it (power save, link not back yet)
+bool etherQueuePacket(uint8_t packet[], uint16_t size) {
+	while (!etherIsTxReady())
+		;
+	return etherSendPacket(packet, size);
+}
+
+// Starts a DMA copy or checksum over buffer memory start..end (inclusive) and
+// waits for it to complete
+// Reads inside the receive buffer wrap from ERXND to ERXST in hardware
+void etherRunDma(uint16_t start, uint16_t end, uint8_t mode) {
+	etherSetBank(EDMASTL);
+	etherWriteReg(EDMASTL, LOBYTE(start));
+	etherWriteReg(EDMASTH, HIBYTE(start));
+	etherWriteReg(EDMANDL, LOBYTE(end));
+	etherWriteReg(EDMANDH, HIBYTE(end));
+	etherSetReg(ECON1, mode | DMAST);
+	while ((etherReadReg(ECON1) & DMAST) != 0)
+		;
+	etherClearReg(ECON1, CSUMEN);
+}
+
+// Returns the checksum of buffer memory start..end calculated by the controller
+// The result is complemented and in memory order, like checksumFinish, so it
+// is 0 over a block that holds a valid checksum
+// Reception is paused around the calculation, after the frame being received
+// is in: ENC28J60 silicon errata (DS80349) item 15, a packet received while
+// the DMA runs in checksum mode can be corrupted or lost
+uint16_t etherDmaChecksum(uint16_t start, uint16_t end) {
+	bool receiving = (etherReadReg(ECON1) & RXEN) != 0;
+	uint16_t sum;
+	if (receiving) {
+		etherClearReg(ECON1, RXEN);
+		while ((etherReadReg(ESTAT) & RXBUSY) != 0)
+			;
 	}
+	etherRunDma(start, end, CSUMEN);
+	sum = etherReadReg(EDMACSH) | (etherReadReg(EDMACSL) << 8);
+	if (receiving)
+		etherSetReg(ECON1, RXEN);
+	return sum;
 }
 
-// Completes 1's compliment addition by folding carries back into field
-uint16_t getEtherChecksum() {
-	uint16_t result;
-	// this is based on rfc1071
-	while ((sum >> 16) > 0)
-		sum = (sum & 0xFFFF) + (sum >> 16);
-	result = sum & 0xFFFF;
-	return ~result;
+// Copies buffer memory start..end to dest with the controller DMA engine
+void etherDmaCopy(uint16_t start, uint16_t end, uint16_t dest) {
+	etherSetBank(EDMADSTL);
+	etherWriteReg(EDMADSTL, LOBYTE(dest));
+	etherWriteReg(EDMADSTH, HIBYTE(dest));
+	etherRunDma(start, end, 0);
 }
 
+// Returns the checksum of size bytes of the current rx packet frame at offset,
+// calculated in buffer memory without reading the data over SPI
+uint16_t etherGetPacketChecksum(uint16_t offset, uint16_t size) {
+	return etherDmaChecksum(etherRxWrap(rxPacketStart + offset),
+	                        etherRxWrap(rxPacketStart + offset + size - 1));
+}
+
+// Sets the ip header checksum
 void etherCalcIpChecksum(ipFrame* ip) {
-	// 32-bit sum over ip header
-	sum = 0;
-	etherSumWords(&ip->revSize, 10);
-	etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-	ip->headerChecksum = getEtherChecksum();
+	ip->headerChecksum = 0;
+	ip->headerChecksum = checksumFinish(checksumAdd(0, ip, (ip->revSize & 0xF) * 4));
 }
 
 // Converts from host to network order and vice versa
@@ -635,14 +1402,179 @@ bool etherIsIp(uint8_t packet[]) {
 	ipFrame* ip = (ipFrame*) &ether->data;
 	bool ok;
 	ok = (ether->frameType == htons(0x0800));
-	if (ok) {
-		sum = 0;
-		etherSumWords(&ip->revSize, (ip->revSize & 0xF) * 4);
-		ok = (getEtherChecksum() == 0);
-	}
+	if (ok)
+		ok = (checksumFinish(checksumAdd(0, ip, (ip->revSize & 0xF) * 4)) == 0);
 	return ok;
 }
 
+// Returns the sum of the UDP/TCP pseudo-header
+uint32_t etherSumPseudoHeader(ipFrame* ip, uint16_t length) {
+	uint32_t sum;
+	sum = checksumAdd(0, ip->sourceIp, 8);
+	sum = checksumAddWord(sum, (uint16_t) ip->protocol << 8);
+	return checksumAddWord(sum, htons(length));
+}
+
+// Sets the udp checksum over the pseudo-header, header and data
+void etherCalcUdpChecksum(ipFrame* ip, udpFrame* udp) {
+	uint16_t length = ntohs(udp->length);
+	udp->check = 0;
+	udp->check = checksumFinish(checksumAdd(etherSumPseudoHeader(ip, length), udp, length));
+	// zero is reserved for no checksum
+	if (udp->check == 0)
+		udp->check = 0xFFFF;
+}
+
+// Sets the tcp checksum over the pseudo-header, header and length - header bytes of data
+void etherCalcTcpChecksum(ipFrame* ip, tcpFrame* tcp, uint16_t length) {
+	tcp->checksum = 0;
+	tcp->checksum = checksumFinish(checksumAdd(etherSumPseudoHeader(ip, length), tcp, length));
+}
+
+// Parses a received frame once
+// Header pointers, lengths and flags are stored in info for the handlers,
+// and checksums are verified here so that a layer flag is only set if valid
+void etherClassify(uint8_t packet[], uint16_t size, etherPacketInfo* info) {
+	etherFrame* ether = (etherFrame*) packet;
+	arpFrame* arp;
+	ipFrame* ip;
+	icmpFrame* icmp;
+	udpFrame* udp;
+	tcpFrame* tcp;
+	uint16_t ipHeaderLength, ipLength, length, tcpHeaderLength, tmp16;
+	uint8_t i;
+	bool ok;
+
+	info->flags = 0;
+	info->size = size;
+	info->ip = 0;
+	info->transport = 0;
+	info->payload = 0;
+	info->payloadLength = 0;
+	info->sourcePort = 0;
+	info->destPort = 0;
+	info->tcpFlags = 0;
+	info->sequenceNumber = 0;
+	info->ackNumber = 0;
+
+	if (size < 14)
+		return;
+
+	// ARP
+	// a runt frame without the whole 28-byte body is left unflagged
+	if (ether->frameType == htons(0x0806)) {
+		if (size < 14 + 28)
+			return;
+		arp = (arpFrame*) &ether->data;
+		if (arp->op == htons(1)) {
+			ok = true;
+			for (i = 0; ok && i < IP_ADD_LENGTH; i++)
+				ok = (arp->destIp[i] == ipAddress[i]);
+			if (ok)
+				info->flags |= ETHER_PKT_ARP_REQUEST;
+		} else if (arp->op == htons(2))
+			info->flags |= ETHER_PKT_ARP_RESPONSE;
+		return;
+	}
+
+	// IP header
+	if (ether->frameType != htons(0x0800))
+		return;
+	ip = (ipFrame*) &ether->data;
+	ipHeaderLength = (ip->revSize & 0xF) * 4;
+	ipLength = ntohs(ip->length);
+	if (ipHeaderLength < 20 || ipLength < ipHeaderLength || ipLength + 14 > size)
+		return;
+	if (checksumFinish(checksumAdd(0, ip, ipHeaderLength)) != 0) {
+		countStat(STAT_CHECKSUM_ERRORS);
+		return;
+	}
+	info->flags |= ETHER_PKT_IP;
+	info->ip = (uint8_t*) ip;
+	if (etherIsIpUnicast(packet))
+		info->flags |= ETHER_PKT_IP_UNICAST;
+	if (etherIsIpBroadcast(packet))
+		info->flags |= ETHER_PKT_IP_BROADCAST;
+
+	// Transport
+	info->transport = (uint8_t*) ip + ipHeaderLength;
+	length = ipLength - ipHeaderLength;
+	switch (ip->protocol) {
+	case 0x01:
+		icmp = (icmpFrame*) info->transport;
+		if (length < 8)
+			break;
+		if (checksumFinish(checksumAdd(0, icmp, length)) != 0) {
+			countStat(STAT_CHECKSUM_ERRORS);
+			break;
+		}
+		info->flags |= ETHER_PKT_ICMP;
+		if (icmp->type == 8)
+			info->flags |= ETHER_PKT_PING_REQUEST;
+		break;
+	case 0x11:
+		udp = (udpFrame*) info->transport;
+		tmp16 = ntohs(udp->length);
+		if (length < 8 || tmp16 < 8 || tmp16 > length)
+			break;
+		// a zero checksum means the sender did not compute one
+		if (udp->check != 0 && checksumFinish(checksumAdd(etherSumPseudoHeader(ip, tmp16), udp, tmp16)) != 0) {
+			countStat(STAT_CHECKSUM_ERRORS);
+			break;
+		}
+		info->flags |= ETHER_PKT_UDP;
+		info->sourcePort = ntohs(udp->sourcePort);
+		info->destPort = ntohs(udp->destPort);
+		info->payload = &udp->data;
+		info->payloadLength = tmp16 - 8;
+		if (info->sourcePort == 67 && info->destPort == 68)
+			info->flags |= ETHER_PKT_DHCP;
+		break;
+	case 0x06:
+		tcp = (tcpFrame*) info->transport;
+		if (length < 20)
+			break;
+		tmp16 = ntohs(tcp->headerLength);
+		tcpHeaderLength = (tmp16 >> 12) * 4;
+		if (tcpHeaderLength < 20 || tcpHeaderLength > length)
+			break;
+		if (checksumFinish(checksumAdd(etherSumPseudoHeader(ip, length), tcp, length)) != 0) {
+			countStat(STAT_CHECKSUM_ERRORS);
+			break;
+		}
+		info->flags |= ETHER_PKT_TCP;
+		info->sourcePort = ntohs(tcp->sourcePort);
+		info->destPort = ntohs(tcp->destPort);
+		info->tcpFlags = tmp16 & 0x3F;
+		info->sequenceNumber = htols(tcp->sequenceNumber);
+		info->ackNumber = htols(tcp->ackNumber);
+		info->payload = info->transport + tcpHeaderLength;
+		info->payloadLength = length - tcpHeaderLength;
+		break;
+	}
+}
+
+// Determines from the headers alone whether a frame is worth reading in full
+// Accepts ARP and IP datagrams unicast to this ip or broadcast
+bool etherIsPacketForUs(uint8_t packet[]) {
+	etherFrame* ether = (etherFrame*) packet;
+	if (ether->frameType == htons(0x0806))
+		return true;
+	if (ether->frameType == htons(0x0800))
+		return etherIsIpUnicast(packet) || etherIsIpBroadcast(packet);
+	return false;
+}
+
+// Decides from the ether header alone whether a frame is still read while the
+// rx buffer is congested: ARP, and anything sent to this MAC address, so that
+// a broadcast storm cannot crowd out ARP and TCP
+bool etherIsFrameCritical(uint8_t packet[]) {
+	etherFrame* ether = (etherFrame*) packet;
+	if (ether->frameType == htons(0x0806))
+		return true;
+	return memcmp(ether->destAddress, macAddress, HW_ADD_LENGTH) == 0;
+}
+
 // Determines whether packet is unicast to this ip
 // Must be an IP packet
 bool etherIsIpUnicast(uint8_t packet[]) {
@@ -680,14 +1612,15 @@ bool etherIsPingRequest(uint8_t packet[]) {
 	return (ip->protocol == 0x01 & icmp->type == 8);
 }
 
-// Sends a ping response given the request data
-void etherSendPingResponse(uint8_t packet[]) {
+// Turns a ping request into its response in place
+void etherMakePingResponse(uint8_t packet[]) {
 	etherFrame* ether = (etherFrame*) packet;
 	ipFrame* ip = (ipFrame*) &ether->data;
 	icmpFrame* icmp = (icmpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
 	uint8_t i, tmp;
-	uint16_t icmp_size;
+	uint16_t oldTypeCode;
 	// swap source and destination fields
+	// (swapping leaves the ip checksum unchanged)
 	for (i = 0; i < HW_ADD_LENGTH; i++) {
 		tmp = ether->destAddress[i];
 		ether->destAddress[i] = ether->sourceAddress[i];
@@ -699,16 +1632,62 @@ void etherSendPingResponse(uint8_t packet[]) {
 		ip->sourceIp[i] = tmp;
 	}
 	// this is a response
+	oldTypeCode = icmp->type | (icmp->code << 8);
 	icmp->type = 0;
-	// calc icmp checksum
-	sum = 0;
-	etherSumWords(&icmp->type, 2);
-	icmp_size = ntohs(ip->length);
-	icmp_size -= 24; // sub ip header and icmp code, type, and check
-	etherSumWords(&icmp->id, icmp_size);
-	icmp->check = getEtherChecksum();
+	// only the type changed, so update the icmp checksum incrementally
+	icmp->check = checksumUpdate16(icmp->check, oldTypeCode, icmp->code << 8);
+}
+
+// Sends a ping response given the request data
+void etherSendPingResponse(uint8_t packet[]) {
+	etherFrame* ether = (etherFrame*) packet;
+	ipFrame* ip = (ipFrame*) &ether->data;
+	etherMakePingResponse(packet);
 	// send packet
-	etherPutPacket(ether, 14 + ntohs(ip->length));
+	etherQueuePacket(packet, 14 + ntohs(ip->length));
+}
+
+// Answers a ping request while its payload stays in buffer memory
+// packet holds the first ETHER_PEEK_SIZE bytes of the current rx packet
+// The request is verified with the controller checksum engine (which pauses
+// reception, see etherDmaChecksum) and the payload is copied to the transmit
+// buffer by its DMA, so the MCU never reads the payload
+// Must be called before etherDiscardPacket
+// Returns false (and sends nothing) if hw checksums are off or this is not a
+// valid ping request to this ip
+bool etherSendPingResponseInBuffer(uint8_t packet[]) {
+	etherFrame* ether = (etherFrame*) packet;
+	ipFrame* ip = (ipFrame*) &ether->data;
+	uint16_t ipHeaderLength = (ip->revSize & 0xF) * 4;
+	icmpFrame* icmp = (icmpFrame*) ((uint8_t*) ip + ipHeaderLength);
+	uint16_t headerSize, frameSize;
+	uint8_t slot;
+
+	if (!etherHwChecksum || etherDriverOps != &enc28j60Driver || ether->frameType != htons(0x0800)
+	        || !etherEncIsTxReady())
+		return false;
+	headerSize = 14 + ipHeaderLength + 8;
+	frameSize = 14 + ntohs(ip->length);
+	if (ipHeaderLength < 20 || headerSize > ETHER_PEEK_SIZE || frameSize < headerSize
+	        || frameSize > rxPacketSize)
+		return false;
+	if (ip->protocol != 0x01 || icmp->type != 8 || !etherIsIpUnicast(packet))
+		return false;
+	if (checksumFinish(checksumAdd(0, ip, ipHeaderLength)) != 0)
+		return false;
+	if (etherGetPacketChecksum(14 + ipHeaderLength, frameSize - 14 - ipHeaderLength) != 0)
+		return false;
+
+	// build the response headers, then append the payload straight from the rx buffer
+	etherMakePingResponse(packet);
+	slot = etherTxFreeSlot();
+	etherWriteTxBuffer(slot, packet, headerSize);
+	if (frameSize > headerSize)
+		etherDmaCopy(etherRxWrap(rxPacketStart + headerSize),
+		             etherRxWrap(rxPacketStart + frameSize - 1),
+		             etherTxSlotAddress(slot) + 1 + headerSize);
+	etherQueueTx(slot, frameSize);
+	return true;
 }
 
 // Determines whether packet is ARP
@@ -732,6 +1711,8 @@ void etherSendArpResponse(uint8_t packet[]) {
 	etherFrame* ether = (etherFrame*) packet;
 	arpFrame* arp = (arpFrame*) &ether->data;
 	uint8_t i, tmp;
+	// the requester is about to talk to us, so remember it
+	etherArpUpdate(arp->sourceIp, arp->sourceAddress);
 	// set op to response
 	arp->op = htons(2);
 	// swap source and destination fields
@@ -746,7 +1727,7 @@ void etherSendArpResponse(uint8_t packet[]) {
 		arp->sourceIp[i] = tmp;
 	}
 	// send packet
-	etherPutPacket(ether, 42);
+	etherQueuePacket(ether, 42);
 }
 
 // Sends an ARP request
@@ -775,38 +1756,231 @@ void etherSendArpRequest(uint8_t packet[], uint8_t ip[]) {
 		arp->destIp[i] = ip[i];
 	}
 	// send packet
-	etherPutPacket(ether, 42);
+	etherQueuePacket(ether, 42);
 }
 
-// Determines whether packet is UDP datagram
-// Must be an IP packet
-bool etherIsUdp(uint8_t packet[]) {
-	etherFrame* ether = (etherFrame*) packet;
-	ipFrame* ip = (ipFrame*) &ether->data;
-	udpFrame* udp = (udpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
-	bool ok;
-	uint16_t tmp16;
-	ok = (ip->protocol == 0x11);
-	if (ok) {
-		// 32-bit sum over pseudo-header
-		sum = 0;
-		etherSumWords(ip->sourceIp, 8);
-		tmp16 = ip->protocol;
-		sum += (tmp16 & 0xff) << 8;
-		etherSumWords(&udp->length, 2);
-		// add udp header and data
-		etherSumWords(udp, ntohs(udp->length));
-		ok = (getEtherChecksum() == 0);
+// Returns true if uptime has reached time, allowing for wrap-around
+bool etherIsTimeReached(uint32_t time) {
+	return (int32_t) (getUptime() - time) >= 0;
+}
+
+// Returns the cache entry for ip, or NULL if there is none
+arpEntry* etherArpFind(uint8_t ip[]) {
+	uint8_t i;
+	for (i = 0; i < ARP_CACHE_SIZE; i++) {
+		if (arpCache[i].state != ARP_FREE && memcmp(arpCache[i].ip, ip, IP_ADD_LENGTH) == 0)
+			return &arpCache[i];
 	}
-	return ok;
+	return NULL;
 }
 
-// Gets pointer to UDP payload of frame
-uint8_t* etherGetUdpData(uint8_t packet[]) {
-	etherFrame* ether = (etherFrame*) packet;
-	ipFrame* ip = (ipFrame*) &ether->data;
-	udpFrame* udp = (udpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
-	return &udp->data;
+// Returns a cache entry for ip, reusing a free entry or evicting the resolved
+// entry closest to expiring
+// Returns NULL if every entry is waiting on a reply
+arpEntry* etherArpAllocate(uint8_t ip[]) {
+	arpEntry* entry = NULL;
+	uint8_t i;
+	for (i = 0; i < ARP_CACHE_SIZE; i++) {
+		if (arpCache[i].state == ARP_FREE) {
+			entry = &arpCache[i];
+			break;
+		}
+		if (arpCache[i].state == ARP_RESOLVED
+		        && (entry == NULL || (int32_t) (arpCache[i].expires - entry->expires) < 0))
+			entry = &arpCache[i];
+	}
+	if (entry != NULL)
+		memcpy(entry->ip, ip, IP_ADD_LENGTH);
+	return entry;
+}
+
+// Sends the frames waiting on ip (or drops them if mac is NULL)
+void etherArpFlushQueue(uint8_t ip[], uint8_t mac[]) {
+	etherFrame* ether;
+	uint8_t i;
+	for (i = 0; i < ARP_QUEUE_SIZE; i++) {
+		if (arpQueue[i].size != 0 && memcmp(arpQueue[i].nextHop, ip, IP_ADD_LENGTH) == 0) {
+			if (mac != NULL) {
+				ether = (etherFrame*) arpQueue[i].frame;
+				memcpy(ether->destAddress, mac, HW_ADD_LENGTH);
+				etherQueuePacket(arpQueue[i].frame, arpQueue[i].size);
+			}
+			freePacket(arpQueue[i].frame);
+			arpQueue[i].size = 0;
+		}
+	}
+}
+
+// Adds or refreshes the mapping of ip to mac and sends any frames waiting on it
+void etherArpUpdate(uint8_t ip[], uint8_t mac[]) {
+	arpEntry* entry = etherArpFind(ip);
+	if (entry == NULL)
+		entry = etherArpAllocate(ip);
+	if (entry == NULL)
+		return;
+	entry->state = ARP_RESOLVED;
+	memcpy(entry->mac, mac, HW_ADD_LENGTH);
+	entry->expires = getUptime() + ARP_ENTRY_TIMEOUT;
+	etherArpFlushQueue(ip, mac);
+}
+
+// Returns true and the hardware address of ip if the cache holds a current entry
+bool etherArpLookup(uint8_t ip[], uint8_t mac[]) {
+	arpEntry* entry = etherArpFind(ip);
+	if (entry == NULL || entry->state != ARP_RESOLVED)
+		return false;
+	if (etherIsTimeReached(entry->expires)) {
+		entry->state = ARP_FREE;
+		return false;
+	}
+	memcpy(mac, entry->mac, HW_ADD_LENGTH);
+	return true;
+}
+
+// Removes every cache entry and drops every queued frame
+void etherArpFlush() {
+	uint8_t i;
+	for (i = 0; i < ARP_CACHE_SIZE; i++)
+		arpCache[i].state = ARP_FREE;
+	for (i = 0; i < ARP_QUEUE_SIZE; i++) {
+		if (arpQueue[i].size != 0)
+			freePacket(arpQueue[i].frame);
+		arpQueue[i].size = 0;
+	}
+}
+
+// Learns the sender of an ARP response if we asked for it or already know it
+void etherHandleArpResponse(uint8_t packet[]) {
+	etherFrame* ether = (etherFrame*) packet;
+	arpFrame* arp = (arpFrame*) &ether->data;
+	if (etherArpFind(arp->sourceIp) != NULL)
+		etherArpUpdate(arp->sourceIp, arp->sourceAddress);
+}
+
+// Retries or gives up on outstanding requests and ages out stale entries
+// Call periodically from the main loop
+void etherArpService() {
+	uint8_t packet[42];
+	uint8_t i;
+	for (i = 0; i < ARP_CACHE_SIZE; i++) {
+		if (arpCache[i].state == ARP_FREE || !etherIsTimeReached(arpCache[i].expires))
+			continue;
+		if (arpCache[i].state == ARP_PENDING && arpCache[i].retries < ARP_RETRIES) {
+			arpCache[i].retries++;
+			arpCache[i].expires = getUptime() + ARP_RETRY_TIMEOUT;
+			etherSendArpRequest(packet, arpCache[i].ip);
+		} else {
+			if (arpCache[i].state == ARP_PENDING)
+				etherArpFlushQueue(arpCache[i].ip, NULL);
+			arpCache[i].state = ARP_FREE;
+		}
+	}
+}
+
+// Returns true if ip is on our subnet
+bool etherIsIpLocal(uint8_t ip[]) {
+	uint8_t i;
+	for (i = 0; i < IP_ADD_LENGTH; i++) {
+		if ((ip[i] & ipSubnetMask[i]) != (ipAddress[i] & ipSubnetMask[i]))
+			return false;
+	}
+	return true;
+}
+
+// Returns true if ip is the limited broadcast or our subnet broadcast address
+bool etherIsIpBroadcastAddress(uint8_t ip[]) {
+	bool limited = true, subnet = true;
+	uint8_t i;
+	for (i = 0; i < IP_ADD_LENGTH; i++) {
+		limited &= ip[i] == 0xFF;
+		subnet &= (ip[i] | ipSubnetMask[i]) == 0xFF;
+	}
+	return limited || (subnet && etherIsIpLocal(ip));
+}
+
+// Sends an IP datagram to its destination, filling in the ethernet header
+// Hosts off our subnet are reached through the gateway; if the next hop has
+// not been resolved yet, the frame is queued and an ARP request is sent
+// Returns false if the frame could not be sent or queued
+bool etherSendIpPacket(uint8_t packet[], uint16_t size) {
+	etherFrame* ether = (etherFrame*) packet;
+	ipFrame* ip = (ipFrame*) &ether->data;
+	uint8_t nextHop[IP_ADD_LENGTH];
+	uint8_t request[42];
+	uint8_t* frame;
+	arpEntry* entry;
+	uint8_t i;
+
+	memcpy(ether->sourceAddress, macAddress, HW_ADD_LENGTH);
+	ether->frameType = htons(0x0800);
+	if (etherIsIpBroadcastAddress(ip->destIp)) {
+		memset(ether->destAddress, 0xFF, HW_ADD_LENGTH);
+		return etherQueuePacket(packet, size);
+	}
+
+	// pick the next hop
+	if (etherIsIpLocal(ip->destIp))
+		memcpy(nextHop, ip->destIp, IP_ADD_LENGTH);
+	else
+		memcpy(nextHop, ipGwAddress, IP_ADD_LENGTH);
+	if ((nextHop[0] | nextHop[1] | nextHop[2] | nextHop[3]) == 0)
+		return false;
+	if (etherArpLookup(nextHop, ether->destAddress))
+		return etherQueuePacket(packet, size);
+
+	// queue the frame until the next hop answers
+	i = 0;
+	while (i < ARP_QUEUE_SIZE && arpQueue[i].size != 0)
+		i++;
+	if (i == ARP_QUEUE_SIZE)
+		return false;
+	if (isPooledPacket(packet)) {
+		frame = packet;
+		retainPacket(frame);
+	} else {
+		frame = allocPacket(size);
+		if (frame == NULL)
+			return false;
+		memcpy(frame, packet, size);
+	}
+	entry = etherArpFind(nextHop);
+	if (entry == NULL) {
+		entry = etherArpAllocate(nextHop);
+		if (entry == NULL) {
+			freePacket(frame);
+			return false;
+		}
+		entry->state = ARP_PENDING;
+		entry->retries = 0;
+		entry->expires = getUptime() + ARP_RETRY_TIMEOUT;
+		etherSendArpRequest(request, nextHop);
+	}
+	arpQueue[i].frame = frame;
+	memcpy(arpQueue[i].nextHop, nextHop, IP_ADD_LENGTH);
+	arpQueue[i].size = size;
+	return true;
+}
+
+// Determines whether packet is UDP datagram
+// Must be an IP packet
+bool etherIsUdp(uint8_t packet[]) {
+	etherFrame* ether = (etherFrame*) packet;
+	ipFrame* ip = (ipFrame*) &ether->data;
+	udpFrame* udp = (udpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
+	bool ok;
+	uint16_t length = ntohs(udp->length);
+	ok = (ip->protocol == 0x11);
+	if (ok && udp->check != 0)
+		ok = (checksumFinish(checksumAdd(etherSumPseudoHeader(ip, length), udp, length)) == 0);
+	return ok;
+}
+
+// Gets pointer to UDP payload of frame
+uint8_t* etherGetUdpData(uint8_t packet[]) {
+	etherFrame* ether = (etherFrame*) packet;
+	ipFrame* ip = (ipFrame*) &ether->data;
+	udpFrame* udp = (udpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
+	return &udp->data;
 }
 
 // Send responses to a udp datagram 
@@ -818,7 +1992,7 @@ void etherSendUdpResponse(uint8_t packet[], uint8_t* udpData, uint8_t udpSize) {
 	udpFrame* udp = (udpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
 	uint8_t *copyData;
 	uint8_t i, tmp8;
-	uint16_t tmp16;
+	uint16_t oldLength;
 	// swap source and destination fields
 	for (i = 0; i < HW_ADD_LENGTH; i++) {
 		tmp8 = ether->destAddress[i];
@@ -836,30 +2010,19 @@ void etherSendUdpResponse(uint8_t packet[], uint8_t* udpData, uint8_t udpSize) {
 	// and rx port on other machine
 	udp->sourcePort = udp->destPort;
 	// adjust lengths
+	// only the length changed in the ip header, so update its checksum incrementally
+	oldLength = ip->length;
 	ip->length = htons(((ip->revSize & 0xF) * 4) + 8 + udpSize);
-	// 32-bit sum over ip header
-	sum = 0;
-	etherSumWords(&ip->revSize, 10);
-	etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-	ip->headerChecksum = getEtherChecksum();
+	ip->headerChecksum = checksumUpdate16(ip->headerChecksum, oldLength, ip->length);
 	udp->length = htons(8 + udpSize);
 	// copy data
 	copyData = &udp->data;
 	for (i = 0; i < udpSize; i++)
 		copyData[i] = udpData[i];
-	// 32-bit sum over pseudo-header
-	sum = 0;
-	etherSumWords(ip->sourceIp, 8);
-	tmp16 = ip->protocol;
-	sum += (tmp16 & 0xff) << 8;
-	etherSumWords(&udp->length, 2);
-	// add udp header except crc
-	etherSumWords(udp, 6);
-	etherSumWords(&udp->data, udpSize);
-	udp->check = getEtherChecksum();
+	etherCalcUdpChecksum(ip, udp);
 
 	// send packet with size = ether + udp hdr + ip header + udp_size
-	etherPutPacket(ether, 22 + ((ip->revSize & 0xF) * 4) + udpSize);
+	etherQueuePacket(ether, 22 + ((ip->revSize & 0xF) * 4) + udpSize);
 }
 
 uint16_t etherGetId() {
@@ -871,23 +2034,124 @@ void etherIncId() {
 }
 
 // Determines if the IP address is valid
+uint8_t etherUdpHash(uint16_t port) {
+	return (port ^ (port >> 8)) & (UDP_PORT_TABLE_SIZE - 1);
+}
+
+// Returns the slot bound to port, or NULL if there is none
+udpBinding* etherUdpFind(uint16_t port) {
+	uint8_t i, index = etherUdpHash(port);
+	for (i = 0; i < UDP_PORT_TABLE_SIZE && udpPorts[index].port != 0; i++) {
+		if (udpPorts[index].port == port)
+			return udpPorts[index].handler != NULL ? &udpPorts[index] : NULL;
+		index = (index + 1) & (UDP_PORT_TABLE_SIZE - 1);
+	}
+	return NULL;
+}
+
+// Delivers datagrams for a local port to handler (replacing any earlier one)
+// Returns false if the table is full
+bool etherUdpBind(uint16_t port, _udpHandler handler) {
+	udpBinding* binding = NULL;
+	uint8_t i, index = etherUdpHash(port);
+	if (port == 0 || handler == NULL)
+		return false;
+	for (i = 0; i < UDP_PORT_TABLE_SIZE; i++) {
+		if (udpPorts[index].port == port) {
+			binding = &udpPorts[index];
+			break;
+		}
+		if (binding == NULL && (udpPorts[index].port == 0 || udpPorts[index].handler == NULL))
+			binding = &udpPorts[index];
+		if (udpPorts[index].port == 0)
+			break;
+		index = (index + 1) & (UDP_PORT_TABLE_SIZE - 1);
+	}
+	if (binding == NULL)
+		return false;
+	binding->port = port;
+	binding->handler = handler;
+	return true;
+}
+
+void etherUdpUnbind(uint16_t port) {
+	udpBinding* binding = etherUdpFind(port);
+	if (binding != NULL)
+		binding->handler = NULL;
+}
+
+// Hands a classified UDP datagram to the handler bound to its destination port
+// Returns false if nothing is bound to it
+bool etherUdpDispatch(uint8_t packet[], etherPacketInfo* info) {
+	udpBinding* binding;
+	if ((info->flags & ETHER_PKT_UDP) == 0)
+		return false;
+	binding = etherUdpFind(info->destPort);
+	if (binding == NULL)
+		return false;
+	binding->handler(packet, info);
+	return true;
+}
+
+// Sends size bytes from sourcePort to ip:destPort, resolving the next hop first
+// Returns false if the datagram is too large or could not be sent or queued
+bool etherUdpSendTo(uint8_t ip[], uint16_t sourcePort, uint16_t destPort, uint8_t data[], uint16_t size) {
+	etherFrame* ether;
+	ipFrame* ipHeader;
+	udpFrame* udp;
+	uint8_t* datagram;
+	bool ok;
+
+	if (size > UDP_MAX_PAYLOAD)
+		return false;
+	datagram = allocPacket(14 + 20 + 8 + size);
+	if (datagram == NULL)
+		return false;
+	ether = (etherFrame*) datagram;
+	ipHeader = (ipFrame*) &ether->data;
+	udp = (udpFrame*) ((uint8_t*) ipHeader + 20);
+	ipHeader->revSize = 0x45;
+	ipHeader->typeOfService = 0;
+	ipHeader->length = htons(20 + 8 + size);
+	ipHeader->id = etherGetId();
+	etherIncId();
+	ipHeader->flagsAndOffset = 0;
+	ipHeader->ttl = TTL;
+	ipHeader->protocol = 0x11;
+	memcpy(ipHeader->sourceIp, ipAddress, IP_ADD_LENGTH);
+	memcpy(ipHeader->destIp, ip, IP_ADD_LENGTH);
+	etherCalcIpChecksum(ipHeader);
+
+	udp->sourcePort = htons(sourcePort);
+	udp->destPort = htons(destPort);
+	udp->length = htons(8 + size);
+	memcpy(&udp->data, data, size);
+	etherCalcUdpChecksum(ipHeader, udp);
+
+	ok = etherSendIpPacket(datagram, 14 + 20 + 8 + size);
+	freePacket(datagram);
+	return ok;
+}
+
 bool etherIsIpValid() {
 	return ipAddress[0] || ipAddress[1] || ipAddress[2] || ipAddress[3];
 }
 
+// Copies a new ip address, gateway or mask into address, flushing the ARP
+// cache if it changes, since its entries and queued frames were resolved for
+// next hops on the old network
+void etherChangeAddress(uint8_t address[], const uint8_t value[]) {
+	if (memcmp(address, value, IP_ADD_LENGTH) == 0)
+		return;
+	memcpy(address, value, IP_ADD_LENGTH);
+	etherArpFlush();
+}
+
 // Sets IP address
 void etherSetIpAddress(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3) {
-	ipAddress[0] = ip0;
-	ipAddress[1] = ip1;
-	ipAddress[2] = ip2;
-	ipAddress[3] = ip3;
-
-	uint32_t ip = 0;
-	ip |= (ip0 & 0x000000ff) << 24;
-	ip |= (ip1 & 0x000000ff) << 16;
-	ip |= (ip2 & 0x000000ff) << 8;
-	ip |= (ip3 & 0x000000ff);
-	writeEeprom(1, ip);
+	const uint8_t ip[IP_ADD_LENGTH] = { ip0, ip1, ip2, ip3 };
+	etherChangeAddress(ipAddress, ip);
+	setConfigAddress(CONFIG_IP, ipAddress);
 }
 
 // Gets IP address
@@ -899,24 +2163,15 @@ void etherGetIpAddress(uint8_t ip[4]) {
 
 // Sets IP address to 0.0.0.0 - Used when lease expires
 void etherSetIpAddressToZeroes() {
-	uint8_t i;
-	for (i = 0; i < 4; i++)
-		ipAddress[i] = 0;
+	const uint8_t zeroes[IP_ADD_LENGTH] = { 0, 0, 0, 0 };
+	etherChangeAddress(ipAddress, zeroes);
 }
 
 // Sets IP gateway address
 void etherSetIpGatewayAddress(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3) {
-	ipGwAddress[0] = ip0;
-	ipGwAddress[1] = ip1;
-	ipGwAddress[2] = ip2;
-	ipGwAddress[3] = ip3;
-
-	uint32_t ip = 0;
-	ip |= ip0 << 24;
-	ip |= ip1 << 16;
-	ip |= ip2 << 8;
-	ip |= ip3;
-	writeEeprom(2, ip);
+	const uint8_t ip[IP_ADD_LENGTH] = { ip0, ip1, ip2, ip3 };
+	etherChangeAddress(ipGwAddress, ip);
+	setConfigAddress(CONFIG_GW, ipGwAddress);
 }
 
 // Gets IP gateway address
@@ -928,17 +2183,11 @@ void etherGetIpGatewayAddress(uint8_t ip[4]) {
 
 // Sets DNS address
 void etherSetDNSAddress(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3) {
-	ipGwAddress[0] = ip0;
-	ipGwAddress[1] = ip1;
-	ipGwAddress[2] = ip2;
-	ipGwAddress[3] = ip3;
-
-	uint32_t ip = 0;
-	ip |= ip0 << 24;
-	ip |= ip1 << 16;
-	ip |= ip2 << 8;
-	ip |= ip3;
-	writeEeprom(3, ip);
+	dnsAddress[0] = ip0;
+	dnsAddress[1] = ip1;
+	dnsAddress[2] = ip2;
+	dnsAddress[3] = ip3;
+	setConfigAddress(CONFIG_DNS, dnsAddress);
 }
 
 // Gets DNS address
@@ -950,17 +2199,9 @@ void etherGetDNSAddress(uint8_t ip[4]) {
 
 // Sets IP subnet mask
 void etherSetIpSubnetMask(uint8_t mask0, uint8_t mask1, uint8_t mask2, uint8_t mask3) {
-	ipSubnetMask[0] = mask0;
-	ipSubnetMask[1] = mask1;
-	ipSubnetMask[2] = mask2;
-	ipSubnetMask[3] = mask3;
-
-	uint32_t ip = 0;
-	ip |= mask0 << 24;
-	ip |= mask1 << 16;
-	ip |= mask2 << 8;
-	ip |= mask3;
-	writeEeprom(4, ip);
+	const uint8_t mask[IP_ADD_LENGTH] = { mask0, mask1, mask2, mask3 };
+	etherChangeAddress(ipSubnetMask, mask);
+	setConfigAddress(CONFIG_SN, ipSubnetMask);
 }
 
 // Gets IP subnet mask
@@ -987,63 +2228,114 @@ void etherGetMacAddress(uint8_t mac[6]) {
 		mac[i] = macAddress[i];
 }
 
+// Restores the static addresses from the saved configuration
+// The configuration is cached in RAM, so this never touches the EEPROM
 void getDetailsFromEprom() {
-
-	// Get IP Address
-	uint32_t tmp = readEeprom(1);
-
-	ipAddress[0] = (tmp & 0xff000000) >> 24;
-	ipAddress[1] = (tmp & 0x00ff0000) >> 16;
-	ipAddress[2] = (tmp & 0x0000ff00) >> 8;
-	ipAddress[3] = (tmp & 0x000000ff);
-
-	// Get GW Address
-	tmp = readEeprom(2);
-
-	ipGwAddress[0] = (tmp & 0xff000000) >> 24;
-	ipGwAddress[1] = (tmp & 0x00ff0000) >> 16;
-	ipGwAddress[2] = (tmp & 0x0000ff00) >> 8;
-	ipGwAddress[3] = (tmp & 0x000000ff);
-
-	// Get DNS Address
-	tmp = readEeprom(3);
-
-	dnsAddress[0] = (tmp & 0xff000000) >> 24;
-	dnsAddress[1] = (tmp & 0x00ff0000) >> 16;
-	dnsAddress[2] = (tmp & 0x0000ff00) >> 8;
-	dnsAddress[3] = (tmp & 0x000000ff);
-
-	// Get SN Address
-	tmp = readEeprom(4);
-
-	ipSubnetMask[0] = (tmp & 0xff000000) >> 24;
-	ipSubnetMask[1] = (tmp & 0x00ff0000) >> 16;
-	ipSubnetMask[2] = (tmp & 0x0000ff00) >> 8;
-	ipSubnetMask[3] = (tmp & 0x000000ff);
+	uint8_t ip[IP_ADD_LENGTH];
+	getConfigAddress(CONFIG_IP, ip);
+	etherChangeAddress(ipAddress, ip);
+	getConfigAddress(CONFIG_GW, ip);
+	etherChangeAddress(ipGwAddress, ip);
+	getConfigAddress(CONFIG_DNS, dnsAddress);
+	getConfigAddress(CONFIG_SN, ip);
+	etherChangeAddress(ipSubnetMask, ip);
 }
 
 // DHCP Functions
 // Enable or disable DHCP mode
 void etherEnableDhcpMode() {
 	dhcpEnabled = true;
-	writeEeprom(0, 1);
+	setConfigDhcpMode(true);
 }
 
 void etherDisableDhcpMode() {
 	dhcpEnabled = false;
-	writeEeprom(0, 0x000);
+	setConfigDhcpMode(false);
 }
 
 bool etherIsDhcpEnabled() {
 	return dhcpEnabled;
 }
 
-// Send DHCP Packets. packet_type - 1 for Discovery, 3 for Request, 4 for Decline, 5 for Renew, 6 for Rebind, 7 for release
+// Walks the options of a DHCP message once, keeping the ones in
+// dhcpOptionFields; later copies of an option are ignored
+// Returns false if an option runs past the end of the message
+bool etherParseDhcpOptions(uint8_t data[], uint16_t size, dhcpOptions* options) {
+	uint16_t i = 0;
+	uint8_t f, number, length;
+	options->present = 0;
+	while (i < size) {
+		number = data[i];
+		if (number == DHCP_OPTION_END)
+			break;
+		if (number == DHCP_OPTION_PAD) {
+			i++;
+			continue;
+		}
+		if (i + 2 > size || i + 2 + data[i + 1] > size)
+			return false;
+		length = data[i + 1];
+		for (f = 0; f < DHCP_OPTION_FIELDS; f++) {
+			if (dhcpOptionFields[f].number == number && length >= dhcpOptionFields[f].size
+			        && (options->present & dhcpOptionFields[f].flag) == 0) {
+				memcpy((uint8_t*) options + dhcpOptionFields[f].offset, &data[i + 2], dhcpOptionFields[f].size);
+				options->present |= dhcpOptionFields[f].flag;
+			}
+		}
+		i += 2 + length;
+	}
+	if (options->present & DHCP_HAS_LEASE)
+		options->leaseTime = htols(options->leaseTime);
+	return true;
+}
+
+// Returns the DHCP message in packet and its options if it is a server
+// reply to us with a message type, or NULL
+dhcpFrame* etherGetDhcpReply(uint8_t packet[], dhcpOptions* options) {
+	etherFrame* ether = (etherFrame*) packet;
+	ipFrame* ip = (ipFrame*) &ether->data;
+	udpFrame* udp = (udpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
+	dhcpFrame* dhcp = (dhcpFrame*) &udp->data;
+	uint16_t length = ntohs(udp->length);
+
+	if (length < 8 + sizeof(dhcpFrame) || length > ntohs(ip->length) - ((ip->revSize & 0xF) * 4))
+		return NULL;
+	if (dhcp->op != 2 || dhcp->magicCookie != htols(DHCP_MAGIC_COOKIE)
+	        || memcmp(dhcp->chaddr, macAddress, HW_ADD_LENGTH) != 0)
+		return NULL;
+	if (!etherParseDhcpOptions(dhcp->options, length - 8 - sizeof(dhcpFrame), options)
+	        || (options->present & DHCP_HAS_TYPE) == 0)
+		return NULL;
+	return dhcp;
+}
+
+// Appends an option of size bytes, returning where the next one goes
+uint8_t* putDhcpOption(uint8_t* option, uint8_t number, const void* value, uint8_t size) {
+	*option++ = number;
+	*option++ = size;
+	memcpy(option, value, size);
+	return option + size;
+}
+
+// Send DHCP Packets. packet_type - 1 for Discovery, 3 for Request, 4 for Decline, 5 for Renew, 6 for Rebind, 7 for release,
+// 8 for a Request from INIT-REBOOT (asks for the address set by etherSetDhcpRequestedIp)
+// A Request is built over the Offer in packet, which must be valid
 void etherSendDhcpPacket(uint8_t packet[], uint8_t packet_type) {
 
 	etherFrame* ether = (etherFrame*) packet;
+	dhcpOptions offer;
+	uint8_t clientId[1 + HW_ADD_LENGTH];
+	uint8_t* option;
 	uint8_t i;
 
+	// Save options 51 and 54 from DHCP Offer (to be used in DHCP Request)
+	if (packet_type == 3) {
+		if (etherGetDhcpReply(packet, &offer) == NULL
+		        || (offer.present & (DHCP_HAS_SERVER | DHCP_HAS_LEASE)) != (DHCP_HAS_SERVER | DHCP_HAS_LEASE))
+			return;
+		offer.leaseTime = htols(offer.leaseTime);
+	}
+
 	for (i = 0; i < HW_ADD_LENGTH; i++) {
 		// DHCP Renew and Release are unicast
 		if (packet_type == 5 || packet_type == 7) {
@@ -1055,8 +2347,6 @@ void etherSendDhcpPacket(uint8_t packet[], uint8_t packet_type) {
 	}
 	ether->frameType = htons(0x0800);
 
-	uint16_t tmp16;
-
 	ipFrame* ip = (ipFrame*) &ether->data;
 	ip->revSize = 0x45;
 	ip->typeOfService = 0;
@@ -1094,23 +2384,12 @@ void etherSendDhcpPacket(uint8_t packet[], uint8_t packet_type) {
 		dhcp->flags = htons(0x8000);
 	}
 
-	dhcp->magicCookie = htols(0x63825363);
+	dhcp->magicCookie = htols(DHCP_MAGIC_COOKIE);
 
-	// Save options 51 and 54 from DHCP Offer (to be used in DHCP Request)
-	uint8_t t1, t2, t3, t4, t5, t6, t7, t8;
+	// A Request asks for the offered address
 	if (packet_type == 3) {
-		uint16_t opSiz = htons(udp->length - 248);
-		uint8_t* o54 = getOption(dhcp->options, 54, opSiz);
-		uint8_t* o51 = getOption(dhcp->options, 51, opSiz);
-		t1 = o54[0];
-		t2 = o54[1];
-		t3 = o54[2];
-		t4 = o54[3];
-
-		t5 = o51[0];
-		t6 = o51[1];
-		t7 = o51[2];
-		t8 = o51[3];
+		for (i = 0; i < IP_ADD_LENGTH; i++)
+			tempIpAddress[i] = dhcp->yiaddr[i];
 	}
 
 	// Set 0 to unused data
@@ -1121,50 +2400,40 @@ void etherSendDhcpPacket(uint8_t packet[], uint8_t packet_type) {
 		dhcp->data[i] = 0;
 	}
 
-	uint8_t opSize = 0;
-
 	// Add DHCP Message type according to packet_type variable
 	uint8_t dhcp_packet_type = packet_type;
-	if (dhcp_packet_type == 5 || dhcp_packet_type == 6)
-		dhcp_packet_type = 3; // DHCP Renew and Rebind are DHCP Request Packets
-	opSize = putOption(dhcp->options, opSize, 53, 1, dhcp_packet_type);
+	if (dhcp_packet_type == 5 || dhcp_packet_type == 6 || dhcp_packet_type == 8)
+		dhcp_packet_type = 3; // DHCP Renew, Rebind and Reboot are DHCP Request Packets
+	option = putDhcpOption(dhcp->options, DHCP_OPTION_MESSAGE_TYPE, &dhcp_packet_type, 1);
 
 	// Add options parameters list
-	opSize = putOption(dhcp->options, opSize, 55, 5, 1, 2, 3, 6, 51);
+	option = putDhcpOption(option, DHCP_OPTION_PARAMETERS, dhcpParameters, sizeof(dhcpParameters));
 
-	dhcp->options[opSize++] = 61;
-	dhcp->options[opSize++] = 7;
-	dhcp->options[opSize++] = 1;
+	clientId[0] = 1;
 	for (i = 0; i < HW_ADD_LENGTH; i++) {
 		dhcp->chaddr[i] = macAddress[i];
-		dhcp->options[opSize++] = macAddress[i];
+		clientId[1 + i] = macAddress[i];
 	}
+	option = putDhcpOption(option, DHCP_OPTION_CLIENT_ID, clientId, sizeof(clientId));
 
-	// If it is DHCP Request and not in renewing/rebinding state
-	if (packet_type == 3) {
-		dhcp->options[opSize++] = 50;
-		dhcp->options[opSize++] = 4;
-		for (i = 0; i < IP_ADD_LENGTH; i++) {
-			dhcp->options[opSize++] = dhcp->yiaddr[i];
-			tempIpAddress[i] = dhcp->yiaddr[i];
-		}
-
-		// Put Lease Time option if this is DHCP Request
-		opSize = putOption(dhcp->options, opSize, 51, 4, t5, t6, t7, t8);
-//		opSize = putOption(dhcp->options, opSize, 51, 4, 0, 0, 0, 60); // Testing for DHCP Renew
-
-		// Put DHCP Server Identifier option if this is DHCP Request
-		opSize = putOption(dhcp->options, opSize, 54, 4, t1, t2, t3, t4);
+	// A Request from SELECTING or INIT-REBOOT names the address it wants
+	if (packet_type == 3 || packet_type == 8)
+		option = putDhcpOption(option, DHCP_OPTION_REQUESTED_IP, tempIpAddress, IP_ADD_LENGTH);
 
+	// Only a Request from SELECTING carries the lease time and the server
+	// identifier; INIT-REBOOT must not name a server (RFC 2131 4.3.2)
+	if (packet_type == 3) {
+		option = putDhcpOption(option, DHCP_OPTION_LEASE_TIME, &offer.leaseTime, 4);
+		option = putDhcpOption(option, DHCP_OPTION_SERVER_ID, offer.serverId, IP_ADD_LENGTH);
 	}
 
 	// End options
-	dhcp->options[opSize++] = 255;
+	*option++ = DHCP_OPTION_END;
 
 	for (i = 0; i < IP_ADD_LENGTH; i++) {
 
 		// Populate CIAddr field if this is DHCP Rebind/Renew/Release
-		if (packet_type > 4) {
+		if (packet_type >= 5 && packet_type <= 7) {
 			dhcp->ciaddr[i] = ipAddress[i];
 		} else {
 			dhcp->ciaddr[i] = 0;
@@ -1174,55 +2443,22 @@ void etherSendDhcpPacket(uint8_t packet[], uint8_t packet_type) {
 		dhcp->giaddr[i] = 0;
 	}
 
-	uint16_t udpSize = 240 + opSize; // calculate dynamic options size
+	uint16_t udpSize = 240 + (option - dhcp->options); // calculate dynamic options size
 
 	// adjust lengths
 	ip->length = htons(((ip->revSize & 0xF) * 4) + 8 + udpSize);
-	// 32-bit sum over ip header
-	sum = 0;
-	etherSumWords(&ip->revSize, 10);
-	etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-	ip->headerChecksum = getEtherChecksum();
+	etherCalcIpChecksum(ip);
 	udp->length = htons(8 + udpSize);
-	// 32-bit sum over pseudo-header
-	sum = 0;
-	etherSumWords(ip->sourceIp, 8);
-	tmp16 = ip->protocol;
-	sum += (tmp16 & 0xff) << 8;
-	etherSumWords(&udp->length, 2);
-	// add udp header except crc
-	etherSumWords(udp, 6);
-	etherSumWords(&udp->data, udpSize);
-	udp->check = getEtherChecksum();
+	etherCalcUdpChecksum(ip, udp);
 
 	// send packet with size = ether + ip header + udp hdr + udp_size
-	etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + 8 + udpSize);
+	etherQueuePacket(ether, 14 + ((ip->revSize & 0xF) * 4) + 8 + udpSize);
 }
 
 // Determines whether packet is DHCP Offer
 bool isDhcpOffer(uint8_t packet[]) {
-
-	etherFrame* ether = (etherFrame*) packet;
-	ipFrame* ip = (ipFrame*) &ether->data;
-	udpFrame* udp = (udpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
-	dhcpFrame* dhcp = (dhcpFrame*) &udp->data;
-
-	uint8_t i;
-	bool ok = true;
-
-	// Check if MAC address matches
-	for (i = 0; i < HW_ADD_LENGTH; i++) {
-		ok = dhcp->chaddr[i] == macAddress[i];
-	}
-
-	uint16_t opSize = htons(udp->length - 248);
-	uint8_t* msgType = getOption(dhcp->options, 53, opSize);
-
-	// Check for Client Hardware Address and DHCP Message Type
-	if (ok && dhcp->op == 2 && msgType[0] == 2) {
-		return true;
-	}
-	return false;
+	dhcpOptions options;
+	return etherGetDhcpReply(packet, &options) != NULL && options.messageType == 2;
 }
 
 // Determines whether packet is DHCP ACK
@@ -1231,46 +2467,48 @@ uint32_t isDhcpAck(uint8_t packet[]) {
 
 	etherFrame* ether = (etherFrame*) packet;
 	ipFrame* ip = (ipFrame*) &ether->data;
-	udpFrame* udp = (udpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
-	dhcpFrame* dhcp = (dhcpFrame*) &udp->data;
-
-	uint16_t opSize = htons(udp->length - 248);
-	uint8_t* msgType = getOption(dhcp->options, 53, opSize);
-
+	dhcpOptions options;
 	uint8_t i;
-	bool ok = true;
-	for (i = 0; i < HW_ADD_LENGTH; i++) {
-		ok = dhcp->chaddr[i] == macAddress[i];
-		serverMacAddress[i] = ether->sourceAddress[i];
-	}
-
-	if (ok && dhcp->op == 2 && msgType[0] == 5) {
-
-		uint8_t* leaseTime = getOption(dhcp->options, 51, opSize);
 
-		uint32_t lease = 0;
-		lease |= leaseTime[0] << 24;
-		lease |= leaseTime[1] << 16;
-		lease |= leaseTime[2] << 8;
-		lease |= leaseTime[3];
+	if (etherGetDhcpReply(packet, &options) == NULL || options.messageType != 5
+	        || (options.present & DHCP_HAS_LEASE) == 0)
+		return 0;
+
+	// Parameters the server left out keep their current values
+	// A lease with a new address, mask or router flushes the ARP cache
+	etherChangeAddress(ipAddress, tempIpAddress);
+	if (options.present & DHCP_HAS_SUBNET)
+		etherChangeAddress(ipSubnetMask, options.subnetMask);
+	if (options.present & DHCP_HAS_ROUTER)
+		etherChangeAddress(ipGwAddress, options.router);
+	for (i = 0; i < IP_ADD_LENGTH; i++) {
+		if (options.present & DHCP_HAS_DNS)
+			dnsAddress[i] = options.dns[i];
+		if (options.present & DHCP_HAS_SERVER)
+			serverIpAddress[i] = options.serverId[i];
+		else
+			serverIpAddress[i] = ip->sourceIp[i];
+	}
+	for (i = 0; i < HW_ADD_LENGTH; i++)
+		serverMacAddress[i] = ether->sourceAddress[i];
 
-		uint8_t* sn = getOption(dhcp->options, 1, opSize);
-		uint8_t* gw = getOption(dhcp->options, 3, opSize);
-		uint8_t* dns = getOption(dhcp->options, 6, opSize);
+	return options.leaseTime;
+}
 
-		uint8_t i = 0;
-		for (i = 0; i < IP_ADD_LENGTH; i++) {
-			ipAddress[i] = tempIpAddress[i];
-			dnsAddress[i] = dns[i];
-			ipSubnetMask[i] = sn[i];
-			ipGwAddress[i] = gw[i];
+// Determines whether packet is DHCP NAK for us
+bool isDhcpNak(uint8_t packet[]) {
+	dhcpOptions options;
+	return etherGetDhcpReply(packet, &options) != NULL && options.messageType == 6;
+}
 
-			serverIpAddress[i] = ip->sourceIp[i];
-		}
+// Sets the address asked for by the next INIT-REBOOT request
+void etherSetDhcpRequestedIp(uint8_t ip[4]) {
+	memcpy(tempIpAddress, ip, IP_ADD_LENGTH);
+}
 
-		return lease;
-	}
-	return 0;
+// Gets the address of the server that granted the lease
+void etherGetDhcpServerAddress(uint8_t ip[4]) {
+	memcpy(ip, serverIpAddress, IP_ADD_LENGTH);
 }
 
 // Sends Gratuituous ARP
@@ -1299,7 +2537,7 @@ void sendGratiousArp(uint8_t packet[]) {
 		arp->sourceIp[i] = ipAddress[i];
 	}
 	// send packet
-	etherPutPacket(ether, 42);
+	etherQueuePacket(ether, 42);
 }
 
 // TODO Implementation remaining
@@ -1315,131 +2553,343 @@ bool etherIsTcp(uint8_t packet[]) {
 	ipFrame* ip = (ipFrame*) &ether->data;
 	tcpFrame* tcp = (tcpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
 	bool ok;
-	uint16_t tmp16;
+	uint16_t length;
 	ok = (ip->protocol == 6);
 	if (ok) {
-		// 32-bit sum over pseudo-header
-
-		uint8_t tcpSize = htons(tcp->headerLength) >> 12;
-		sum = 0;
-		etherSumWords(ip->sourceIp, 8);
-
-		tmp16 = ip->protocol;
-		sum += (tmp16 & 0xff) << 8;
-
-		// Calculate TCP Data size
-		tmp16 = htons(ip->length) - 20;
-		sum += (tmp16 & 0xff) << 8;
-
-		etherSumWords(tcp, tmp16);
-		ok = (getEtherChecksum() == 0);
+		// tcp header and data size
+		length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
+		ok = (checksumFinish(checksumAdd(etherSumPseudoHeader(ip, length), tcp, length)) == 0);
 	}
 	return ok;
 }
 
-// Checks if the TCP packet was a SYN
-bool etherIsTcpSYN(uint8_t packet[]) {
-	etherFrame* ether = (etherFrame*) packet;
-	ipFrame* ip = (ipFrame*) &ether->data;
-	tcpFrame* tcp = (tcpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
-	bool ok = (htons(tcp->headerLength) >> 1) & 1;
-	return ok;
+// Returns a new initial sequence number
+// Follows the RFC 793 4 us clock, with a per-connection offset so that
+// connections opened in the same second do not overlap
+uint32_t etherTcpNewIsn() {
+	tcpIsnCount++;
+	return getUptime() * 250000 + ((uint32_t) tcpIsnCount << 16);
 }
 
+// Returns the connection for the (remote ip, remote port, local port) tuple, or NULL
+tcpControlBlock* etherTcpFind(uint8_t remoteIp[], uint16_t remotePort, uint16_t localPort) {
+	uint8_t i;
+	for (i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+		if (tcpConnections[i].state != TCP_CLOSED && tcpConnections[i].remotePort == remotePort
+		        && tcpConnections[i].localPort == localPort
+		        && memcmp(tcpConnections[i].remoteIp, remoteIp, IP_ADD_LENGTH) == 0)
+			return &tcpConnections[i];
+	}
+	return NULL;
+}
 
-uint32_t currentIsn = 0;
+// Returns the connection a received segment belongs to, or NULL
+tcpControlBlock* etherTcpFindSegment(ipFrame* ip, tcpFrame* tcp) {
+	return etherTcpFind(ip->sourceIp, ntohs(tcp->sourcePort), ntohs(tcp->destPort));
+}
 
-// Checks if the TCP packet was a SYN
-bool etherIsTcpAck(uint8_t packet[]) {
-	etherFrame* ether = (etherFrame*) packet;
-	ipFrame* ip = (ipFrame*) &ether->data;
-	tcpFrame* tcp = (tcpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
-	bool ok = (htons(tcp->headerLength) >> 4) & 1;
-	uint32_t tmp32 = htols(tcp->ackNumber);
-	return ok && tmp32 == currentIsn;
+// Returns the connection a classified segment belongs to, or NULL
+tcpControlBlock* etherTcpFindInfo(etherPacketInfo* info) {
+	if ((info->flags & ETHER_PKT_TCP) == 0)
+		return NULL;
+	return etherTcpFind(((ipFrame*) info->ip)->sourceIp, info->sourcePort, info->destPort);
 }
 
-// Checks if the TCP packet was Telnet Data
-bool etherIsTelnetData(uint8_t packet[]) {
-	etherFrame* ether = (etherFrame*) packet;
-	ipFrame* ip = (ipFrame*) &ether->data;
-	uint16_t tL = htons(ip->length);
-	tcpFrame* tcp = (tcpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
-	uint16_t tmp16 = htons(tcp->headerLength);
-	bool ok = ((tmp16 >> 3) & 1) && ((tmp16 >> 4) & 1);
-	uint32_t tmp32 = htols(tcp->ackNumber);
-	return ok && tmp32 == currentIsn;
+// Returns the state of the connection a segment belongs to
+// Segments of unknown connections report TCP_CLOSED
+uint8_t etherGetTcpState(etherPacketInfo* info) {
+	tcpControlBlock* tcb = etherTcpFindInfo(info);
+	if (tcb == NULL)
+		return TCP_CLOSED;
+	return tcb->state;
 }
 
-// Send SYN ACK in response to SYN
-void etherSendTcpSynAck(uint8_t packet[]) {
-	etherFrame* ether = (etherFrame*) packet;
-	ipFrame* ip = (ipFrame*) &ether->data;
-	tcpFrame* tcp = (tcpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
+// Moves the connection a segment belongs to into state
+// TCP_CLOSED releases its entry
+void etherSetTcpState(etherPacketInfo* info, uint8_t state) {
+	tcpControlBlock* tcb = etherTcpFindInfo(info);
+	if (tcb != NULL)
+		tcb->state = state;
+}
 
-	uint8_t i, tmp8;
-	// swap source and destination fields
-	for (i = 0; i < HW_ADD_LENGTH; i++) {
-		tmp8 = ether->destAddress[i];
-		ether->destAddress[i] = ether->sourceAddress[i];
-		ether->sourceAddress[i] = tmp8;
-	}
-	for (i = 0; i < IP_ADD_LENGTH; i++) {
-		tmp8 = ip->destIp[i];
-		ip->destIp[i] = ip->sourceIp[i];
-		ip->sourceIp[i] = tmp8;
+// Returns the number of open connections
+uint8_t etherGetTcpConnectionCount() {
+	uint8_t i, count = 0;
+	for (i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+		if (tcpConnections[i].state != TCP_CLOSED)
+			count++;
 	}
-	// set source port of resp will be dest port of req
-	// dest port of resp will be left at source port of req
-	// unusual nomenclature, but this allows a different tx
-	// and rx port on other machine
-	uint16_t tmp16 = tcp->destPort;
-	tcp->destPort = tcp->sourcePort;
-	tcp->sourcePort = tmp16;
+	return count;
+}
 
-	// Set ACK Number as +1 of Seq Number
-	tcp->ackNumber = htols(htols(tcp->sequenceNumber) + 1);
+// Returns the number of the connection a classified segment belongs to, or
+// TCP_NO_CONNECTION
+uint8_t etherTcpGetConnection(etherPacketInfo* info) {
+	tcpControlBlock* tcb = etherTcpFindInfo(info);
+	if (tcb == NULL)
+		return TCP_NO_CONNECTION;
+	return tcb - tcpConnections;
+}
 
-	// Increment Seq Number (since no data is sent)
-	tcp->sequenceNumber = htols(currentIsn++);
+// Updates the smoothed rtt and variance with a new sample and recalculates the rto
+// Jacobson/Karels estimator with the RFC 6298 gains, kept scaled (srtt x8, rttvar x4)
+void etherTcpUpdateRtt(tcpControlBlock* tcb, uint32_t rtt) {
+	int32_t delta;
+	if (tcb->srtt8 == 0) {
+		tcb->srtt8 = rtt << 3;
+		tcb->rttvar4 = rtt << 1;
+	} else {
+		delta = (int32_t) rtt - (tcb->srtt8 >> 3);
+		tcb->srtt8 += delta;
+		if (delta < 0)
+			delta = -delta;
+		tcb->rttvar4 += delta - (tcb->rttvar4 >> 2);
+	}
+	tcb->rto = (tcb->srtt8 >> 3) + tcb->rttvar4;
+	if (tcb->rto < TCP_MIN_RTO)
+		tcb->rto = TCP_MIN_RTO;
+	if (tcb->rto > TCP_MAX_RTO)
+		tcb->rto = TCP_MAX_RTO;
+}
+
+// Starts the retransmit timer unless it is already running
+void etherTcpStartTimer(tcpControlBlock* tcb, uint32_t now) {
+	if (tcb->sndNxt == tcb->sndUna)
+		tcb->rtoDeadline = now + tcb->rto;
+}
+
+// Sends one segment of a connection with flags, starting at sequence
+// The payload is length bytes of the send buffer, offset bytes past sndUna
+// Segments are built in a pool buffer of their own, so received frames are
+// left intact; bare acks fit in a small block
+bool etherTcpSendSegment(tcpControlBlock* tcb, uint8_t flags, uint32_t sequence, uint16_t offset, uint16_t length) {
+	etherFrame* ether;
+	ipFrame* ip;
+	tcpFrame* tcp;
+	uint8_t* copyData;
+	uint8_t* segment;
+	uint16_t i, index;
+	bool ok;
 
-	tcp->headerLength = htons(tcp->headerLength);
+	segment = allocPacket(14 + 20 + 20 + length);
+	if (segment == NULL)
+		return false;
+	ether = (etherFrame*) segment;
+	ip = (ipFrame*) &ether->data;
+	tcp = (tcpFrame*) ((uint8_t*) ip + 20);
+	copyData = (uint8_t*) tcp + 20;
+	ip->revSize = 0x45;
+	ip->typeOfService = 0;
+	ip->length = htons(20 + 20 + length);
+	ip->id = etherGetId();
+	etherIncId();
+	ip->flagsAndOffset = 0;
+	ip->ttl = TTL;
+	ip->protocol = 6;
+	memcpy(ip->sourceIp, ipAddress, IP_ADD_LENGTH);
+	memcpy(ip->destIp, tcb->remoteIp, IP_ADD_LENGTH);
+	etherCalcIpChecksum(ip);
+
+	tcp->sourcePort = htons(tcb->localPort);
+	tcp->destPort = htons(tcb->remotePort);
+	tcp->sequenceNumber = htols(sequence);
+	tcp->ackNumber = htols(tcb->rcvNxt);
+	tcp->headerLength = htons((5 << 12) | flags);
+	tcp->windowSize = htons(TCP_RECEIVE_WINDOW);
+	tcp->urgent = 0;
+
+	index = (tcb->sendStart + offset) % TCP_SEND_BUFFER_SIZE;
+	for (i = 0; i < length; i++) {
+		copyData[i] = tcb->sendBuffer[index];
+		if (++index == TCP_SEND_BUFFER_SIZE)
+			index = 0;
+	}
+	etherCalcTcpChecksum(ip, tcp, 20 + length);
 
-	// Set ACK Flag
-	tcp->headerLength |= (1 << 4);
+	ok = etherSendIpPacket(segment, 14 + 20 + 20 + length);
+	freePacket(segment);
+	// every segment acknowledges all we have received
+	if (ok)
+		tcb->ackPending = false;
+	return ok;
+}
 
-	uint8_t tcpSize = tcp->headerLength >> 12;
+// Appends data to the send buffer of a connection
+// Returns the number of bytes that fit
+uint16_t etherTcpQueue(tcpControlBlock* tcb, const uint8_t data[], uint16_t size) {
+	uint16_t i, index;
+	if (size > TCP_SEND_BUFFER_SIZE - tcb->sendLength)
+		size = TCP_SEND_BUFFER_SIZE - tcb->sendLength;
+	index = (tcb->sendStart + tcb->sendLength) % TCP_SEND_BUFFER_SIZE;
+	for (i = 0; i < size; i++) {
+		tcb->sendBuffer[index] = data[i];
+		if (++index == TCP_SEND_BUFFER_SIZE)
+			index = 0;
+	}
+	tcb->sendLength += size;
+	return size;
+}
 
-	tcp->headerLength = htons(tcp->headerLength);
+// Sends as much unsent data as the peer's window allows, several segments at a
+// time, followed by our FIN once a closing connection has sent all of its data
+// Nagle (RFC 896): a segment shorter than the mss only goes out when nothing
+// is in flight, so output written a few bytes at a time leaves in full
+// segments and the tail follows the ack of what came before it
+// Returns the number of segments sent
+uint8_t etherTcpOutput(tcpControlBlock* tcb) {
+	uint32_t now = getMilliseconds();
+	uint16_t sent, length;
+	uint8_t count = 0;
+
+	if (tcb->state != TCP_ESTABLISHED && tcb->state != TCP_LAST_ACK)
+		return 0;
+	sent = tcb->sndNxt - tcb->sndUna;
+	while (sent < tcb->sendLength && sent < tcb->sndWnd) {
+		length = tcb->sendLength - sent;
+		if (length > tcb->mss)
+			length = tcb->mss;
+		if (length < tcb->mss && sent > 0)
+			break;
+		if (length > tcb->sndWnd - sent)
+			length = tcb->sndWnd - sent;
+		// never a segment without data
+		if (length == 0)
+			break;
+		if (!etherTcpSendSegment(tcb, TCP_PSH | TCP_ACK, tcb->sndNxt, sent, length))
+			break;
+		etherTcpStartTimer(tcb, now);
+		tcb->sndNxt += length;
+		if (!tcb->rttTiming) {
+			tcb->rttTiming = true;
+			tcb->rttSequence = tcb->sndNxt;
+			tcb->rttStart = now;
+		}
+		sent += length;
+		count++;
+	}
+	// the FIN goes out once, right after the last byte of data
+	if (tcb->state == TCP_LAST_ACK && sent == tcb->sendLength && !tcb->finSent) {
+		if (etherTcpSendSegment(tcb, TCP_FIN | TCP_ACK, tcb->sndNxt, 0, 0)) {
+			etherTcpStartTimer(tcb, now);
+			tcb->sndNxt++;
+			tcb->finSent = true;
+			count++;
+		}
+	}
+	return count;
+}
+
+// Resends the oldest unacknowledged segment after its timer expires
+void etherTcpRetransmit(tcpControlBlock* tcb) {
+	uint16_t length = tcb->sndNxt - tcb->sndUna;
+	if (tcb->state == TCP_SYN_RECEIVED) {
+		etherTcpSendSegment(tcb, TCP_SYN | TCP_ACK, tcb->sndUna, 0, 0);
+	} else if (tcb->sendLength > 0) {
+		if (length > tcb->sendLength)
+			length = tcb->sendLength;
+		if (length > tcb->mss)
+			length = tcb->mss;
+		etherTcpSendSegment(tcb, TCP_PSH | TCP_ACK, tcb->sndUna, 0, length);
+	} else {
+		etherTcpSendSegment(tcb, TCP_FIN | TCP_ACK, tcb->sndUna, 0, 0);
+	}
+}
 
-	// 32-bit sum over ip header
-	sum = 0;
-	etherSumWords(&ip->revSize, 10);
-	etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-	ip->headerChecksum = getEtherChecksum();
+// Retransmits segments whose timer has expired, backing off the rto, and
+// drops connections that stop answering
+// Call periodically from the main loop
+void etherTcpService() {
+	uint32_t now = getMilliseconds();
+	tcpControlBlock* tcb;
+	uint8_t i;
+	for (i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+		tcb = &tcpConnections[i];
+		if (tcb->state == TCP_CLOSED || tcb->sndNxt == tcb->sndUna
+		        || (int32_t) (now - tcb->rtoDeadline) < 0)
+			continue;
+		if (++tcb->retries > TCP_MAX_RETRIES) {
+			tcb->state = TCP_CLOSED;
+			continue;
+		}
+		// Karn: a retransmitted segment gives no rtt sample
+		tcb->rttTiming = false;
+		tcb->rto *= 2;
+		if (tcb->rto > TCP_MAX_RTO)
+			tcb->rto = TCP_MAX_RTO;
+		tcb->rtoDeadline = now + tcb->rto;
+		etherTcpRetransmit(tcb);
+	}
+}
 
-	// Calculate TCP Checksum
-	tcp->checksum = 0;
-	sum = 0;
-	etherSumWords(ip->sourceIp, 8);
-	tmp16 = ip->protocol;
-	sum += (tmp16 & 0xff) << 8;
-	sum += ((tcpSize * 4) & 0xff) << 8;
-	etherSumWords(tcp, tcpSize * 4);
+// Takes the acknowledgment and window from a segment of a known connection
+// Acknowledged data is released from the send buffer, the rtt is sampled and
+// any data the window now allows is sent
+// Call for every TCP segment before acting on it
+void etherProcessTcpAck(etherPacketInfo* info) {
+	tcpControlBlock* tcb = etherTcpFindInfo(info);
+	tcpFrame* tcp = (tcpFrame*) info->transport;
+	uint32_t now = getMilliseconds();
+	uint32_t acked;
+	if (tcb == NULL || (info->tcpFlags & TCP_ACK) == 0)
+		return;
+	// only acks of data we sent and that was not yet acknowledged move sndUna
+	if ((int32_t) (info->ackNumber - tcb->sndUna) > 0 && (int32_t) (info->ackNumber - tcb->sndNxt) <= 0) {
+		// our SYN comes before any data and our FIN after it, so the buffer
+		// only holds the data part of what was acknowledged
+		acked = info->ackNumber - tcb->sndUna;
+		if (acked > tcb->sendLength)
+			acked = tcb->sendLength;
+		tcb->sendStart = (tcb->sendStart + acked) % TCP_SEND_BUFFER_SIZE;
+		tcb->sendLength -= acked;
+		tcb->sndUna = info->ackNumber;
+		if (tcb->rttTiming && (int32_t) (info->ackNumber - tcb->rttSequence) >= 0) {
+			tcb->rttTiming = false;
+			etherTcpUpdateRtt(tcb, now - tcb->rttStart);
+		}
+		tcb->retries = 0;
+		tcb->rtoDeadline = now + tcb->rto;
+	}
+	tcb->sndWnd = ntohs(tcp->windowSize);
+	etherTcpOutput(tcb);
+}
 
-	tcp->checksum = getEtherChecksum();
+// Sends what each connection has waiting that the window and Nagle allow,
+// such as segments that could not be queued while every tx slot was in use
+// Call once tx slots free up (the EVENT_ETHER_TX handler)
+void etherTcpPoll() {
+	uint8_t i;
+	for (i = 0; i < TCP_MAX_CONNECTIONS; i++) {
+		if (tcpConnections[i].state != TCP_CLOSED)
+			etherTcpOutput(&tcpConnections[i]);
+	}
+}
 
-	// send packet with size = ether + ip header + tcp_size
-	etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + (tcpSize * 4));
+// Checks if the TCP packet was a SYN
+bool etherIsTcpSYN(etherPacketInfo* info) {
+	return (info->tcpFlags & TCP_SYN) != 0;
 }
 
-// Send Telnet data
-void etherSendTelnetData(uint8_t packet[], uint8_t* telnetData, uint8_t telnetSize) {
-	etherFrame* ether = (etherFrame*) packet;
-	ipFrame* ip = (ipFrame*) &ether->data;
-	tcpFrame* tcp = (tcpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
+// Checks if the TCP packet was an ACK of the last segment sent on its connection
+bool etherIsTcpAck(etherPacketInfo* info) {
+	tcpControlBlock* tcb = etherTcpFindInfo(info);
+	return tcb != NULL && (info->tcpFlags & TCP_ACK) != 0 && info->ackNumber == tcb->sndNxt;
+}
 
+// Checks if the TCP packet was Telnet Data
+// Several of our segments may still be in flight, so any ack up to sndNxt is accepted
+// A FIN is left to etherIsTcpFINACK, which takes any data in front of it
+bool etherIsTelnetData(etherPacketInfo* info) {
+	tcpControlBlock* tcb = etherTcpFindInfo(info);
+	bool ok = (info->tcpFlags & (TCP_FIN | TCP_ACK)) == TCP_ACK && info->payloadLength > 0;
+	return ok && tcb != NULL && tcb->state == TCP_ESTABLISHED
+	        && (int32_t) (info->ackNumber - tcb->sndNxt) <= 0;
+}
+
+// Swaps the addresses and ports of a received segment so it can be sent back
+// Leaves the ip and tcp checksums unchanged
+void etherTcpSwapAddresses(etherFrame* ether, ipFrame* ip, tcpFrame* tcp) {
 	uint8_t i, tmp8;
+	uint16_t tmp16;
 	// swap source and destination fields
 	for (i = 0; i < HW_ADD_LENGTH; i++) {
 		tmp8 = ether->destAddress[i];
@@ -1455,94 +2905,212 @@ void etherSendTelnetData(uint8_t packet[], uint8_t* telnetData, uint8_t telnetSi
 	// dest port of resp will be left at source port of req
 	// unusual nomenclature, but this allows a different tx
 	// and rx port on other machine
-	uint16_t tmp16 = tcp->destPort;
+	tmp16 = tcp->destPort;
 	tcp->destPort = tcp->sourcePort;
 	tcp->sourcePort = tmp16;
+}
 
-	tcp->ackNumber = htols(htols(tcp->sequenceNumber) + 1);
-	tcp->sequenceNumber = htols(currentIsn);
-	currentIsn += telnetSize;
+// Send SYN ACK in response to SYN
+// Opens a connection in TCP_SYN_RECEIVED, or resends the SYN ACK of one
+// Drops the SYN if every connection is in use
+void etherSendTcpSynAck(uint8_t packet[]) {
+	etherFrame* ether = (etherFrame*) packet;
+	ipFrame* ip = (ipFrame*) &ether->data;
+	tcpFrame* tcp = (tcpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
+	tcpControlBlock* tcb = etherTcpFindSegment(ip, tcp);
+	uint8_t* option;
+	uint8_t* optionEnd;
+	uint8_t i = 0;
 
-	tcp->headerLength = htons(tcp->headerLength);
+	// a SYN on a connection past the handshake starts it over
+	if (tcb == NULL || tcb->state != TCP_SYN_RECEIVED) {
+		if (tcb == NULL) {
+			while (i < TCP_MAX_CONNECTIONS && tcpConnections[i].state != TCP_CLOSED)
+				i++;
+			if (i == TCP_MAX_CONNECTIONS)
+				return;
+			tcb = &tcpConnections[i];
+		}
+		memcpy(tcb->remoteIp, ip->sourceIp, IP_ADD_LENGTH);
+		tcb->remotePort = ntohs(tcp->sourcePort);
+		tcb->localPort = ntohs(tcp->destPort);
+		tcb->sndUna = etherTcpNewIsn();
+		tcb->state = TCP_SYN_RECEIVED;
+		tcb->finSent = false;
+		tcb->ackPending = false;
+		tcb->sendStart = 0;
+		tcb->sendLength = 0;
+		tcb->retries = 0;
+		tcb->srtt8 = 0;
+		tcb->rttvar4 = 0;
+		tcb->rto = TCP_INITIAL_RTO;
+		tcb->rttTiming = true;
+		tcb->rttSequence = tcb->sndUna + 1;
+		tcb->rttStart = getMilliseconds();
+	} else {
+		// the peer resent its SYN, so our SYN ACK no longer gives an rtt sample
+		tcb->rttTiming = false;
+	}
+	// the SYN takes one sequence number on each side
+	tcb->sndNxt = tcb->sndUna + 1;
+	tcb->rtoDeadline = getMilliseconds() + tcb->rto;
+
+	// take the peer's mss option, if any
+	// each option has to fit in the header, and an mss too small to be real
+	// is ignored
+	tcb->mss = TCP_DEFAULT_MSS;
+	option = tcp->options;
+	optionEnd = (uint8_t*) tcp + (htons(tcp->headerLength) >> 12) * 4;
+	while (option < optionEnd && *option != 0) {
+		if (*option == 1) {
+			option++;
+			continue;
+		}
+		if (optionEnd - option < 2 || option[1] < 2 || optionEnd - option < option[1])
+			break;
+		if (option[0] == 2 && option[1] == 4)
+			tcb->mss = (option[2] << 8) | option[3];
+		option += option[1];
+	}
+	if (tcb->mss < TCP_MIN_MSS)
+		tcb->mss = TCP_DEFAULT_MSS;
+	if (tcb->mss > TCP_MSS)
+		tcb->mss = TCP_MSS;
+	tcb->rcvNxt = htols(tcp->sequenceNumber) + 1;
+	tcb->sndWnd = ntohs(tcp->windowSize);
+
+	etherTcpSwapAddresses(ether, ip, tcp);
+
+	// The swaps above leave both checksums unchanged, and the ip header is
+	// otherwise untouched, so only the tcp fields rewritten below are folded
+	// into the tcp checksum incrementally
+	uint16_t check = tcp->checksum;
+	uint32_t old32;
+	uint16_t tmp16;
 
-	uint8_t tcpSize = (tcp->headerLength >> 12);
+	// Acknowledge the SYN
+	old32 = tcp->ackNumber;
+	tcp->ackNumber = htols(tcb->rcvNxt);
+	check = checksumUpdate32(check, old32, tcp->ackNumber);
 
-	tcp->headerLength = htons(tcp->headerLength);
+	// Send our SYN with the connection's initial sequence number
+	old32 = tcp->sequenceNumber;
+	tcp->sequenceNumber = htols(tcb->sndUna);
+	check = checksumUpdate32(check, old32, tcp->sequenceNumber);
 
-	// Copy data to TCP Frame
-	uint8_t* copyData;
-	copyData = &tcp->data;
-	for (i = 0; i < telnetSize; i++)
-		copyData[i] = telnetData[i];
+	// Advertise our receive window
+	tmp16 = tcp->windowSize;
+	tcp->windowSize = htons(TCP_RECEIVE_WINDOW);
+	check = checksumUpdate16(check, tmp16, tcp->windowSize);
 
-	// Update lenght in IP Header
-	ip->length = htons(40 + telnetSize);
+	tmp16 = tcp->headerLength;
+	tcp->headerLength = htons(tcp->headerLength);
 
-	// 32-bit sum over ip header
-	sum = 0;
-	etherSumWords(&ip->revSize, 10);
-	etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-	ip->headerChecksum = getEtherChecksum();
+	// Set ACK Flag
+	tcp->headerLength |= (1 << 4);
 
-	// Calculate TCP Checksum
-	tcp->checksum = 0;
-	sum = 0;
-	etherSumWords(ip->sourceIp, 8);
-	tmp16 = ip->protocol;
-	sum += (tmp16 & 0xff) << 8;
-	sum += ((tcpSize * 4 + telnetSize) & 0xff) << 8;
-	etherSumWords(tcp, tcpSize * 4);
-	etherSumWords(&tcp->data, telnetSize);
+	uint8_t tcpSize = tcp->headerLength >> 12;
 
-	tcp->checksum = getEtherChecksum();
+	tcp->headerLength = htons(tcp->headerLength);
+	tcp->checksum = checksumUpdate16(check, tmp16, tcp->headerLength);
 
-	// send packet with size = ether + udp hdr + ip header + tcp_size + tcp_data
-	etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + (tcpSize * 4) + telnetSize);
+	// send packet with size = ether + ip header + tcp_size
+	etherQueuePacket(ether, 14 + ((ip->revSize & 0xF) * 4) + (tcpSize * 4));
+}
+
+// Takes the data of a received segment for its connection
+// Returns the number of new bytes at info->payload, or 0 for a segment we
+// already have or one that is out of order; either way the segment is owed
+// an ack, which goes out with the next etherTcpFlush
+uint16_t etherTcpReceive(etherPacketInfo* info) {
+	tcpControlBlock* tcb = etherTcpFindInfo(info);
+	if (tcb == NULL)
+		return 0;
+	tcb->ackPending = true;
+	if (info->sequenceNumber != tcb->rcvNxt)
+		return 0;
+	tcb->rcvNxt += info->payloadLength;
+	return info->payloadLength;
+}
+
+// Appends data to the send buffer of a connection without sending it, so
+// output written a little at a time is sent together by etherTcpFlush
+// Returns the number of bytes that fit
+uint16_t etherTcpWrite(uint8_t connection, const uint8_t data[], uint16_t size) {
+	if (connection >= TCP_MAX_CONNECTIONS || tcpConnections[connection].state != TCP_ESTABLISHED)
+		return 0;
+	return etherTcpQueue(&tcpConnections[connection], data, size);
+}
+
+// Sends what has been written to a connection as the window and Nagle allow
+// The ack of received data rides on the first segment, or goes out on its
+// own if no data could be sent
+void etherTcpFlush(uint8_t connection) {
+	tcpControlBlock* tcb;
+	if (connection >= TCP_MAX_CONNECTIONS)
+		return;
+	tcb = &tcpConnections[connection];
+	if (etherTcpOutput(tcb) == 0 && tcb->ackPending)
+		etherTcpSendSegment(tcb, TCP_ACK, tcb->sndNxt, 0, 0);
 }
 
 // Checks if the TCP packet was a FIN_ACK
-bool etherIsTcpFINACK(uint8_t packet[]) {
-	etherFrame* ether = (etherFrame*) packet;
-	ipFrame* ip = (ipFrame*) &ether->data;
-	tcpFrame* tcp = (tcpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
-	bool ok = (htons(tcp->headerLength) >> 4) & 1 && htons(tcp->headerLength) & 1;
-	uint32_t tmp32 = htols(tcp->ackNumber);
-	return ok && tmp32 == currentIsn;
+bool etherIsTcpFINACK(etherPacketInfo* info) {
+	tcpControlBlock* tcb = etherTcpFindInfo(info);
+	bool ok = (info->tcpFlags & (TCP_FIN | TCP_ACK)) == (TCP_FIN | TCP_ACK);
+	return ok && tcb != NULL && (int32_t) (info->ackNumber - tcb->sndNxt) <= 0;
 }
 
 
 // Send ACK and FIN ACK in response to FIN ACK
+// Moves the connection to TCP_LAST_ACK
 void etherSendAckFinAck(uint8_t packet[]) {
 	etherFrame* ether = (etherFrame*) packet;
 	ipFrame* ip = (ipFrame*) &ether->data;
 	tcpFrame* tcp = (tcpFrame*) ((uint8_t*) ip + ((ip->revSize & 0xF) * 4));
+	tcpControlBlock* tcb = etherTcpFindSegment(ip, tcp);
 
-	uint8_t i, tmp8;
-	// swap source and destination fields
-	for (i = 0; i < HW_ADD_LENGTH; i++) {
-		tmp8 = ether->destAddress[i];
-		ether->destAddress[i] = ether->sourceAddress[i];
-		ether->sourceAddress[i] = tmp8;
-	}
-	for (i = 0; i < IP_ADD_LENGTH; i++) {
-		tmp8 = ip->destIp[i];
-		ip->destIp[i] = ip->sourceIp[i];
-		ip->sourceIp[i] = tmp8;
-	}
-	// set source port of resp will be dest port of req
-	// dest port of resp will be left at source port of req
-	// unusual nomenclature, but this allows a different tx
-	// and rx port on other machine
-	uint16_t tmp16 = tcp->destPort;
-	tcp->destPort = tcp->sourcePort;
-	tcp->sourcePort = tmp16;
-
-	// Set ACK Number as +1 of Seq Number
-	tcp->ackNumber = htols(htols(tcp->sequenceNumber) + 1);
-
-	// Increment Seq Number (since no data is sent)
-	tcp->sequenceNumber = htols(currentIsn++);
+	if (tcb == NULL)
+		return;
 
+	uint16_t tmp16 = htons(tcp->headerLength);
+	uint8_t tcpSize = tmp16 >> 12;
+
+	// The FIN takes one sequence number after any data in the segment
+	uint16_t dataSize = ntohs(ip->length) - ((ip->revSize & 0xF) * 4) - (tcpSize * 4);
+	tcb->rcvNxt = htols(tcp->sequenceNumber) + dataSize + 1;
+
+	// Data not yet sent is dropped, since our FIN has to follow what is in flight
+	if (tcb->sendLength > tcb->sndNxt - tcb->sndUna)
+		tcb->sendLength = tcb->sndNxt - tcb->sndUna;
+	etherTcpStartTimer(tcb, getMilliseconds());
+
+	etherTcpSwapAddresses(ether, ip, tcp);
+
+	// The swaps above leave both checksums unchanged and the ip header is
+	// otherwise untouched, so the tcp checksum is updated incrementally
+	uint16_t check = tcp->checksum;
+	uint32_t old32;
+
+	// Acknowledge the data and the FIN
+	old32 = tcp->ackNumber;
+	tcp->ackNumber = htols(tcb->rcvNxt);
+	check = checksumUpdate32(check, old32, tcp->ackNumber);
+
+	// Our FIN follows the last data we sent
+	old32 = tcp->sequenceNumber;
+	tcp->sequenceNumber = htols(tcb->sndNxt);
+	check = checksumUpdate32(check, old32, tcp->sequenceNumber);
+	tcb->sndNxt++;
+	tcb->finSent = true;
+	tcb->state = TCP_LAST_ACK;
+
+	// Advertise our receive window
+	tmp16 = tcp->windowSize;
+	tcp->windowSize = htons(TCP_RECEIVE_WINDOW);
+	check = checksumUpdate16(check, tmp16, tcp->windowSize);
+
+	tmp16 = tcp->headerLength;
 	tcp->headerLength = htons(tcp->headerLength);
 
 	// Set ACK Flag
@@ -1552,31 +3120,13 @@ void etherSendAckFinAck(uint8_t packet[]) {
 	tcp->headerLength = tcp->headerLength >> 1;
 	tcp->headerLength = tcp->headerLength << 1;
 
-
-	uint8_t tcpSize = tcp->headerLength >> 12;
-
 	tcp->headerLength = htons(tcp->headerLength);
-
-	// 32-bit sum over ip header
-	sum = 0;
-	etherSumWords(&ip->revSize, 10);
-	etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-	ip->headerChecksum = getEtherChecksum();
-
-
-	tcp->checksum = 0;
-	sum = 0;
-	etherSumWords(ip->sourceIp, 8);
-	tmp16 = ip->protocol;
-	sum += (tmp16 & 0xff) << 8;
-	sum += ((tcpSize * 4) & 0xff) << 8;
-	etherSumWords(tcp, tcpSize * 4);
-
-	tcp->checksum = getEtherChecksum();
+	tcp->checksum = checksumUpdate16(check, tmp16, tcp->headerLength);
 
 	// send packet with size = ether + ip header + tcp_size
-	etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + (tcpSize * 4));
+	etherQueuePacket(ether, 14 + ((ip->revSize & 0xF) * 4) + (tcpSize * 4));
 
+	tmp16 = tcp->headerLength;
 	tcp->headerLength = htons(tcp->headerLength);
 
 	// Set FIN Flag
@@ -1584,50 +3134,9 @@ void etherSendAckFinAck(uint8_t packet[]) {
 
 	tcp->headerLength = htons(tcp->headerLength);
 
-	// Recalculate checksum
-	tcp->checksum = 0;
-	sum = 0;
-	etherSumWords(ip->sourceIp, 8);
-	tmp16 = ip->protocol;
-	sum += (tmp16 & 0xff) << 8;
-	sum += ((tcpSize * 4) & 0xff) << 8;
-	etherSumWords(tcp, tcpSize * 4);
-
-	tcp->checksum = getEtherChecksum();
+	// Update checksum for the flags change
+	tcp->checksum = checksumUpdate16(tcp->checksum, tmp16, tcp->headerLength);
 
 	// send packet with size = ether + ip header + tcp_size
-	etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + (tcpSize * 4));
-
-}
-
-
-// Get an option from DHCP options field. MUST have the option number
-uint8_t* getOption(uint8_t options[0], uint8_t number, uint8_t size) {
-	uint8_t i = 0;
-	while (i < size) {
-		if (options[i] == number) {
-			// return the start of the value of that option
-			return &options[i + 2];
-		} else {
-			// Increment i by the length of current option
-			i += options[i + 1] + 2;
-		}
-	}
-	return NULL;
-}
-
-// Put an option
-uint8_t putOption(uint8_t options[0], uint8_t size, uint8_t number, uint8_t count, ...) {
-	options[size++] = number;
-	options[size++] = count;
-
-	uint8_t i = 0;
-
-	va_list ap;
-	va_start(ap, count);
-
-	for (i = 0; i < count; i++) {
-		options[size++] = va_arg(ap, uint8_t);
-	}
-	return size;
+	etherQueuePacket(ether, 14 + ((ip->revSize & 0xF) * 4) + (tcpSize * 4));
 }
@@ -39,6 +39,14 @@
 
 #define ETHER_HALFDUPLEX     0x00
 #define ETHER_FULLDUPLEX     0x100
+#define ETHER_INTERRUPT      0x200
+#define ETHER_HWCHECKSUM     0x400
+
+// Events returned by etherGetEvents (EIR bit positions)
+#define ETHER_EVENT_RXERR    0x01
+#define ETHER_EVENT_TX       0x08
+#define ETHER_EVENT_LINK     0x10
+#define ETHER_EVENT_RX       0x40
 
 #define LOBYTE(x) ((x) & 0xFF)
 #define HIBYTE(x) (((x) >> 8) & 0xFF)
@@ -49,17 +57,136 @@
 
 #define TTL 64
 
+// Receive bursts
+// Frames read per pass before other events get a turn, and the fill of the
+// rx buffer (percent) beyond which only critical frames are read
+#ifndef ETHER_RX_BUDGET
+#define ETHER_RX_BUDGET 4
+#endif
+#ifndef ETHER_RX_HIGH_WATER
+#define ETHER_RX_HIGH_WATER 75
+#endif
+
+// Bytes read by etherPeekPacket to classify a frame
+// Ether header (14) + IP header (20) + TCP header (20)
+#define ETHER_PEEK_SIZE 54
+
+// Packet classification flags (etherClassify)
+#define ETHER_PKT_ARP_REQUEST   0x0001
+#define ETHER_PKT_ARP_RESPONSE  0x0002
+#define ETHER_PKT_IP            0x0004
+#define ETHER_PKT_IP_UNICAST    0x0008
+#define ETHER_PKT_IP_BROADCAST  0x0010
+#define ETHER_PKT_PING_REQUEST  0x0020
+#define ETHER_PKT_UDP           0x0040
+#define ETHER_PKT_TCP           0x0080
+#define ETHER_PKT_DHCP          0x0100
+#define ETHER_PKT_ICMP          0x0200
+
+// TCP connection states
+#define TCP_CLOSED       0
+#define TCP_SYN_RECEIVED 1
+#define TCP_ESTABLISHED  2
+#define TCP_LAST_ACK     3
+
+// TCP connections, numbered 0 to TCP_MAX_CONNECTIONS - 1
+#define TCP_MAX_CONNECTIONS 4
+#define TCP_NO_CONNECTION   0xFF
+
+// TCP flags
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+// Result of a single parse of a received frame
+// Header pointers are into the packet buffer, numbers are in host order
+typedef struct _etherPacketInfo
+{
+    uint16_t flags;
+    uint16_t size;
+    uint8_t* ip;
+    uint8_t* transport;
+    uint8_t* payload;
+    uint16_t payloadLength;
+    uint16_t sourcePort;
+    uint16_t destPort;
+    uint8_t tcpFlags;
+    uint32_t sequenceNumber;
+    uint32_t ackNumber;
+} etherPacketInfo;
+
+// Frame operations of a MAC driver
+// The protocol code reaches the controller only through these, so another
+// backend can be plugged in with etherSetDriver; enc28j60Driver is the default
+// and host/pcap.c replays a capture file in the host build
+typedef struct _etherDriver
+{
+    uint8_t (*getEvents)();
+    bool (*isEventPending)();
+    uint8_t (*getPacketCount)();
+    bool (*isRxCongested)();
+    uint16_t (*peekPacket)(uint8_t packet[], uint16_t peekSize);
+    uint16_t (*readPacket)(uint8_t data[], uint16_t offset, uint16_t size);
+    void (*discardPacket)();
+    bool (*isTxReady)();
+    bool (*isTxIdle)();
+    bool (*sendPacket)(uint8_t packet[], uint16_t size);
+    bool (*isLinkUp)();
+} etherDriver;
+
+extern const etherDriver enc28j60Driver;
+
+// Receives the datagrams sent to a bound UDP port
+// packet is the whole frame, so a handler can answer with etherSendUdpResponse
+typedef void (*_udpHandler)(uint8_t packet[], etherPacketInfo* info);
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
 void etherInit(uint16_t mode);
+uint16_t etherReadPhy(uint8_t reg);
+void etherSetDriver(const etherDriver* driver);
+void etherSetReceiveFilters(uint16_t mode);
+void etherClearMulticastHash();
+void etherAddMulticastAddress(const uint8_t mac[6]);
+void etherSetPatternMatch(uint16_t offset, const uint8_t pattern[64], const uint8_t mask[8]);
+void etherEnterWakeOnLan();
+void etherExitWakeOnLan();
+void etherPowerDown();
+void etherPowerUp();
+uint32_t etherGetSpiClock();
 bool etherIsLinkUp();
 
 bool etherIsDataAvailable();
+uint8_t etherGetPacketCount();
 bool etherIsOverflow();
+bool etherIsEventPending();
+uint8_t etherGetEvents();
+void etherIsr();
 uint16_t etherGetPacket(uint8_t packet[], uint16_t maxSize);
-bool etherPutPacket(uint8_t packet[], uint16_t size);
+uint16_t etherPeekPacket(uint8_t packet[], uint16_t peekSize);
+uint16_t etherReadPacket(uint8_t data[], uint16_t offset, uint16_t size);
+void etherDiscardPacket();
+bool etherIsPacketForUs(uint8_t packet[]);
+bool etherIsFrameCritical(uint8_t packet[]);
+bool etherIsRxCongested();
+void etherClassify(uint8_t packet[], uint16_t size, etherPacketInfo* info);
+// Transmit
+// etherSendPacket and etherQueuePacket return true once the frame is in a tx
+// slot, not once it is on the wire: etherSendPacket fails if no slot is free,
+// etherQueuePacket waits for one. etherIsTxIdle is true once every queued
+// frame has finished; a frame the controller aborted is counted in
+// STAT_TX_ABORTS when its TXIF is serviced, and etherWasTxOk tells whether the
+// last frame to finish got out
+bool etherSendPacket(uint8_t packet[], uint16_t size);
+bool etherIsTxReady();
+bool etherIsTxIdle();
+bool etherWasTxOk();
+bool etherQueuePacket(uint8_t packet[], uint16_t size);
+uint16_t etherReadTxPacket(uint8_t packet[], uint16_t size);
 
 bool etherIsIp(uint8_t packet[]);
 bool etherIsIpUnicast(uint8_t packet[]);
@@ -67,14 +194,27 @@ bool etherIsIpBroadcast(uint8_t packet[]);
 
 bool etherIsPingRequest(uint8_t packet[]);
 void etherSendPingResponse(uint8_t packet[]);
+bool etherSendPingResponseInBuffer(uint8_t packet[]);
+uint16_t etherGetPacketChecksum(uint16_t offset, uint16_t size);
 
 bool etherIsArpRequest(uint8_t packet[]);
 void etherSendArpResponse(uint8_t packet[]);
 void etherSendArpRequest(uint8_t packet[], uint8_t ip[]);
+void etherHandleArpResponse(uint8_t packet[]);
+bool etherArpLookup(uint8_t ip[], uint8_t mac[]);
+void etherArpUpdate(uint8_t ip[], uint8_t mac[]);
+void etherArpFlush();
+void etherArpService();
+bool etherIsIpLocal(uint8_t ip[]);
+bool etherSendIpPacket(uint8_t packet[], uint16_t size);
 
 bool etherIsUdp(uint8_t packet[]);
 uint8_t* etherGetUdpData(uint8_t packet[]);
 void etherSendUdpResponse(uint8_t packet[], uint8_t* udpData, uint8_t udpSize);
+bool etherUdpBind(uint16_t port, _udpHandler handler);
+void etherUdpUnbind(uint16_t port);
+bool etherUdpDispatch(uint8_t packet[], etherPacketInfo* info);
+bool etherUdpSendTo(uint8_t ip[], uint16_t sourcePort, uint16_t destPort, uint8_t data[], uint16_t size);
 
 void etherEnableDhcpMode();
 void etherDisableDhcpMode();
@@ -106,19 +246,29 @@ void sendDhcpRequest(uint8_t packet[]);
 void sendGratiousArp(uint8_t packet[]);
 bool isDhcpOffer(uint8_t packet[]);
 uint32_t isDhcpAck(uint8_t packet[]);
-uint8_t* getOption(uint8_t options[0], uint8_t number, uint8_t size);
+bool isDhcpNak(uint8_t packet[]);
+void etherSetDhcpRequestedIp(uint8_t ip[4]);
+void etherGetDhcpServerAddress(uint8_t ip[4]);
 void getNewEtherPacket(uint8_t packet[], uint16_t frameType);
 bool isArpResponse(uint8_t packet[]);
-uint8_t putOption(uint8_t options[0], uint8_t size, uint8_t number, uint8_t count, ...);
 
 // TCP Functions
 bool etherIsTcp(uint8_t packet[]);
-bool etherIsTcpSYN(uint8_t packet[]);
-bool etherIsTelnetData(uint8_t packet[]);
+bool etherIsTcpSYN(etherPacketInfo* info);
+bool etherIsTelnetData(etherPacketInfo* info);
 void etherSendTcpSynAck(uint8_t packet[]);
-void etherSendTelnetData(uint8_t packet[], uint8_t* telnetData, uint8_t telnetSize);
-bool etherIsTcpFINACK(uint8_t packet[]);
+uint8_t etherTcpGetConnection(etherPacketInfo* info);
+uint16_t etherTcpReceive(etherPacketInfo* info);
+uint16_t etherTcpWrite(uint8_t connection, const uint8_t data[], uint16_t size);
+void etherTcpFlush(uint8_t connection);
+void etherTcpService();
+void etherTcpPoll();
+bool etherIsTcpFINACK(etherPacketInfo* info);
 void etherSendAckFinAck(uint8_t packet[]);
-bool etherIsTcpAck(uint8_t packet[]);
+bool etherIsTcpAck(etherPacketInfo* info);
+uint8_t etherGetTcpState(etherPacketInfo* info);
+void etherSetTcpState(etherPacketInfo* info, uint8_t state);
+uint8_t etherGetTcpConnectionCount();
+void etherProcessTcpAck(etherPacketInfo* info);
 
 #endif
@@ -60,6 +60,7 @@ void selectPinInterruptHighLevel(PORT port, uint8_t pin);
 void selectPinInterruptLowLevel(PORT port, uint8_t pin);
 void enablePinInterrupt(PORT port, uint8_t pin);
 void disablePinInterrupt(PORT port, uint8_t pin);
+void clearPinInterrupt(PORT port, uint8_t pin);
 
 void setPinValue(PORT port, uint8_t pin, bool value);
 bool getPinValue(PORT port, uint8_t pin);
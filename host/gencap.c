@@ -0,0 +1,177 @@
+// Sample Capture Generator
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Linux host (replay build)
+
+// Writes the capture make check replays: from a peer on the local network,
+// an ARP request, a ping, a UDP echo request and a Telnet SYN, each of which
+// gets one reply, and a datagram for another host, which gets none
+// usage: gencap sample.pcap
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "checksum.h"
+#include "replay.h"
+
+#define FRAME_ARP  0x0806
+#define FRAME_IP   0x0800
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+const uint8_t ourMac[6] = { REPLAY_MAC };
+const uint8_t ourIp[4] = { REPLAY_IP };
+const uint8_t peerMac[6] = { REPLAY_PEER_MAC };
+const uint8_t peerIp[4] = { REPLAY_PEER_IP };
+const uint8_t otherIp[4] = { 192, 168, 1, 2 };
+const uint8_t broadcastMac[6] = { 255, 255, 255, 255, 255, 255 };
+
+uint8_t frame[1514];
+FILE* capture;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void put16(uint8_t* p, uint16_t value) {
+	p[0] = value >> 8;
+	p[1] = value & 0xFF;
+}
+
+void put32(uint8_t* p, uint32_t value) {
+	put16(p, value >> 16);
+	put16(p + 2, value & 0xFFFF);
+}
+
+// Appends a frame to the capture
+void writeFrame(uint16_t size) {
+	uint32_t record[4] = { 0, 0, size, size };
+	fwrite(record, sizeof(record), 1, capture);
+	fwrite(frame, 1, size, capture);
+}
+
+// Fills in the ether header, returning where its data starts
+uint8_t* putEther(const uint8_t dest[6], uint16_t type) {
+	memcpy(frame, dest, 6);
+	memcpy(&frame[6], peerMac, 6);
+	put16(&frame[12], type);
+	return &frame[14];
+}
+
+// Fills in an ip header for length bytes of data, returning where they start
+uint8_t* putIp(const uint8_t dest[4], uint8_t protocol, uint16_t length) {
+	uint8_t* ip = putEther(ourMac, FRAME_IP);
+	uint16_t check;
+	memset(ip, 0, 20);
+	ip[0] = 0x45;
+	put16(&ip[2], 20 + length);
+	ip[8] = 64;
+	ip[9] = protocol;
+	memcpy(&ip[12], peerIp, 4);
+	memcpy(&ip[16], dest, 4);
+	check = checksumFinish(checksumAdd(0, ip, 20));
+	memcpy(&ip[10], &check, 2);
+	return ip + 20;
+}
+
+// Checksum over the pseudo-header and length bytes of the transport header and data
+uint16_t transportChecksum(uint8_t* transport, uint8_t protocol, uint16_t length) {
+	uint8_t* ip = transport - 20;
+	uint32_t sum = checksumAdd(0, &ip[12], 8);
+	uint8_t pseudo[4] = { 0, protocol, length >> 8, length & 0xFF };
+	sum = checksumAdd(sum, pseudo, 4);
+	return checksumFinish(checksumAdd(sum, transport, length));
+}
+
+void writeArpRequest() {
+	uint8_t* arp = putEther(broadcastMac, FRAME_ARP);
+	put16(&arp[0], 1);
+	put16(&arp[2], FRAME_IP);
+	arp[4] = 6;
+	arp[5] = 4;
+	put16(&arp[6], 1);
+	memcpy(&arp[8], peerMac, 6);
+	memcpy(&arp[14], peerIp, 4);
+	memset(&arp[18], 0, 6);
+	memcpy(&arp[24], ourIp, 4);
+	writeFrame(14 + 28);
+}
+
+void writePing() {
+	uint16_t length = 8 + 56, check, i;
+	uint8_t* icmp = putIp(ourIp, 1, length);
+	icmp[0] = 8;
+	icmp[1] = 0;
+	put16(&icmp[2], 0);
+	put16(&icmp[4], 1);
+	put16(&icmp[6], 1);
+	for (i = 0; i < 56; i++)
+		icmp[8 + i] = i;
+	check = checksumFinish(checksumAdd(0, icmp, length));
+	memcpy(&icmp[2], &check, 2);
+	writeFrame(14 + 20 + length);
+}
+
+void writeUdp(const uint8_t dest[4], uint16_t port, const char* text) {
+	uint16_t length = 8 + strlen(text), check;
+	uint8_t* udp = putIp(dest, 17, length);
+	put16(&udp[0], 40000);
+	put16(&udp[2], port);
+	put16(&udp[4], length);
+	put16(&udp[6], 0);
+	memcpy(&udp[8], text, strlen(text));
+	check = transportChecksum(udp, 17, length);
+	memcpy(&udp[6], &check, 2);
+	writeFrame(14 + 20 + length);
+}
+
+void writeTcpSyn() {
+	uint16_t length = 24, check;
+	uint8_t* tcp = putIp(ourIp, 6, length);
+	put16(&tcp[0], 40001);
+	put16(&tcp[2], REPLAY_TELNET_PORT);
+	put32(&tcp[4], 1000);
+	put32(&tcp[8], 0);
+	put16(&tcp[12], (6 << 12) | 0x02);
+	put16(&tcp[14], 8192);
+	put32(&tcp[16], 0);
+	// mss option
+	tcp[20] = 2;
+	tcp[21] = 4;
+	put16(&tcp[22], 1460);
+	check = transportChecksum(tcp, 6, length);
+	memcpy(&tcp[16], &check, 2);
+	writeFrame(14 + 20 + length);
+}
+
+int main(int argc, char* argv[]) {
+	uint32_t header[6] = { 0xA1B2C3D4, 0x00040002, 0, 0, 65535, 1 };
+	if (argc != 2) {
+		fprintf(stderr, "usage: gencap sample.pcap\n");
+		return 2;
+	}
+	capture = fopen(argv[1], "wb");
+	if (capture == NULL) {
+		fprintf(stderr, "gencap: cannot write %s\n", argv[1]);
+		return 2;
+	}
+	fwrite(header, sizeof(header), 1, capture);
+	writeArpRequest();
+	writePing();
+	writeUdp(ourIp, REPLAY_ECHO_PORT, "replay");
+	writeTcpSyn();
+	writeUdp(otherIp, REPLAY_ECHO_PORT, "not for us");
+	fclose(capture);
+	return 0;
+}
@@ -0,0 +1,164 @@
+// Host Hardware Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Linux host (replay build)
+
+// Stand-ins for the TM4C123 drivers the protocol code links against
+// The ENC28J60 backend is never selected on the host, so the GPIO and SPI
+// calls it makes do nothing; time comes from the monotonic clock, the EEPROM
+// is a RAM array that starts out erased and the console is stdout
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include "gpio.h"
+#include "spi0.h"
+#include "wait.h"
+#include "eprom.h"
+#include "timer.h"
+#include "scheduler.h"
+#include "uart0.h"
+
+#define EEPROM_WORDS 512
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+uint32_t eepromWords[EEPROM_WORDS];
+bool eepromErased = false;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// GPIO
+void enablePort(PORT port) {
+}
+
+void selectPinPushPullOutput(PORT port, uint8_t pin) {
+}
+
+void selectPinDigitalInput(PORT port, uint8_t pin) {
+}
+
+void selectPinInterruptFallingEdge(PORT port, uint8_t pin) {
+}
+
+void enablePinInterrupt(PORT port, uint8_t pin) {
+}
+
+void clearPinInterrupt(PORT port, uint8_t pin) {
+}
+
+void setPinValue(PORT port, uint8_t pin, bool value) {
+}
+
+bool getPinValue(PORT port, uint8_t pin) {
+	return true;
+}
+
+// SPI0
+void initSpi0(uint32_t pinMask) {
+}
+
+void setSpi0BaudRate(uint32_t clockRate, uint32_t fcyc) {
+}
+
+void setSpi0Mode(uint8_t polarity, uint8_t phase) {
+}
+
+void writeSpi0Data(uint32_t data) {
+}
+
+uint32_t readSpi0Data() {
+	return 0;
+}
+
+void initSpi0Dma() {
+}
+
+void readSpi0Buffer(uint8_t buffer[], uint16_t size) {
+	uint16_t i;
+	for (i = 0; i < size; i++)
+		buffer[i] = 0;
+}
+
+void writeSpi0Buffer(const uint8_t buffer[], uint16_t size) {
+}
+
+// Wait
+void waitMicrosecond(uint32_t us) {
+}
+
+// EEPROM
+uint32_t* getEepromWord(uint16_t add) {
+	uint16_t i;
+	if (!eepromErased) {
+		for (i = 0; i < EEPROM_WORDS; i++)
+			eepromWords[i] = 0xFFFFFFFF;
+		eepromErased = true;
+	}
+	return &eepromWords[add % EEPROM_WORDS];
+}
+
+void readEepromWords(uint16_t add, uint32_t data[], uint8_t count) {
+	uint8_t i;
+	for (i = 0; i < count; i++)
+		data[i] = *getEepromWord(add + i);
+}
+
+void startEepromWrite(uint16_t add, uint32_t data) {
+	*getEepromWord(add) = data;
+}
+
+bool isEepromBusy() {
+	return false;
+}
+
+// Timer
+// Timers never expire on the host, since the replay drives the stack directly
+timerHandle startTimer(_callback callback, uint32_t ms, bool periodic) {
+	return TIMER_INVALID;
+}
+
+bool cancelTimer(timerHandle handle) {
+	return false;
+}
+
+uint32_t getMilliseconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint32_t getUptime() {
+	return getMilliseconds() / 1000;
+}
+
+// Scheduler
+// The replay polls the backend, so events are not needed
+void postEvent(uint8_t event) {
+}
+
+// UART0
+void putcUart0(char c) {
+	putchar(c);
+}
+
+void putsUart0(char* str) {
+	fputs(str, stdout);
+}
+
+void putUintUart0(uint32_t value) {
+	printf("%u", value);
+}
@@ -0,0 +1,104 @@
+// Console Line Test
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Linux host (replay build)
+
+// Feeds command lines through editLine and parseFields the way a Telnet
+// session does, and checks the fields that come out
+// A line with more than MAX_FIELDS fields must keep the first MAX_FIELDS and
+// leave the memory past the USER_DATA alone
+// usage: linetest; the exit status is 1 if any line fails
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "uart0.h"
+
+#define GUARD_SIZE  16
+#define GUARD_BYTE  0xA5
+
+// A line with the bytes a session keeps after it, so an overflow shows up
+typedef struct _guardedLine {
+	USER_DATA data;
+	uint8_t guard[GUARD_SIZE];
+} guardedLine;
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+guardedLine line;
+uint8_t failures = 0;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// uart0Isr posts an event, which the test never handles
+void postEvent(uint8_t event) {
+}
+
+// Runs text and a carriage return through the line editor, then the parser
+void parseText(const char* text) {
+	bool done = false;
+	uint8_t i;
+	memset(&line.data, 0, sizeof(line.data));
+	memset(line.guard, GUARD_BYTE, GUARD_SIZE);
+	for (i = 0; !done && text[i] != '\0'; i++)
+		done = editLine(&line.data, text[i], false);
+	if (!done)
+		editLine(&line.data, '\r', false);
+	parseFields(&line.data);
+}
+
+// Returns true if nothing was written past the USER_DATA
+bool isGuardIntact() {
+	uint8_t i;
+	for (i = 0; i < GUARD_SIZE; i++) {
+		if (line.guard[i] != GUARD_BYTE)
+			return false;
+	}
+	return true;
+}
+
+// Checks that text parses to the fields in expect, separated by spaces
+void checkLine(const char* text, const char* expect, uint8_t count) {
+	char fields[MAX_CHARS + 1] = "";
+	char* field;
+	bool ok;
+	uint8_t i;
+
+	parseText(text);
+	ok = isGuardIntact() && line.data.fieldCount == count;
+	for (i = 1; ok && i <= line.data.fieldCount; i++) {
+		field = getFieldString(&line.data, i);
+		if (strlen(fields) + strlen(field) + 2 > sizeof(fields))
+			break;
+		if (i > 1)
+			strcat(fields, " ");
+		strcat(fields, field);
+	}
+	ok = ok && strcmp(fields, expect) == 0;
+	printf("%s: \"%s\" -> %u fields \"%s\"\n", ok ? "ok" : "FAIL", text, line.data.fieldCount, fields);
+	if (!ok)
+		failures++;
+}
+
+int main() {
+	checkLine("set ip 192.168.1.199", "set ip 192 168 1 199", 6);
+	checkLine("reboot", "reboot", 1);
+	checkLine("a b c d e f g", "a b c d e f g", MAX_FIELDS);
+	checkLine("a b c d e f g h i j k l m n o p", "a b c d e f g", MAX_FIELDS);
+	checkLine("1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32 33 34 35 36"
+	          " 37 38 39 40", "1 2 3 4 5 6 7", MAX_FIELDS);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,251 @@
+// Capture Replay Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Linux host (replay build)
+
+// Capture files are libpcap's classic format with Ethernet link type, in
+// either byte order and with micro or nanosecond time stamps
+// The whole capture is loaded into memory first, so a replay runs at the
+// speed of the protocol code and not of the file system
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eth0.h"
+#include "packet.h"
+#include "stats.h"
+#include "pcap.h"
+
+#define PCAP_MAGIC       0xA1B2C3D4
+#define PCAP_MAGIC_NSEC  0xA1B23C4D
+#define PCAP_LINK_ETHER  1
+#define PCAP_MAX_FRAME   65535
+
+typedef struct _pcapHeader {
+	uint32_t magic;
+	uint16_t versionMajor;
+	uint16_t versionMinor;
+	int32_t zone;
+	uint32_t sigfigs;
+	uint32_t snapLength;
+	uint32_t linkType;
+} pcapHeader;
+
+typedef struct _pcapRecord {
+	uint32_t seconds;
+	uint32_t fraction;
+	uint32_t length;
+	uint32_t originalLength;
+} pcapRecord;
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+uint8_t* pcapData = NULL;
+uint32_t* pcapOffsets = NULL;
+uint16_t* pcapSizes = NULL;
+uint32_t pcapCount = 0;
+uint32_t pcapNext = 0;
+uint32_t pcapSent = 0;
+FILE* pcapOutput = NULL;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+uint32_t swap32(uint32_t value) {
+	return (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24);
+}
+
+// Loads every frame of a capture file, replacing any capture loaded before
+// Frames longer than the pool's largest buffer are cut to its size, as the
+// controller would have done with its maximum frame length
+// Returns false if the file cannot be read or is not an Ethernet capture
+bool loadPcapFile(const char* path) {
+	FILE* file = fopen(path, "rb");
+	pcapHeader header;
+	pcapRecord record;
+	uint32_t capacity = 0, used = 0, frames = 0, length;
+	bool swapped;
+	uint8_t* frame;
+
+	if (file == NULL)
+		return false;
+	if (fread(&header, sizeof(header), 1, file) != 1) {
+		fclose(file);
+		return false;
+	}
+	swapped = header.magic == swap32(PCAP_MAGIC) || header.magic == swap32(PCAP_MAGIC_NSEC);
+	if (swapped)
+		header.linkType = swap32(header.linkType);
+	else if (header.magic != PCAP_MAGIC && header.magic != PCAP_MAGIC_NSEC) {
+		fclose(file);
+		return false;
+	}
+	if (header.linkType != PCAP_LINK_ETHER) {
+		fclose(file);
+		return false;
+	}
+
+	free(pcapData);
+	free(pcapOffsets);
+	free(pcapSizes);
+	pcapData = NULL;
+	pcapOffsets = NULL;
+	pcapSizes = NULL;
+	pcapCount = 0;
+	frame = malloc(PCAP_MAX_FRAME);
+	while (frame != NULL && fread(&record, sizeof(record), 1, file) == 1) {
+		length = swapped ? swap32(record.length) : record.length;
+		if (length > PCAP_MAX_FRAME || fread(frame, 1, length, file) != length)
+			break;
+		if (length > PACKET_LARGE_SIZE)
+			length = PACKET_LARGE_SIZE;
+		if (used + length > capacity) {
+			capacity = (capacity + length) * 2;
+			pcapData = realloc(pcapData, capacity);
+		}
+		if ((frames & 1023) == 0) {
+			pcapOffsets = realloc(pcapOffsets, (frames + 1024) * sizeof(uint32_t));
+			pcapSizes = realloc(pcapSizes, (frames + 1024) * sizeof(uint16_t));
+		}
+		if (pcapData == NULL || pcapOffsets == NULL || pcapSizes == NULL)
+			break;
+		memcpy(&pcapData[used], frame, length);
+		pcapOffsets[frames] = used;
+		pcapSizes[frames] = length;
+		used += length;
+		frames++;
+	}
+	free(frame);
+	fclose(file);
+	pcapCount = frames;
+	pcapNext = 0;
+	return pcapData != NULL && pcapOffsets != NULL && pcapSizes != NULL;
+}
+
+// Writes the frames sent from now on to a capture file
+bool openPcapOutput(const char* path) {
+	pcapHeader header = { PCAP_MAGIC, 2, 4, 0, 0, PCAP_MAX_FRAME, PCAP_LINK_ETHER };
+	closePcapOutput();
+	pcapOutput = fopen(path, "wb");
+	if (pcapOutput == NULL)
+		return false;
+	return fwrite(&header, sizeof(header), 1, pcapOutput) == 1;
+}
+
+void closePcapOutput() {
+	if (pcapOutput != NULL)
+		fclose(pcapOutput);
+	pcapOutput = NULL;
+}
+
+// Starts the capture over from its first frame
+void rewindPcapFile() {
+	pcapNext = 0;
+}
+
+uint32_t getPcapFrameCount() {
+	return pcapCount;
+}
+
+uint32_t getPcapSentCount() {
+	return pcapSent;
+}
+
+// Frame operations
+
+uint8_t pcapGetEvents() {
+	return pcapNext < pcapCount ? ETHER_EVENT_RX : 0;
+}
+
+bool pcapIsEventPending() {
+	return pcapNext < pcapCount;
+}
+
+uint8_t pcapGetPacketCount() {
+	uint32_t count = pcapCount - pcapNext;
+	return count > 255 ? 255 : count;
+}
+
+bool pcapIsRxCongested() {
+	return false;
+}
+
+// Copies up to peekSize bytes of the next frame, which stays current until
+// pcapDiscardPacket
+// Returns the full frame size, or 0 once the capture has run out
+uint16_t pcapPeekPacket(uint8_t packet[], uint16_t peekSize) {
+	uint16_t size;
+	if (pcapNext >= pcapCount)
+		return 0;
+	size = pcapSizes[pcapNext];
+	memcpy(packet, &pcapData[pcapOffsets[pcapNext]], peekSize < size ? peekSize : size);
+	return size;
+}
+
+uint16_t pcapReadPacket(uint8_t data[], uint16_t offset, uint16_t size) {
+	uint16_t frameSize;
+	if (pcapNext >= pcapCount)
+		return 0;
+	frameSize = pcapSizes[pcapNext];
+	if (offset >= frameSize)
+		return 0;
+	if (size > frameSize - offset)
+		size = frameSize - offset;
+	memcpy(data, &pcapData[pcapOffsets[pcapNext] + offset], size);
+	return size;
+}
+
+void pcapDiscardPacket() {
+	if (pcapNext < pcapCount)
+		pcapNext++;
+}
+
+bool pcapIsTxReady() {
+	return true;
+}
+
+bool pcapIsTxIdle() {
+	return true;
+}
+
+bool pcapSendPacket(uint8_t packet[], uint16_t size) {
+	pcapRecord record = { 0, 0, size, size };
+	if (pcapOutput != NULL) {
+		fwrite(&record, sizeof(record), 1, pcapOutput);
+		fwrite(packet, 1, size, pcapOutput);
+	}
+	pcapSent++;
+	countStat(STAT_TX_FRAMES);
+	return true;
+}
+
+bool pcapIsLinkUp() {
+	return true;
+}
+
+const etherDriver pcapDriver = {
+	pcapGetEvents,
+	pcapIsEventPending,
+	pcapGetPacketCount,
+	pcapIsRxCongested,
+	pcapPeekPacket,
+	pcapReadPacket,
+	pcapDiscardPacket,
+	pcapIsTxReady,
+	pcapIsTxIdle,
+	pcapSendPacket,
+	pcapIsLinkUp
+};
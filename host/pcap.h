@@ -0,0 +1,36 @@
+// Capture Replay Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Linux host (replay build)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef PCAP_H_
+#define PCAP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+
+// Frame backend that receives the frames of a capture file, in order, and
+// writes the frames sent to a second capture file (or just counts them)
+extern const etherDriver pcapDriver;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+bool loadPcapFile(const char* path);
+bool openPcapOutput(const char* path);
+void closePcapOutput();
+void rewindPcapFile();
+uint32_t getPcapFrameCount();
+uint32_t getPcapSentCount();
+
+#endif
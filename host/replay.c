@@ -0,0 +1,257 @@
+// Capture Replay Harness
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Linux host (replay build)
+
+// Runs the protocol code of eth0.c over a capture file as fast as it will go
+// and reports the frames per second and the cost of each handler
+// Frames take the same path as on the board: the headers are peeked into a
+// pool buffer, the rest is read only if the frame is for us, and the frame is
+// classified once for all of the handlers; UDP and TCP data are echoed back
+// usage: replay [-l passes] [-i w.x.y.z] [-o sent.pcap] [-x replies] capture.pcap
+// With -x the exit status is 1 unless every pass sent exactly that many frames
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "eth0.h"
+#include "packet.h"
+#include "config.h"
+#include "stats.h"
+#include "pcap.h"
+#include "replay.h"
+
+// Timed handlers
+#define HANDLER_RX       0
+#define HANDLER_CLASSIFY 1
+#define HANDLER_ARP      2
+#define HANDLER_ICMP     3
+#define HANDLER_UDP      4
+#define HANDLER_TCP      5
+#define NUM_HANDLERS     6
+
+// Like cycleStats, but in ns with a total that holds a long replay
+typedef struct _handlerTime {
+	uint32_t count;
+	uint64_t total;
+	uint32_t min;
+	uint32_t max;
+} handlerTime;
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+const char* handlerNames[NUM_HANDLERS] = { "rx", "classify", "arp", "icmp", "udp", "tcp" };
+handlerTime handlerTimes[NUM_HANDLERS];
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+uint64_t getNanoseconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Times a handler from start, in ns
+void recordHandler(uint8_t handler, uint64_t start) {
+	handlerTime* t = &handlerTimes[handler];
+	uint32_t ns = getNanoseconds() - start;
+	t->count++;
+	t->total += ns;
+	if (t->count == 1 || ns < t->min)
+		t->min = ns;
+	if (ns > t->max)
+		t->max = ns;
+}
+
+// Echoes a datagram back to its sender
+void processEcho(uint8_t packet[], etherPacketInfo* info) {
+	uint8_t size = info->payloadLength > 255 ? 255 : info->payloadLength;
+	etherSendUdpResponse(packet, info->payload, size);
+}
+
+// Runs the TCP handlers the way main does, echoing data instead of running
+// Telnet commands
+void processTcp(uint8_t data[], etherPacketInfo* info) {
+	uint8_t connection;
+	uint16_t size;
+
+	etherProcessTcpAck(info);
+	if (etherIsTcpSYN(info)) {
+		if (info->destPort == REPLAY_TELNET_PORT)
+			etherSendTcpSynAck(data);
+	} else if (etherIsTcpAck(info) && etherGetTcpState(info) == TCP_SYN_RECEIVED) {
+		etherSetTcpState(info, TCP_ESTABLISHED);
+	} else if (etherIsTelnetData(info)) {
+		connection = etherTcpGetConnection(info);
+		size = etherTcpReceive(info);
+		etherTcpWrite(connection, info->payload, size);
+		etherTcpFlush(connection);
+	} else if (etherIsTcpFINACK(info)) {
+		etherSendAckFinAck(data);
+	} else if (etherIsTcpAck(info) && etherGetTcpState(info) == TCP_LAST_ACK) {
+		etherSetTcpState(info, TCP_CLOSED);
+	}
+}
+
+// Reads the next frame into data and runs the handlers for it
+void handleFrame(uint8_t data[]) {
+	etherPacketInfo info;
+	uint16_t size;
+	uint64_t start;
+	bool forUs;
+
+	start = getNanoseconds();
+	countStat(STAT_RX_FRAMES);
+	size = etherPeekPacket(data, ETHER_PEEK_SIZE);
+	forUs = etherIsPacketForUs(data);
+	if (!forUs)
+		countStat(STAT_RX_DROPPED);
+	if (forUs && size > ETHER_PEEK_SIZE) {
+		if (size > PACKET_LARGE_SIZE)
+			size = PACKET_LARGE_SIZE;
+		etherReadPacket(&data[ETHER_PEEK_SIZE], ETHER_PEEK_SIZE, size - ETHER_PEEK_SIZE);
+	}
+	etherDiscardPacket();
+	recordHandler(HANDLER_RX, start);
+	if (!forUs)
+		return;
+
+	start = getNanoseconds();
+	etherClassify(data, size, &info);
+	recordHandler(HANDLER_CLASSIFY, start);
+
+	if (info.flags & (ETHER_PKT_ARP_REQUEST | ETHER_PKT_ARP_RESPONSE)) {
+		countStat(STAT_RX_ARP);
+		start = getNanoseconds();
+		if (info.flags & ETHER_PKT_ARP_REQUEST)
+			etherSendArpResponse(data);
+		else
+			etherHandleArpResponse(data);
+		recordHandler(HANDLER_ARP, start);
+	}
+	if ((info.flags & ETHER_PKT_IP_UNICAST) && (info.flags & ETHER_PKT_PING_REQUEST)) {
+		countStat(STAT_RX_ICMP);
+		start = getNanoseconds();
+		etherSendPingResponse(data);
+		recordHandler(HANDLER_ICMP, start);
+	}
+	if ((info.flags & ETHER_PKT_IP_UNICAST) && (info.flags & ETHER_PKT_TCP)) {
+		countStat(STAT_RX_TCP);
+		start = getNanoseconds();
+		processTcp(data, &info);
+		recordHandler(HANDLER_TCP, start);
+	}
+	if (info.flags & ETHER_PKT_UDP) {
+		countStat(STAT_RX_UDP);
+		start = getNanoseconds();
+		etherUdpDispatch(data, &info);
+		recordHandler(HANDLER_UDP, start);
+	}
+}
+
+// Handles every frame of the capture once
+void replayPass() {
+	uint8_t* data;
+	rewindPcapFile();
+	while (etherGetEvents() & ETHER_EVENT_RX) {
+		data = allocPacket(PACKET_LARGE_SIZE);
+		if (data == NULL) {
+			etherDiscardPacket();
+			countStat(STAT_RX_DROPPED);
+			continue;
+		}
+		handleFrame(data);
+		freePacket(data);
+	}
+}
+
+void printReport(uint32_t frames, uint64_t ns) {
+	uint8_t i;
+	handlerTime* t;
+	printf("%u frames in %.3f ms, %.0f frames/s\n", frames, ns / 1e6, ns ? frames * 1e9 / ns : 0.0);
+	printf("%-9s %10s %9s %9s %9s\n", "handler", "count", "avg ns", "min ns", "max ns");
+	for (i = 0; i < NUM_HANDLERS; i++) {
+		t = &handlerTimes[i];
+		if (t->count == 0)
+			continue;
+		printf("%-9s %10u %9u %9u %9u\n", handlerNames[i], t->count, (uint32_t) (t->total / t->count),
+		       t->min, t->max);
+	}
+	printf("sent %u, dropped %u, checksum errors %u, pool failures %u\n", getPcapSentCount(),
+	       stats[STAT_RX_DROPPED], stats[STAT_CHECKSUM_ERRORS], stats[STAT_POOL_FAILURES]);
+}
+
+void usage() {
+	fprintf(stderr, "usage: replay [-l passes] [-i w.x.y.z] [-o sent.pcap] [-x replies] capture.pcap\n");
+	exit(2);
+}
+
+int main(int argc, char* argv[]) {
+	uint32_t passes = 1, replies = 0, i;
+	uint32_t ip[4] = { REPLAY_IP };
+	const char* output = NULL;
+	bool expect = false;
+	uint64_t start, ns;
+	int arg;
+
+	for (arg = 1; arg < argc - 1 && argv[arg][0] == '-'; arg += 2) {
+		if (argv[arg][1] == 'l')
+			passes = strtoul(argv[arg + 1], NULL, 0);
+		else if (argv[arg][1] == 'o')
+			output = argv[arg + 1];
+		else if (argv[arg][1] == 'x') {
+			replies = strtoul(argv[arg + 1], NULL, 0);
+			expect = true;
+		} else if (argv[arg][1] == 'i') {
+			if (sscanf(argv[arg + 1], "%u.%u.%u.%u", &ip[0], &ip[1], &ip[2], &ip[3]) != 4)
+				usage();
+		} else
+			usage();
+	}
+	if (arg != argc - 1)
+		usage();
+
+	initPacketPool();
+	initConfig();
+	etherSetDriver(&pcapDriver);
+	etherSetMacAddress(REPLAY_MAC);
+	etherSetIpAddress(ip[0], ip[1], ip[2], ip[3]);
+	etherSetIpSubnetMask(255, 255, 255, 0);
+	etherUdpBind(REPLAY_ECHO_PORT, processEcho);
+
+	if (!loadPcapFile(argv[arg])) {
+		fprintf(stderr, "replay: cannot load %s\n", argv[arg]);
+		return 2;
+	}
+	if (output != NULL && !openPcapOutput(output)) {
+		fprintf(stderr, "replay: cannot write %s\n", output);
+		return 2;
+	}
+
+	start = getNanoseconds();
+	for (i = 0; i < passes; i++)
+		replayPass();
+	ns = getNanoseconds() - start;
+	closePcapOutput();
+
+	printReport(getPcapFrameCount() * passes, ns);
+	if (expect && getPcapSentCount() != replies * passes) {
+		fprintf(stderr, "replay: expected %u frames sent per pass\n", replies);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,28 @@
+// Capture Replay Harness
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Linux host (replay build)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+// Addresses the replayed stack answers on, which the sample capture is for
+// They match the board's defaults; -m and -i override them for a real capture
+#define REPLAY_MAC        2, 3, 4, 5, 6, 136
+#define REPLAY_IP         192, 168, 1, 199
+#define REPLAY_PEER_MAC   2, 0, 0, 0, 0, 1
+#define REPLAY_PEER_IP    192, 168, 1, 1
+
+// UDP port answered by the harness's echo service
+#define REPLAY_ECHO_PORT  7
+#define REPLAY_TELNET_PORT 23
+
+#endif
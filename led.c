@@ -0,0 +1,185 @@
+// LED Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Non-blocking indicator service
+// Blink patterns are stepped by one periodic timer that only runs while some
+// LED is blinking, so flashing an LED never stalls the caller
+// Each LED also has a steady level, set with setLed: a blink inverts it while
+// the pattern runs and goes back to it when the pattern ends
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "gpio.h"
+#include "timer.h"
+#include "led.h"
+
+#define MAX_LEDS 4
+
+typedef struct _ledPattern {
+	PORT port;
+	uint8_t pin;
+	uint8_t count;
+	uint8_t onTicks;
+	uint8_t offTicks;
+	uint8_t ticks;
+	bool on;
+	bool active;
+	bool steady;
+} ledPattern;
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+ledPattern leds[MAX_LEDS];
+timerHandle ledTimer = TIMER_INVALID;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+uint8_t ledMsToTicks(uint16_t ms) {
+	uint16_t ticks = (ms + LED_TICK_MS - 1) / LED_TICK_MS;
+	if (ticks == 0)
+		ticks = 1;
+	if (ticks > 255)
+		ticks = 255;
+	return ticks;
+}
+
+// A slot is in use while its LED is blinking or steady on
+ledPattern* findLed(PORT port, uint8_t pin) {
+	uint8_t i;
+	for (i = 0; i < MAX_LEDS; i++)
+		if ((leds[i].active || leds[i].steady) && leds[i].port == port && leds[i].pin == pin)
+			return &leds[i];
+	return NULL;
+}
+
+// Returns the slot of an LED, taking a free one if it has none
+ledPattern* getLed(PORT port, uint8_t pin) {
+	ledPattern* led = findLed(port, pin);
+	uint8_t i;
+	for (i = 0; i < MAX_LEDS && led == NULL; i++) {
+		if (!leds[i].active && !leds[i].steady) {
+			led = &leds[i];
+			led->port = port;
+			led->pin = pin;
+		}
+	}
+	return led;
+}
+
+// Drives the pin from the pattern, or from the steady level once it is done
+void driveLed(ledPattern* led) {
+	if (led->active)
+		setPinValue(led->port, led->pin, led->on != led->steady);
+	else
+		setPinValue(led->port, led->pin, led->steady);
+}
+
+// Steps every active pattern by one tick and stops the timer once all are done
+void ledTick() {
+	uint8_t i;
+	bool busy = false;
+	for (i = 0; i < MAX_LEDS; i++) {
+		if (!leds[i].active)
+			continue;
+		if (--leds[i].ticks == 0) {
+			if (leds[i].on) {
+				leds[i].on = false;
+				if (--leds[i].count == 0)
+					leds[i].active = false;
+				else
+					leds[i].ticks = leds[i].offTicks;
+			} else {
+				leds[i].on = true;
+				leds[i].ticks = leds[i].onTicks;
+			}
+			driveLed(&leds[i]);
+		}
+		busy |= leds[i].active;
+	}
+	if (!busy) {
+		cancelTimer(ledTimer);
+		ledTimer = TIMER_INVALID;
+	}
+}
+
+void initLeds() {
+	uint8_t i;
+	for (i = 0; i < MAX_LEDS; i++) {
+		leds[i].active = false;
+		leds[i].steady = false;
+	}
+	ledTimer = TIMER_INVALID;
+}
+
+// Flashes an LED count times, on for onMs and off for offMs each time, then
+// leaves it at its steady level (a steady-on LED flashes off instead)
+// A pattern already running on the same pin is restarted with the new one
+// Returns false if no pattern slot or timer is free
+bool blinkLed(PORT port, uint8_t pin, uint8_t count, uint16_t onMs, uint16_t offMs) {
+	ledPattern* led;
+	if (count == 0)
+		return true;
+	led = getLed(port, pin);
+	if (led == NULL)
+		return false;
+	if (!isTimerActive(ledTimer)) {
+		ledTimer = startTimer(ledTick, LED_TICK_MS, true);
+		if (ledTimer == TIMER_INVALID)
+			return false;
+	}
+	led->count = count;
+	led->onTicks = ledMsToTicks(onMs);
+	led->offTicks = ledMsToTicks(offMs);
+	led->ticks = led->onTicks;
+	led->on = true;
+	led->active = true;
+	driveLed(led);
+	return true;
+}
+
+// Sets the steady level of an LED; a running pattern keeps going, inverted
+// from the new level, and then leaves the LED at it
+// Returns false if no slot is free to hold it on
+bool setLed(PORT port, uint8_t pin, bool on) {
+	ledPattern* led = on ? getLed(port, pin) : findLed(port, pin);
+	if (led == NULL) {
+		if (on)
+			return false;
+		setPinValue(port, pin, 0);
+		return true;
+	}
+	led->steady = on;
+	driveLed(led);
+	return true;
+}
+
+// Cancels any pattern on the pin and turns the LED off
+void stopLed(PORT port, uint8_t pin) {
+	ledPattern* led = findLed(port, pin);
+	if (led != NULL) {
+		led->active = false;
+		led->steady = false;
+	}
+	setPinValue(port, pin, 0);
+}
+
+// Returns true while a pattern is running on the pin
+bool isLedBusy(PORT port, uint8_t pin) {
+	ledPattern* led = findLed(port, pin);
+	return led != NULL && led->active;
+}
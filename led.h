@@ -0,0 +1,35 @@
+// LED Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef LED_H_
+#define LED_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "gpio.h"
+
+// Resolution of blink on and off times
+#define LED_TICK_MS 50
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initLeds();
+bool blinkLed(PORT port, uint8_t pin, uint8_t count, uint16_t onMs, uint16_t offMs);
+bool setLed(PORT port, uint8_t pin, bool on);
+void stopLed(PORT port, uint8_t pin);
+bool isLedBusy(PORT port, uint8_t pin);
+
+#endif
@@ -37,7 +37,6 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-#include <stdio.h>
 #include <string.h>
 #include "tm4c123gh6pm.h"
 #include "eth0.h"
@@ -47,6 +46,14 @@
 #include "wait.h"
 #include "eprom.h"
 #include "timer.h"
+#include "scheduler.h"
+#include "led.h"
+#include "stats.h"
+#include "packet.h"
+#include "config.h"
+#include "power.h"
+#include "telnet.h"
+#include "bench.h"
 
 // Pins
 #define RED_LED PORTF,1
@@ -54,6 +61,13 @@
 #define GREEN_LED PORTF,3
 #define PUSH_BUTTON PORTF,4
 
+// Indicator flash length
+#define FLASH_MS 100
+
+// UDP ports
+#define DHCP_CLIENT_PORT 68
+#define TELEMETRY_PORT   1024
+
 // DHCP States (and static [DHCP Disabled] state)
 #define STATIC 0
 #define INIT 1
@@ -62,15 +76,28 @@
 #define BOUND 4
 #define RENEWING 5
 #define REBINDING 6
+#define REBOOTING 7
+
+// DHCP retransmission (RFC 2131 4.1)
+// The delay starts at 4 s and doubles up to 64 s, randomized by +/- 1 s so
+// that boards powered up together spread their retries out
+#define DHCP_BACKOFF_MIN_MS 4000
+#define DHCP_BACKOFF_MAX_MS 64000
+#define DHCP_JITTER_MS      1000
+#define DHCP_REBOOT_TRIES   3
+
+// A lease of this many seconds never expires (RFC 2132 9.2)
+#define DHCP_INFINITE_LEASE 0xFFFFFFFF
+
+// Standby modes
+// Wake-on-LAN standby keeps the controller listening for Magic Packets
+// only; power-down standby puts it in power save and waits for the terminal
+#define STANDBY_OFF       0
+#define STANDBY_WOL       1
+#define STANDBY_POWERDOWN 2
 
-// TCP States
-#define LISTEN 0
-#define SYN_RECEIVED 1
-#define ESTABLISHED 2
-#define FINWAIT_1 3
-#define FINWAIT_2 4
-#define TIME_WAIT 5
-#define CLOSED 6
+// ARP retries and TCP retransmits are serviced this often outside standby
+#define NETWORK_SERVICE_MS 50
 
 //-----------------------------------------------------------------------------
 // Subroutines                
@@ -93,60 +120,34 @@ void initHw() {
 	selectPinDigitalInput(PUSH_BUTTON);
 
 	initEeprom();
+	initPower();
 }
 
 void displayConnectionInfo() {
-	uint8_t i;
-	char str[10];
 	uint8_t mac[6];
 	uint8_t ip[4];
 	etherGetMacAddress(mac);
 	putsUart0("HW: ");
-	for (i = 0; i < 6; i++) {
-		sprintf(str, "%02x", mac[i]);
-		putsUart0(str);
-		if (i < 6 - 1)
-			putcUart0(':');
-	}
+	putMacUart0(mac);
 	putsUart0("\r\n");
 	etherGetIpAddress(ip);
 	putsUart0("IP: ");
-	for (i = 0; i < 4; i++) {
-		sprintf(str, "%u", ip[i]);
-		putsUart0(str);
-		if (i < 4 - 1)
-			putcUart0('.');
-	}
+	putIpUart0(ip);
 	if (etherIsDhcpEnabled())
 		putsUart0(" (dhcp)");
 	else putsUart0(" (static)");
 	putsUart0("\r\n");
 	etherGetIpSubnetMask(ip);
 	putsUart0("SN: ");
-	for (i = 0; i < 4; i++) {
-		sprintf(str, "%u", ip[i]);
-		putsUart0(str);
-		if (i < 4 - 1)
-			putcUart0('.');
-	}
+	putIpUart0(ip);
 	putsUart0("\r\n");
 	etherGetIpGatewayAddress(ip);
 	putsUart0("GW: ");
-	for (i = 0; i < 4; i++) {
-		sprintf(str, "%u", ip[i]);
-		putsUart0(str);
-		if (i < 4 - 1)
-			putcUart0('.');
-	}
+	putIpUart0(ip);
 	putsUart0("\r\n");
 	etherGetDNSAddress(ip);
 	putsUart0("DNS: ");
-	for (i = 0; i < 4; i++) {
-		sprintf(str, "%u", ip[i]);
-		putsUart0(str);
-		if (i < 4 - 1)
-			putcUart0('.');
-	}
+	putIpUart0(ip);
 	putsUart0("\r\n");
 	if (etherIsLinkUp())
 		putsUart0("Link is up\r\n");
@@ -157,377 +158,693 @@ void displayConnectionInfo() {
 // Main
 //-----------------------------------------------------------------------------
 
-// Max packet is calculated as:
-// Ether frame header (18) + Max MTU (1500) + CRC (4)
-#define MAX_PACKET_SIZE 1522
+// Frames are read into and built in large pool buffers
+#define MAX_PACKET_SIZE PACKET_LARGE_SIZE
+
+// DHCP timers, stopped together whenever the lease is restarted or dropped
+#define DHCP_TIMER_RETRY    0
+#define DHCP_TIMER_T1       1
+#define DHCP_TIMER_T2       2
+#define DHCP_TIMER_LEASE    3
+#define DHCP_TIMER_ARP      4
+#define DHCP_TIMER_RENEW    5
+#define DHCP_TIMER_REBIND   6
+#define DHCP_TIMER_DECLINE  7
+#define DHCP_TIMER_COUNT    8
+
+uint8_t state = 0;
+uint8_t dhcpAttempt = 0;
+timerHandle dhcpTimers[DHCP_TIMER_COUNT];
+USER_DATA command;
+uint32_t rxStartCycles;
+uint8_t standby = STANDBY_OFF;
+timerHandle networkTimer = TIMER_INVALID;
+uint8_t awakeIdleMode = IDLE_SLEEP;
+
+void stopDhcpTimers() {
+	uint8_t i;
+	for (i = 0; i < DHCP_TIMER_COUNT; i++) {
+		cancelTimer(dhcpTimers[i]);
+		dhcpTimers[i] = TIMER_INVALID;
+	}
+}
+
+// Builds a DHCP message of type in a buffer of its own
+void sendDhcpMessage(uint8_t type) {
+	uint8_t* packet = allocPacket(MAX_PACKET_SIZE);
+	if (packet == NULL)
+		return;
+	etherSendDhcpPacket(packet, type);
+	freePacket(packet);
+}
 
-bool sendDhcp = false, renewLease = false, sendRenewRequest = false, sendRebindRequest = false,
-        rebind = false, leaseEnd = false, safeToUseIp = false, dhcpRelease = false, transitionToInit = false;
+// Returns the delay before retransmission number attempt
+uint32_t getDhcpBackoff(uint8_t attempt) {
+	uint32_t delay = DHCP_BACKOFF_MIN_MS;
+	uint8_t mac[HW_ADD_LENGTH];
+	while (attempt-- > 0 && delay < DHCP_BACKOFF_MAX_MS)
+		delay *= 2;
+	if (delay > DHCP_BACKOFF_MAX_MS)
+		delay = DHCP_BACKOFF_MAX_MS;
+	// Boards powered up together read the same timer values, so mix in the MAC
+	etherGetMacAddress(mac);
+	return delay - DHCP_JITTER_MS
+	        + (random32() ^ (((mac[4] << 8) | mac[5]) * 40503)) % (2 * DHCP_JITTER_MS + 1);
+}
 
+// Sends Discover and arms the next retransmission
 void sendDhcpDiscovery() {
-	sendDhcp = true;
+	sendDhcpMessage(1);
+	state = SELECTING;
+	dhcpTimers[DHCP_TIMER_RETRY] = startTimer(sendDhcpDiscovery, getDhcpBackoff(dhcpAttempt++), false);
 }
 
-void startT1Timer() {
-	renewLease = true;
+// Start over without an address, sending Discover until an offer arrives
+// Whatever the ARP cache learned belongs to the old lease, so it goes too
+void enterDhcpInit() {
+	cancelTimer(dhcpTimers[DHCP_TIMER_RETRY]);
+	etherArpFlush();
+	state = INIT;
+	dhcpAttempt = 0;
+	sendDhcpDiscovery();
 }
 
+// Asks for the saved address again, falling back to INIT if no server answers
+void sendDhcpReboot() {
+	if (dhcpAttempt == DHCP_REBOOT_TRIES) {
+		enterDhcpInit();
+		return;
+	}
+	sendDhcpMessage(8);
+	dhcpTimers[DHCP_TIMER_RETRY] = startTimer(sendDhcpReboot, getDhcpBackoff(dhcpAttempt++), false);
+}
+
+// Start DHCP from the saved lease if there is one (INIT-REBOOT), so a
+// reboot costs one request and ack instead of a full discovery
+void enterDhcpReboot() {
+	uint8_t ip[IP_ADD_LENGTH], server[IP_ADD_LENGTH];
+	uint32_t lease;
+	if (!getConfigLease(ip, server, &lease)) {
+		enterDhcpInit();
+		return;
+	}
+	cancelTimer(dhcpTimers[DHCP_TIMER_RETRY]);
+	etherSetDhcpRequestedIp(ip);
+	state = REBOOTING;
+	dhcpAttempt = 0;
+	sendDhcpReboot();
+}
+
+// Sends Renew to the server that granted the lease and arms the next retransmission
 void startRenewing() {
-	sendRenewRequest = true;
+	sendDhcpMessage(5);
+	dhcpTimers[DHCP_TIMER_RENEW] = startTimer(startRenewing, getDhcpBackoff(dhcpAttempt++), false);
 }
 
-void startT2Timer() {
-	rebind = true;
+void startT1Timer() {
+	state = RENEWING;
+	dhcpAttempt = 0;
+	startRenewing();
 }
 
+// Broadcasts Rebind and arms the next retransmission
 void startRebinding() {
-	sendRebindRequest = true;
+	sendDhcpMessage(6);
+	dhcpTimers[DHCP_TIMER_REBIND] = startTimer(startRebinding, getDhcpBackoff(dhcpAttempt++), false);
+}
+
+void startT2Timer() {
+	cancelTimer(dhcpTimers[DHCP_TIMER_RENEW]);
+	state = REBINDING;
+	dhcpAttempt = 0;
+	startRebinding();
 }
 
+// Transition to INIT state once lease ends (without renewing) and set IP to 0.0.0.0 (so that we don't use it)
 void leaseEndTimer() {
-	leaseEnd = true;
+	cancelTimer(dhcpTimers[DHCP_TIMER_REBIND]);
+	etherSetIpAddressToZeroes();
+	clearConfigLease();
+	enterDhcpInit();
 }
 
+// After waiting 2 seconds after sending gratuituous ARP, transition to BOUND state
 void arpResponse() {
-	safeToUseIp = true;
+	if (state == REQUESTING) {
+		state = BOUND;
+		blinkLed(GREEN_LED, 1, FLASH_MS, FLASH_MS);
+//		putsUart0("\r\nGot dynamic IP Address\r\n");
+//		displayConnectionInfo();
+	}
 }
 
+// Transition to INIT state after sending DHCP Decline and waiting 10 secs (as in RFC)
 void startDeclineTimer() {
-	transitionToInit = true;
+	enterDhcpInit();
 }
 
-int main(void) {
-	uint8_t* udpData;
-	uint8_t data[MAX_PACKET_SIZE];
-	uint8_t state = 0, tcp_state = 0;
+// Send DHCP Release and transition to STATIC state
+void releaseDhcp() {
+	sendDhcpMessage(7);
+	clearConfigLease();
 
-	// Init controller
-	initHw();
+	etherDisableDhcpMode();
+	state = STATIC;
+	getDetailsFromEprom();
 
-	// Setup UART0
-	initUart0();
-	setUart0BaudRate(115200, 40e6);
-
-	// Init Timer
-	initTimer();
-	bool dhcpMode = false;
+	stopDhcpTimers();
+}
 
-	// Init ethernet interface (eth0) and Get DHCP mode from EEPROM
-	putsUart0("\r\nStarting eth0\r\n");
-	etherInit(ETHER_UNICAST | ETHER_BROADCAST | ETHER_HALFDUPLEX);
-	etherSetMacAddress(2, 3, 4, 5, 6, 136);
+// Retries ARP requests, ages the cache and retransmits unacknowledged TCP segments
+void serviceNetwork() {
+	etherArpService();
+	etherTcpService();
+}
 
-	dhcpMode = etherIsDhcpEnabled();
-	if (dhcpMode) {
-		state = INIT;
+// Deep sleeps until a Magic Packet (STANDBY_WOL) or a terminal line ends standby
+// The network service stops and the tick goes tickless, so only INT, UART0
+// and timers that are really due (a DHCP renewal, say) wake the core
+void enterStandby(uint8_t mode) {
+	if (standby != STANDBY_OFF)
+		return;
+	awakeIdleMode = getIdleMode();
+	standby = mode;
+	if (mode == STANDBY_WOL) {
+		etherEnterWakeOnLan();
+		putsUart0("Standby, waiting for a Magic Packet or a command\r\n");
 	} else {
-		state = STATIC;
+		putsUart0("Standby, waiting for a command\r\n");
+		etherPowerDown();
 	}
+	cancelTimer(networkTimer);
+	networkTimer = TIMER_INVALID;
+	startTickless();
+	setIdleMode(IDLE_DEEP_SLEEP);
+}
 
-	waitMicrosecond(100000);
-	displayConnectionInfo();
-
-	// Flash LED
-	setPinValue(GREEN_LED, 1);
-	waitMicrosecond(100000);
-	setPinValue(GREEN_LED, 0);
-	waitMicrosecond(100000);
+void exitStandby() {
+	if (standby == STANDBY_WOL)
+		etherExitWakeOnLan();
+	else if (standby == STANDBY_POWERDOWN)
+		etherPowerUp();
+	standby = STANDBY_OFF;
+	stopTickless();
+	networkTimer = startTimer(serviceNetwork, NETWORK_SERVICE_MS, true);
+	setIdleMode(awakeIdleMode);
+	blinkLed(GREEN_LED, 1, FLASH_MS, FLASH_MS);
+}
 
-	// Main Loop
-	// RTOS and interrupts would greatly improve this code,
-	// but the goal here is simplicity
-	while (true) {
-		// Put terminal processing here
-		if (kbhitUart0()) {
-			USER_DATA info;
-			// Get the string from the user
-			getsUart0(&info);
-			// Parse fields
-			parseFields(&info);
-
-			// Echo back the parsed field information (type and fields)
+// Runs a parsed command line, from the terminal or a Telnet session
+// Output goes to the console, which telnet redirects to its connection
+void processCommand(USER_DATA* data) {
+	// Echo back the parsed field information (type and fields)
 //			uint8_t i;
-			putsUart0("\r\n");
-//			for (i = 0; i < info.fieldCount; i++) {
-//				putcUart0(info.fieldType[i]);
+	putsUart0("\r\n");
+//			for (i = 0; i < data->fieldCount; i++) {
+//				putcUart0(data->fieldType[i]);
 //				putcUart0('\t');
-//				putsUart0(&info.buffer[info.fieldPosition[i]]);
+//				putsUart0(&data->buffer[data->fieldPosition[i]]);
 //				putsUart0("\r\n");
 //			}
 
-			bool valid = false;
-
-			// set IP | GW | DNS | SN w.x.y.z
-			if (isCommand(&info, "set", 5)) {
-				char* add = getFieldString(&info, 2);
-				valid = true;
-
-				if (state != STATIC) {
-					putsUart0("DHCP mode is on. ");
-					valid = false;
-				} else {
-					if (mystrcmp("ip", add)) {
-						etherSetIpAddress(getFieldInteger(&info, 3), getFieldInteger(&info, 4),
-						                  getFieldInteger(&info, 5), getFieldInteger(&info, 6));
-					} else if (mystrcmp("gw", add)) {
-						etherSetIpGatewayAddress(getFieldInteger(&info, 3), getFieldInteger(&info, 4),
-						                         getFieldInteger(&info, 5), getFieldInteger(&info, 6));
-					} else if (mystrcmp("dns", add)) {
-						etherSetDNSAddress(getFieldInteger(&info, 3), getFieldInteger(&info, 4),
-						                   getFieldInteger(&info, 5), getFieldInteger(&info, 6));
-					} else if (mystrcmp("sn", add)) {
-						etherSetIpSubnetMask(getFieldInteger(&info, 3), getFieldInteger(&info, 4),
-						                     getFieldInteger(&info, 5), getFieldInteger(&info, 6));
-					} else {
-						valid = false;
-					}
-				}
+	bool valid = false;
+
+	// set IP | GW | DNS | SN w.x.y.z
+	if (isCommand(data, "set", 5)) {
+		char* add = getFieldString(data, 2);
+		valid = true;
+
+		if (state != STATIC) {
+			putsUart0("DHCP mode is on. ");
+			valid = false;
+		} else {
+			if (mystrcmp("ip", add)) {
+				etherSetIpAddress(getFieldInteger(data, 3), getFieldInteger(data, 4),
+				                  getFieldInteger(data, 5), getFieldInteger(data, 6));
+			} else if (mystrcmp("gw", add)) {
+				etherSetIpGatewayAddress(getFieldInteger(data, 3), getFieldInteger(data, 4),
+				                         getFieldInteger(data, 5), getFieldInteger(data, 6));
+			} else if (mystrcmp("dns", add)) {
+				etherSetDNSAddress(getFieldInteger(data, 3), getFieldInteger(data, 4),
+				                   getFieldInteger(data, 5), getFieldInteger(data, 6));
+			} else if (mystrcmp("sn", add)) {
+				etherSetIpSubnetMask(getFieldInteger(data, 3), getFieldInteger(data, 4),
+				                     getFieldInteger(data, 5), getFieldInteger(data, 6));
+			} else {
+				valid = false;
 			}
+		}
+	}
 
-			// dhcp ON | OFF | REFRESH | RELEASE
-			if (isCommand(&info, "dhcp", 1)) {
-				char* str = getFieldString(&info, 2);
-				valid = true;
-				if (mystrcmp(str, "on")) {
-					etherEnableDhcpMode();
-					state = INIT;
-				} else if (mystrcmp(str, "off")) {
-					etherDisableDhcpMode();
-					state = STATIC;
-					getDetailsFromEprom();
-
-					// Stop timers
-					stopAllTimers();
-				} else if (mystrcmp(str, "release")) {
-
-					if (state == STATIC) {
-						putsUart0("DHCP mode is off ");
-						valid = false;
-					} else {
-						dhcpRelease = true;
-					}
-
-				} else if (mystrcmp(str, "refresh")) {
+	// dhcp ON | OFF | REFRESH | RELEASE
+	if (isCommand(data, "dhcp", 1)) {
+		char* str = getFieldString(data, 2);
+		valid = true;
+		if (mystrcmp(str, "on")) {
+			etherEnableDhcpMode();
+			enterDhcpReboot();
+		} else if (mystrcmp(str, "off")) {
+			etherDisableDhcpMode();
+			state = STATIC;
+			getDetailsFromEprom();
 
-					if (state == STATIC) {
-						putsUart0("DHCP mode is off ");
-						valid = false;
-					} else {
-						sendRenewRequest = true;
-					}
+			// Stop timers
+			stopDhcpTimers();
+		} else if (mystrcmp(str, "release")) {
 
-				} else {
-					valid = false;
-				}
+			if (state == STATIC) {
+				putsUart0("DHCP mode is off ");
+				valid = false;
+			} else {
+				releaseDhcp();
 			}
 
-			// ifconfig
-			if (isCommand(&info, "ifconfig", 0)) {
-				displayConnectionInfo();
-				valid = true;
-			}
+		} else if (mystrcmp(str, "refresh")) {
 
-			// reboot
-			if (isCommand(&info, "reboot", 0)) {
-				NVIC_APINT_R |= NVIC_APINT_SYSRESETREQ;
-				valid = true;
+			if (state == STATIC) {
+				putsUart0("DHCP mode is off ");
+				valid = false;
+			} else {
+				sendDhcpMessage(5);
 			}
 
-			if (!valid)
-				putsUart0("Invalid command\n");
+		} else {
+			valid = false;
 		}
+	}
 
-		if (state == INIT) {
-			// Send Discover once and start periodic timer
-			sendDhcp = true;
-			startPeriodicTimer(sendDhcpDiscovery, 15);
-		}
+	// ifconfig
+	if (isCommand(data, "ifconfig", 0)) {
+		displayConnectionInfo();
+		valid = true;
+	}
 
-		if (sendDhcp) {
-			sendDhcp = false;
-			etherSendDhcpPacket(data, 1);
-			state = SELECTING;
-		}
+	// stats [RESET]
+	if (isCommand(data, "stats", 1)) {
+		char* str = getFieldString(data, 2);
+		valid = true;
+		if (str == 0)
+			displayStats();
+		else if (mystrcmp(str, "reset"))
+			resetStats();
+		else
+			valid = false;
+	}
 
-		// After waiting 2 seconds after sending gratuituous ARP, transition to BOUND state
-		if (safeToUseIp && state == REQUESTING) {
-			state = BOUND;
-			setPinValue(GREEN_LED, 1);
-			waitMicrosecond(100000);
-			setPinValue(GREEN_LED, 0);
-//			putsUart0("\r\nGot dynamic IP Address\r\n");
-//			displayConnectionInfo();
-		}
+	// idle SLEEP | DEEP
+	if (isCommand(data, "idle", 1)) {
+		char* str = getFieldString(data, 2);
+		valid = true;
+		if (str != 0 && mystrcmp(str, "sleep"))
+			setIdleMode(IDLE_SLEEP);
+		else if (str != 0 && mystrcmp(str, "deep"))
+			setIdleMode(IDLE_DEEP_SLEEP);
+		else
+			valid = false;
+	}
 
-		if (renewLease) {
-			state = RENEWING;
-			renewLease = false;
-			startPeriodicTimer(startRenewing, 15);
-		}
+	// standby [POWERDOWN]
+	if (isCommand(data, "standby", 1)) {
+		char* str = getFieldString(data, 2);
+		valid = true;
+		if (str == 0)
+			enterStandby(STANDBY_WOL);
+		else if (mystrcmp(str, "powerdown"))
+			enterStandby(STANDBY_POWERDOWN);
+		else
+			valid = false;
+	}
 
-		if (sendRenewRequest) {
-			etherSendDhcpPacket(data, 4);
-			sendRenewRequest = false;
-		}
+#ifdef BENCHMARK
+	// bench
+	if (isCommand(data, "bench", 0)) {
+		runBenchmarks();
+		valid = true;
+	}
+#endif
 
-		if (rebind) {
-			stopTimer(startRenewing);
-			state = REBINDING;
-			rebind = false;
-			startPeriodicTimer(startRebinding, 15);
-		}
+	// reboot
+	if (isCommand(data, "reboot", 0)) {
+		NVIC_APINT_R |= NVIC_APINT_SYSRESETREQ;
+		valid = true;
+	}
 
-		if (sendRebindRequest) {
-			sendRebindRequest = false;
-			etherSendDhcpPacket(data, 5);
-		}
+	if (!valid)
+		putsUart0("Invalid command\n");
+}
+
+// Terminal processing, run when a character has arrived
+void processUart() {
+	// Edit the line with what has arrived so far, and act once it is complete
+	if (!editLineUart0(&command))
+		return;
+	// Any command ends standby
+	if (standby != STANDBY_OFF) {
+		exitStandby();
+		putsUart0("Awake\r\n");
+	}
+	// Parse fields
+	parseFields(&command);
+	processCommand(&command);
+
+	// Start the next line, which may already be waiting in the RX ring
+	command.charCount = 0;
+	if (kbhitUart0())
+		postEvent(EVENT_UART);
+}
 
-		// Transition to INIT state once lease ends (without renewing) and set IP to 0.0.0.0 (so that we don't use it)
-		if (leaseEnd) {
-			stopTimer(startRebinding);
-			state = INIT;
-			leaseEnd = false;
+// Reports a link change and restarts DHCP once the link is back, since the
+// board may have been moved to another network; INIT-REBOOT finds out
+// whether the saved address is still good there
+void processLinkChange() {
+	if (etherIsLinkUp()) {
+		putsUart0("Link is up\r\n");
+		if (state != STATIC) {
+			stopDhcpTimers();
 			etherSetIpAddressToZeroes();
+			enterDhcpReboot();
 		}
+	} else
+		putsUart0("Link is down\r\n");
+}
 
-		// Send DHCP Release and transition to STATIC state
-		if (dhcpRelease) {
-			dhcpRelease = false;
-
-			etherSendDhcpPacket(data, 7);
+// Telemetry datagrams turn the green LED on or off and are acknowledged
+// test this with a udp send utility like sendip
+//   if sender IP (-is) is 192.168.1.198, this will attempt to
+//   send the udp datagram (-d) to 192.168.1.199, port 1024 (-ud)
+// sudo sendip -p ipv4 -is 192.168.1.198 -p udp -ud 1024 -d "on" 192.168.1.199
+// sudo sendip -p ipv4 -is 192.168.1.198 -p udp -ud 1024 -d "off" 192.168.1.199
+void processTelemetry(uint8_t packet[], etherPacketInfo* info) {
+	uint8_t* udpData = info->payload;
+	if ((info->flags & ETHER_PKT_IP_UNICAST) == 0)
+		return;
+	if (strcmp((char*) udpData, "on") == 0)
+		setLed(GREEN_LED, true);
+	if (strcmp((char*) udpData, "off") == 0)
+		setLed(GREEN_LED, false);
+	etherSendUdpResponse(packet, (uint8_t*) "Received", 9);
+	recordCycles(STAGE_UDP_REPLY, rxStartCycles);
+}
 
-			etherDisableDhcpMode();
-			state = STATIC;
-			getDetailsFromEprom();
+// DHCP client, given the datagrams sent to port 68
+void processDhcp(uint8_t packet[], etherPacketInfo* info) {
+	uint8_t ip[IP_ADD_LENGTH], server[IP_ADD_LENGTH];
+	uint32_t lease;
 
-			stopAllTimers();
+	// If DHCP Offer and state is SELECTING, send DHCP Request and transition to REQUESTING state
+	if (isDhcpOffer(packet) && state == SELECTING) {
+		etherSendDhcpPacket(packet, 3);
+		state = REQUESTING;
+	}
 
+	// If DHCP ACK, get the lease time and start the timers
+	lease = isDhcpAck(packet);
+	if (lease > 0
+	        && (state == REQUESTING || state == RENEWING || state == REBINDING || state == REBOOTING)) {
+		stopDhcpTimers();
+
+		if (state == REQUESTING || state == REBOOTING)
+			sendGratiousArp(packet); // Send Gratuitous ARP only if getting IP for the first timer (not renew/rebind)
+		// Start T1 and T2 one shot timers which will start the renew and rebind retries
+		// An infinite lease is never renewed, so it gets no timers
+		if (lease != DHCP_INFINITE_LEASE) {
+			dhcpTimers[DHCP_TIMER_T1] = startOneshotTimer(startT1Timer, lease / 2);
+			dhcpTimers[DHCP_TIMER_T2] = startOneshotTimer(startT2Timer, lease - lease / 8);
+			dhcpTimers[DHCP_TIMER_LEASE] = startOneshotTimer(leaseEndTimer, lease);
 		}
+		// A new address waits out the conflict check; a confirmed or renewed one is ours already
+		if (state == REQUESTING)
+			dhcpTimers[DHCP_TIMER_ARP] = startOneshotTimer(arpResponse, 2);
+		else
+			state = BOUND;
 
-		// Transition to INIT state after sending DHCP Decline and waiting 10 secs (as in RFC)
-		if (transitionToInit) {
-			transitionToInit = false;
-			state = INIT;
-		}
+		// Save the lease for INIT-REBOOT
+		etherGetIpAddress(ip);
+		etherGetDhcpServerAddress(server);
+		setConfigLease(ip, server, lease);
+	}
 
-		// Packet processing
-		if (etherIsDataAvailable()) {
-			if (etherIsOverflow()) {
-				setPinValue(RED_LED, 1);
-				waitMicrosecond(100000);
-				setPinValue(RED_LED, 0);
-			}
+	// A NAK means the address is no longer ours
+	if (isDhcpNak(packet) && state != STATIC && state != INIT && state != SELECTING) {
+		stopDhcpTimers();
+		etherSetIpAddressToZeroes();
+		clearConfigLease();
+		enterDhcpInit();
+	}
+}
 
-			// Get packet
-			etherGetPacket(data, MAX_PACKET_SIZE);
+// Counts a classified frame by the protocols it carries
+void countRxFrame(etherPacketInfo* info) {
+	if (info->flags & (ETHER_PKT_ARP_REQUEST | ETHER_PKT_ARP_RESPONSE))
+		countStat(STAT_RX_ARP);
+	if (info->flags & ETHER_PKT_ICMP)
+		countStat(STAT_RX_ICMP);
+	if (info->flags & ETHER_PKT_UDP)
+		countStat(STAT_RX_UDP);
+	if (info->flags & ETHER_PKT_TCP)
+		countStat(STAT_RX_TCP);
+	if (info->flags & ETHER_PKT_DHCP)
+		countStat(STAT_RX_DHCP);
+	if ((info->flags & (ETHER_PKT_ARP_REQUEST | ETHER_PKT_ARP_RESPONSE | ETHER_PKT_ICMP
+	        | ETHER_PKT_UDP | ETHER_PKT_TCP)) == 0)
+		countStat(STAT_RX_DROPPED);
+}
 
-			// Handle ARP request
-			if (etherIsArpRequest(data)) {
-				etherSendArpResponse(data);
-			}
+// Reads the next frame into data and runs the handlers for it
+// While the rx buffer is congested only the ether header is read at first,
+// and frames that are not critical are dropped by advancing the read pointer
+void handleFrame(uint8_t data[], bool congested) {
+	uint16_t size = 0;
+	bool forUs;
+	etherPacketInfo info;
+	uint32_t start;
+
+	// Read only the headers first, and copy the rest of the frame only if it is for us
+	rxStartCycles = getCycles();
+	countStat(STAT_RX_FRAMES);
+	if (congested) {
+		size = etherPeekPacket(data, 14);
+		if (!etherIsFrameCritical(data)) {
+			etherDiscardPacket();
+			countStat(STAT_RX_EARLY_DROPS);
+			return;
+		}
+		etherReadPacket(&data[14], 14, ETHER_PEEK_SIZE - 14);
+	} else
+		size = etherPeekPacket(data, ETHER_PEEK_SIZE);
+	forUs = etherIsPacketForUs(data);
+	if (!forUs)
+		countStat(STAT_RX_DROPPED);
+	// Large pings are answered by the controller without reading the payload
+	if (forUs && size > ETHER_PEEK_SIZE && etherSendPingResponseInBuffer(data)) {
+		recordCycles(STAGE_PING_REPLY, rxStartCycles);
+		countStat(STAT_RX_ICMP);
+		forUs = false;
+	}
+	if (forUs && size > ETHER_PEEK_SIZE) {
+		if (size > MAX_PACKET_SIZE)
+			size = MAX_PACKET_SIZE;
+		etherReadPacket(&data[ETHER_PEEK_SIZE], ETHER_PEEK_SIZE, size - ETHER_PEEK_SIZE);
+	}
+	etherDiscardPacket();
+	recordCycles(STAGE_RX, rxStartCycles);
+
+	if (forUs) {
+		// Parse headers and verify checksums once for all of the handlers below
+		start = getCycles();
+		etherClassify(data, size, &info);
+		recordCycles(STAGE_CLASSIFY, start);
+		countRxFrame(&info);
+
+		// Handle ARP request
+		if (info.flags & ETHER_PKT_ARP_REQUEST) {
+			etherSendArpResponse(data);
+			recordCycles(STAGE_ARP_REPLY, rxStartCycles);
+		}
 
-			// Handle IP datagram
-			if (etherIsIp(data)) {
-				if (etherIsIpUnicast(data)) {
-					// handle icmp ping request
-					if (etherIsPingRequest(data)) {
-						etherSendPingResponse(data);
-					}
+		// Learn hosts that answer our ARP requests
+		if (info.flags & ETHER_PKT_ARP_RESPONSE) {
+			etherHandleArpResponse(data);
+		}
 
-					// Process UDP datagram
-					// test this with a udp send utility like sendip
-					//   if sender IP (-is) is 192.168.1.198, this will attempt to
-					//   send the udp datagram (-d) to 192.168.1.199, port 1024 (-ud)
-					// sudo sendip -p ipv4 -is 192.168.1.198 -p udp -ud 1024 -d "on" 192.168.1.199
-					// sudo sendip -p ipv4 -is 192.168.1.198 -p udp -ud 1024 -d "off" 192.168.1.199
-					if (etherIsUdp(data)) {
-
-						udpData = etherGetUdpData(data);
-						if (strcmp((char*) udpData, "on") == 0)
-							setPinValue(GREEN_LED, 1);
-						if (strcmp((char*) udpData, "off") == 0)
-							setPinValue(GREEN_LED, 0);
-						etherSendUdpResponse(data, (uint8_t*) "Received", 9);
-					}
+		// Handle IP datagram
+		if (info.flags & ETHER_PKT_IP) {
+			if (info.flags & ETHER_PKT_IP_UNICAST) {
+				// handle icmp ping request
+				if (info.flags & ETHER_PKT_PING_REQUEST) {
+					etherSendPingResponse(data);
+					recordCycles(STAGE_PING_REPLY, rxStartCycles);
+				}
 
-					// Handle ARP Response to Gratuituous ARP
-					if (isArpResponse(data)) { // Implementation remaining (Didn't had sample ARP response packet)
-						// Blink RED LED
-						setPinValue(RED_LED, 1);
-						waitMicrosecond(100000);
-						setPinValue(RED_LED, 0);
+				// Handle ARP Response to Gratuituous ARP
+				if (isArpResponse(data)) { // Implementation remaining (Didn't had sample ARP response packet)
+					// Blink RED LED
+					blinkLed(RED_LED, 1, FLASH_MS, FLASH_MS);
 
-						// Send decline message to server
-						etherSendDhcpPacket(data, 4);
+					// Send decline message to server
+					etherSendDhcpPacket(data, 4);
 
-						// Stop all Timers and start a oneshot timer to transition to INIT state after 10 seconds
-						stopAllTimers();
-						startOneshotTimer(startDeclineTimer, 10);
+					// Stop the lease timers and start a oneshot timer to transition to INIT state after 10 seconds
+					stopDhcpTimers();
+					clearConfigLease();
+					dhcpTimers[DHCP_TIMER_DECLINE] = startOneshotTimer(startDeclineTimer, 10);
 
-					}
+				}
 
 
-					// Handle TCP Packets
-					if (etherIsTcp(data)) {
+				// Handle TCP Packets
+				if (info.flags & ETHER_PKT_TCP) {
+					// Each connection keeps its own state and sequence numbers
+					etherProcessTcpAck(&info);
 
-						// Handle TCP SYN packets
-						if (etherIsTcpSYN(data)) {
-							// Send SYN ACK in response to SYN
+					// Handle TCP SYN packets
+					// Telnet is the only service, so SYNs to other ports are dropped
+					if (etherIsTcpSYN(&info)) {
+						// Send SYN ACK in response to SYN, opening the connection in SYN_RECEIVED
+						if (info.destPort == TELNET_PORT)
 							etherSendTcpSynAck(data);
-							tcp_state = SYN_RECEIVED;
-						} else if (etherIsTcpAck(data) && tcp_state == SYN_RECEIVED) { // Handle TCP ACK
-
-							// Transition to
-							tcp_state = ESTABLISHED;
-						} else if (etherIsTelnetData(data)) { // Handle TelnetDate packet
-
-							// Send Telnet Data
-							etherSendTelnetData(data, (uint8_t*) "Hello", 5);
-						} else if (etherIsTcpFINACK(data)) {
-							setPinValue(BLUE_LED, 1);
-							waitMicrosecond(100000);
-							setPinValue(BLUE_LED, 0);
-							etherSendAckFinAck(data);
-							tcp_state = FINWAIT_1;
-
-						} else if (etherIsTcpAck(data) && tcp_state == SYN_RECEIVED) { // Handle TCP ACK
-							tcp_state = CLOSED;
-
-						}
+					} else if (etherIsTcpAck(&info) && etherGetTcpState(&info) == TCP_SYN_RECEIVED) { // Handle TCP ACK
+
+						// Transition to ESTABLISHED and start a console session, taking
+						// any data the ack came with
+						etherSetTcpState(&info, TCP_ESTABLISHED);
+						openTelnet(etherTcpGetConnection(&info));
+						if (etherIsTelnetData(&info))
+							processTelnet(&info);
+					} else if (etherIsTelnetData(&info)) { // Handle TelnetDate packet
+
+						// Run the command lines and send their output
+						processTelnet(&info);
+					} else if (etherIsTcpFINACK(&info)) {
+						blinkLed(BLUE_LED, 1, FLASH_MS, FLASH_MS);
+						// Acknowledge their FIN and send ours, leaving the connection in LAST_ACK
+						etherSendAckFinAck(data);
+
+					} else if (etherIsTcpAck(&info) && etherGetTcpState(&info) == TCP_LAST_ACK) { // Handle TCP ACK
+						etherSetTcpState(&info, TCP_CLOSED);
+
 					}
 				}
+			}
+
+			// Hand UDP datagrams (unicast or broadcast) to the service bound to their port
+			if (info.flags & ETHER_PKT_UDP)
+				etherUdpDispatch(data, &info);
 
-				// Handle IP Broadcast packets
-				if (etherIsIpBroadcast(data)) {
-					if (etherIsUdp(data)) {
+		}
+	}
+}
 
-						// If DHCP Offer and state is SELECTING, send DHCP Request and transition to REQUESTING state
-						if (isDhcpOffer(data) && state == SELECTING) {
-							etherSendDhcpPacket(data, 3);
-							state = REQUESTING;
-						}
+// Handles the next frame in a pool buffer, dropping it if none is free
+// A dropped frame is still peeked, since the discard advances to the next
+// packet pointer that the peek reads from the frame's header
+void processFrame(bool congested) {
+	uint8_t* data = allocPacket(MAX_PACKET_SIZE);
+	uint8_t header[14];
+	if (data == NULL) {
+		etherPeekPacket(header, sizeof(header));
+		etherDiscardPacket();
+		countStat(STAT_RX_DROPPED);
+		return;
+	}
+	handleFrame(data, congested);
+	freePacket(data);
+}
 
-						// If DHCP ACK, get the lease time and start the timers
-						uint32_t lease = isDhcpAck(data);
-						if (lease > 0 && (state == REQUESTING || state == RENEWING || state == REBINDING)) {
-							stopAllTimers();
+// Packet processing, run when the controller asserts INT
+// Drains up to ETHER_RX_BUDGET of the frames waiting per pass, then lets the
+// other events run before coming back for the rest
+void processEther() {
+	uint8_t events, count, i;
+	bool congested, woke;
+	uint32_t wakeStart;
+
+	woke = getWakeStart(EVENT_ETHER, &wakeStart);
+	events = etherGetEvents();
+	if (events & ETHER_EVENT_RXERR) {
+		countStat(STAT_RX_OVERFLOWS);
+		blinkLed(RED_LED, 1, FLASH_MS, FLASH_MS);
+	}
+	if (events & ETHER_EVENT_LINK)
+		processLinkChange();
+	if (events & ETHER_EVENT_RX) {
+		count = etherGetPacketCount();
+		recordPacketCount(count);
+		if (count > ETHER_RX_BUDGET)
+			count = ETHER_RX_BUDGET;
+		// Only Magic Packets get through in wake-on-LAN standby
+		if (standby == STANDBY_WOL && count > 0) {
+			exitStandby();
+			putsUart0("Woke on Magic Packet\r\n");
+		}
+		congested = etherIsRxCongested();
+		for (i = 0; i < count; i++) {
+			processFrame(congested);
+			if (woke) {
+				recordCycles(STAGE_WAKE, wakeStart);
+				woke = false;
+			}
+		}
+	}
 
-							if (state == REQUESTING)
-								sendGratiousArp(data); // Send Gratuitous ARP only if getting IP for the first timer (not renew/rebind)
-							// Start T1 and T2 one shot timers which will start periodic timers
-							startOneshotTimer(startT1Timer, lease * 0.5);
-							startOneshotTimer(startT2Timer, lease * 0.875);
-							startOneshotTimer(leaseEndTimer, lease);
-							startOneshotTimer(arpResponse, 2);
+	// INT is level triggered but only its falling edge raises an event,
+	// so come back while the controller still has something to report
+	if (etherIsEventPending())
+		postEvent(EVENT_ETHER);
+}
 
-						}
+int main(void) {
+	// Init controller
+	initHw();
 
-					}
+	// Setup UART0
+	initUart0();
+	setUart0BaudRate(115200, UART0_CLOCK);
 
-				}
+	// Init Timer and the LED indicators that run on it
+	initTimer();
+	initLeds();
+	initStats();
+	initPacketPool();
+	initConfig();
+	bool dhcpMode = false;
 
-			}
-		}
+	// Init ethernet interface (eth0) and Get DHCP mode from EEPROM
+	putsUart0("\r\nStarting eth0\r\n");
+	etherInit(ETHER_UNICAST | ETHER_BROADCAST | ETHER_HALFDUPLEX | ETHER_INTERRUPT | ETHER_HWCHECKSUM);
+	etherSetMacAddress(2, 3, 4, 5, 6, 136);
+
+	waitMicrosecond(100000);
+	displayConnectionInfo();
+
+	// Flash LED
+	blinkLed(GREEN_LED, 1, FLASH_MS, FLASH_MS);
+
+	// Timer expirations, packets, terminal input and tx completions are
+	// posted as events and handled to completion one at a time
+	// A tx completion frees a slot, so TCP data held up by a full tx ring goes out
+	initScheduler();
+	setEventHandler(EVENT_TIMER, processTimers);
+	setEventHandler(EVENT_ETHER, processEther);
+	setEventHandler(EVENT_ETHER_TX, etherTcpPoll);
+	setEventHandler(EVENT_UART, processUart);
+	etherUdpBind(DHCP_CLIENT_PORT, processDhcp);
+	etherUdpBind(TELEMETRY_PORT, processTelemetry);
+	initTelnet(processCommand);
+	networkTimer = startTimer(serviceNetwork, NETWORK_SERVICE_MS, true);
+	enableUart0RxInterrupt();
+
+	dhcpMode = etherIsDhcpEnabled();
+	if (dhcpMode) {
+		enterDhcpReboot();
+	} else {
+		state = STATIC;
 	}
-}
 
+	// Anything that arrived before the handlers were registered
+	postEvent(EVENT_ETHER);
+
+	// Main Loop
+	// Sleeps until an interrupt posts an event
+	runScheduler();
+}
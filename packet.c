@@ -0,0 +1,164 @@
+// Packet Buffer Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Fixed-block packet buffer pool
+// Each size class is a static array of blocks with a free list threaded
+// through an index array, so allocating and freeing are O(1)
+// Blocks are reference counted: a frame waiting in the ARP queue holds its
+// own reference, so the sender can free its buffer as soon as it returns
+// Buffers are only used from the main loop, so nothing here is masked
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "packet.h"
+#include "stats.h"
+
+// Blocks are whole words so that every buffer is word aligned
+#define SMALL_WORDS ((PACKET_SMALL_SIZE + 3) / 4)
+#define LARGE_WORDS ((PACKET_LARGE_SIZE + 3) / 4)
+
+#define END_OF_LIST 0xFF
+
+typedef struct _packetClass {
+	uint8_t* base;
+	uint16_t blockSize;
+	uint16_t capacity;
+	uint8_t count;
+	uint8_t* next;
+	uint8_t* refs;
+	uint8_t head;
+	uint8_t free;
+	uint8_t minFree;
+} packetClass;
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+uint32_t smallBlocks[PACKET_SMALL_COUNT][SMALL_WORDS];
+uint32_t largeBlocks[PACKET_LARGE_COUNT][LARGE_WORDS];
+uint8_t smallNext[PACKET_SMALL_COUNT];
+uint8_t largeNext[PACKET_LARGE_COUNT];
+uint8_t smallRefs[PACKET_SMALL_COUNT];
+uint8_t largeRefs[PACKET_LARGE_COUNT];
+
+packetClass packetClasses[NUM_PACKET_CLASSES] = {
+	{ (uint8_t*) smallBlocks, SMALL_WORDS * 4, PACKET_SMALL_SIZE, PACKET_SMALL_COUNT, smallNext, smallRefs },
+	{ (uint8_t*) largeBlocks, LARGE_WORDS * 4, PACKET_LARGE_SIZE, PACKET_LARGE_COUNT, largeNext, largeRefs }
+};
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Puts every block of every class on its free list
+void initPacketPool() {
+	packetClass* pool;
+	uint8_t c, i;
+	for (c = 0; c < NUM_PACKET_CLASSES; c++) {
+		pool = &packetClasses[c];
+		for (i = 0; i < pool->count; i++) {
+			pool->next[i] = i + 1;
+			pool->refs[i] = 0;
+		}
+		pool->next[pool->count - 1] = END_OF_LIST;
+		pool->head = 0;
+		pool->free = pool->count;
+		pool->minFree = pool->count;
+	}
+}
+
+// Returns the class holding packet and its block index, or NULL if packet
+// is not the start of a pool block
+packetClass* findPacket(const uint8_t* packet, uint8_t* index) {
+	packetClass* pool;
+	uint32_t offset;
+	uint8_t c;
+	for (c = 0; c < NUM_PACKET_CLASSES; c++) {
+		pool = &packetClasses[c];
+		if (packet < pool->base)
+			continue;
+		offset = packet - pool->base;
+		if (offset >= (uint32_t) pool->blockSize * pool->count || offset % pool->blockSize != 0)
+			continue;
+		*index = offset / pool->blockSize;
+		return pool;
+	}
+	return NULL;
+}
+
+// Returns a buffer of at least size bytes from the smallest class that has
+// one free, holding one reference, or NULL if the pool is exhausted
+uint8_t* allocPacket(uint16_t size) {
+	packetClass* pool;
+	uint8_t c, i;
+	for (c = 0; c < NUM_PACKET_CLASSES; c++) {
+		pool = &packetClasses[c];
+		if (size > pool->capacity || pool->head == END_OF_LIST)
+			continue;
+		i = pool->head;
+		pool->head = pool->next[i];
+		pool->refs[i] = 1;
+		if (--pool->free < pool->minFree)
+			pool->minFree = pool->free;
+		return pool->base + (uint32_t) i * pool->blockSize;
+	}
+	countStat(STAT_POOL_FAILURES);
+	return NULL;
+}
+
+// Takes another reference to a pool buffer
+void retainPacket(uint8_t* packet) {
+	uint8_t index;
+	packetClass* pool = findPacket(packet, &index);
+	if (pool != NULL && pool->refs[index] != 0)
+		pool->refs[index]++;
+}
+
+// Drops a reference, returning the buffer to its free list with the last one
+void freePacket(uint8_t* packet) {
+	uint8_t index;
+	packetClass* pool = findPacket(packet, &index);
+	if (pool == NULL || pool->refs[index] == 0)
+		return;
+	if (--pool->refs[index] == 0) {
+		pool->next[index] = pool->head;
+		pool->head = index;
+		pool->free++;
+	}
+}
+
+// Returns true if packet is a buffer from the pool that is in use
+bool isPooledPacket(const uint8_t* packet) {
+	uint8_t index;
+	packetClass* pool = findPacket(packet, &index);
+	return pool != NULL && pool->refs[index] != 0;
+}
+
+// Returns the usable size of a pool buffer, or 0 for any other pointer
+uint16_t getPacketCapacity(const uint8_t* packet) {
+	uint8_t index;
+	packetClass* pool = findPacket(packet, &index);
+	return pool != NULL ? pool->capacity : 0;
+}
+
+uint8_t getFreePackets(uint8_t sizeClass) {
+	return packetClasses[sizeClass].free;
+}
+
+// Fewest blocks of a class that have been free at once since initPacketPool
+uint8_t getMinFreePackets(uint8_t sizeClass) {
+	return packetClasses[sizeClass].minFree;
+}
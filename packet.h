@@ -0,0 +1,55 @@
+// Packet Buffer Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef PACKET_H_
+#define PACKET_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Size classes
+// Small blocks hold ARP frames and bare TCP segments; large blocks hold a
+// full frame (ether header (18) + max MTU (1500) + CRC (4))
+// The pool is static, so its size is fixed at link time by these counts
+#ifndef PACKET_SMALL_SIZE
+#define PACKET_SMALL_SIZE  128
+#endif
+#ifndef PACKET_SMALL_COUNT
+#define PACKET_SMALL_COUNT 8
+#endif
+#ifndef PACKET_LARGE_SIZE
+#define PACKET_LARGE_SIZE  1522
+#endif
+#ifndef PACKET_LARGE_COUNT
+#define PACKET_LARGE_COUNT 4
+#endif
+
+#define PACKET_CLASS_SMALL 0
+#define PACKET_CLASS_LARGE 1
+#define NUM_PACKET_CLASSES 2
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initPacketPool();
+uint8_t* allocPacket(uint16_t size);
+void retainPacket(uint8_t* packet);
+void freePacket(uint8_t* packet);
+bool isPooledPacket(const uint8_t* packet);
+uint16_t getPacketCapacity(const uint8_t* packet);
+uint8_t getFreePackets(uint8_t sizeClass);
+uint8_t getMinFreePackets(uint8_t sizeClass);
+
+#endif
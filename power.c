@@ -0,0 +1,79 @@
+// Power Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz (16 MHz PIOSC in deep sleep)
+
+// Hardware configuration:
+// Wake sources: ENC28J60 INT (PC6), UART0 RX and Timer 4
+
+// Idle between events
+// Only the GPIO ports, UART0, SSI0, Timer 4 and the EEPROM stay clocked
+// while the core sleeps, and only the wake sources in deep sleep
+// UART0 runs from PIOSC so its baud rate holds in both modes; Timer 4 is
+// reloaded for PIOSC around a deep sleep so the tick rate holds too
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "tm4c123gh6pm.h"
+#include "eprom.h"
+#include "timer.h"
+#include "power.h"
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+uint8_t idleMode = IDLE_SLEEP;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initPower() {
+	// Sleep mode clocks (GPIO A, B, C and F, Timer 4, UART0, SSI0 and EEPROM)
+	SYSCTL_SCGCGPIO_R = SYSCTL_SCGCGPIO_S0 | SYSCTL_SCGCGPIO_S1 | SYSCTL_SCGCGPIO_S2 | SYSCTL_SCGCGPIO_S5;
+	SYSCTL_SCGCTIMER_R = SYSCTL_SCGCTIMER_S4;
+	SYSCTL_SCGCUART_R = SYSCTL_SCGCUART_S0;
+	SYSCTL_SCGCSSI_R = SYSCTL_SCGCSSI_S0;
+	SYSCTL_SCGCEEPROM_R = SYSCTL_SCGCEEPROM_S0;
+	// Deep sleep mode clocks (INT on port C, UART0 RX on port A, Timer 4)
+	SYSCTL_DCGCGPIO_R = SYSCTL_DCGCGPIO_D0 | SYSCTL_DCGCGPIO_D2;
+	SYSCTL_DCGCTIMER_R = SYSCTL_DCGCTIMER_D4;
+	SYSCTL_DCGCUART_R = SYSCTL_DCGCUART_D0;
+	SYSCTL_DSLPCLKCFG_R = SYSCTL_DSLPCLKCFG_O_IO;
+	// Use the sleep and deep sleep gating above instead of the run mode gating
+	SYSCTL_RCC_R |= SYSCTL_RCC_ACG;
+	idleMode = IDLE_SLEEP;
+}
+
+void setIdleMode(uint8_t mode) {
+	idleMode = mode;
+}
+
+uint8_t getIdleMode() {
+	return idleMode;
+}
+
+// Sleeps until an interrupt is pending
+// Call with interrupts masked (see runScheduler)
+// Deep sleep is skipped while an EEPROM write is running, since the EEPROM
+// is not clocked in deep sleep
+void idle() {
+	if (idleMode == IDLE_DEEP_SLEEP && !isEepromBusy()) {
+		setTickClock(PIOSC_CLOCK);
+		NVIC_SYS_CTRL_R |= NVIC_SYS_CTRL_SLEEPDEEP;
+		__asm("    WFI");
+		NVIC_SYS_CTRL_R &= ~NVIC_SYS_CTRL_SLEEPDEEP;
+		setTickClock(SYSTEM_CLOCK);
+	} else
+		__asm("    WFI");
+}
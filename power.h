@@ -0,0 +1,39 @@
+// Power Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz (16 MHz PIOSC in deep sleep)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef POWER_H_
+#define POWER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Idle modes
+// Sleep stops only the core; deep sleep also stops the PLL and runs the
+// peripherals that can wake us from PIOSC
+#define IDLE_SLEEP      0
+#define IDLE_DEEP_SLEEP 1
+
+#define SYSTEM_CLOCK 40000000
+#define PIOSC_CLOCK  16000000
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initPower();
+void setIdleMode(uint8_t mode);
+uint8_t getIdleMode();
+void idle();
+
+#endif
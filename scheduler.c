@@ -0,0 +1,130 @@
+// Scheduler Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Run-to-completion event loop
+// Interrupts post events to a FIFO, and the main loop hands each one to the
+// handler registered for it, sleeping (see idle) whenever the FIFO is empty
+// An event that is already queued is not queued again, so the FIFO can
+// never hold more than NUM_EVENTS entries and posting never fails
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "tm4c123gh6pm.h"
+#include "scheduler.h"
+#include "power.h"
+#include "stats.h"
+
+#define QUEUE_SIZE NUM_EVENTS
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+_eventHandler handlers[NUM_EVENTS];
+volatile uint8_t queue[QUEUE_SIZE];
+volatile uint8_t queueHead = 0;
+volatile uint8_t queueCount = 0;
+volatile bool queued[NUM_EVENTS];
+bool woke = false;
+uint8_t wakeEvent = NUM_EVENTS;
+uint32_t wakeCycles;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initScheduler() {
+	uint8_t i;
+	for (i = 0; i < NUM_EVENTS; i++) {
+		handlers[i] = 0;
+		queued[i] = false;
+	}
+	queueHead = 0;
+	queueCount = 0;
+}
+
+// Registers the handler for an event; events without one are dropped
+void setEventHandler(uint8_t event, _eventHandler handler) {
+	handlers[event] = handler;
+}
+
+// Queues an event for the main loop
+// Safe to call from interrupt handlers
+void postEvent(uint8_t event) {
+	uint32_t status = _disable_interrupts();
+	if (!queued[event]) {
+		queued[event] = true;
+		queue[(queueHead + queueCount) % QUEUE_SIZE] = event;
+		queueCount++;
+	}
+	_restore_interrupts(status);
+}
+
+// Runs the handler of the oldest queued event
+// Returns false if there was none
+bool dispatchEvent() {
+	uint32_t status;
+	uint8_t event;
+	status = _disable_interrupts();
+	if (queueCount == 0) {
+		_restore_interrupts(status);
+		return false;
+	}
+	event = queue[queueHead];
+	queueHead = (queueHead + 1) % QUEUE_SIZE;
+	queueCount--;
+	// cleared before the handler runs so that it can post its own event again
+	queued[event] = false;
+	_restore_interrupts(status);
+	// the first event after a sleep is the one that woke us
+	if (woke) {
+		woke = false;
+		wakeEvent = event;
+	}
+	if (handlers[event] != 0)
+		(*handlers[event])();
+	return true;
+}
+
+// Returns true, once, with the cycle count at wake-up if event was the one
+// that ended the last sleep
+bool getWakeStart(uint8_t event, uint32_t* start) {
+	if (wakeEvent != event)
+		return false;
+	wakeEvent = NUM_EVENTS;
+	*start = wakeCycles;
+	return true;
+}
+
+// Dispatches events forever
+// The queue is checked with interrupts masked, so an event posted just before
+// WFI still wakes the core: WFI returns on a pending interrupt even while it
+// is masked, and the handler runs once interrupts are restored
+// The cycle counter stops while the core sleeps, so wake-up times start from
+// the return of idle
+void runScheduler() {
+	uint32_t status;
+	while (true) {
+		if (dispatchEvent())
+			continue;
+		status = _disable_interrupts();
+		if (queueCount == 0) {
+			idle();
+			wakeCycles = getCycles();
+			woke = true;
+			wakeEvent = NUM_EVENTS;
+		}
+		_restore_interrupts(status);
+	}
+}
@@ -0,0 +1,43 @@
+// Scheduler Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Events
+// The queue is strictly FIFO: handlers get events in the order they were
+// posted, with no priority between them
+#define EVENT_TIMER    0
+#define EVENT_ETHER    1
+#define EVENT_ETHER_TX 2
+#define EVENT_UART     3
+#define NUM_EVENTS     4
+
+typedef void (*_eventHandler)();
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initScheduler();
+void setEventHandler(uint8_t event, _eventHandler handler);
+void postEvent(uint8_t event);
+bool dispatchEvent();
+bool getWakeStart(uint8_t event, uint32_t* start);
+void runScheduler();
+
+#endif
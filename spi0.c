@@ -32,10 +32,39 @@
 #define SSI0FSS PORTA,3
 #define SSI0CLK PORTA,2
 
+// uDMA channels used by SSI0 (channel map encoding 0)
+#define DMA_CH_SSI0RX 10
+#define DMA_CH_SSI0TX 11
+#define DMA_SSI0RX_MASK (1 << DMA_CH_SSI0RX)
+#define DMA_SSI0TX_MASK (1 << DMA_CH_SSI0TX)
+
+// Largest transfer handled by a single basic mode transfer
+#define DMA_MAX_TRANSFER 1024
+
+// Transfers shorter than this are faster without the channel setup
+#define DMA_MIN_TRANSFER 16
+
+// Depth of the SSI tx and rx FIFOs
+#define SSI_FIFO_DEPTH 8
+
+// The uDMA only reaches SRAM and the peripherals, not flash
+#define SRAM_START 0x20000000
+#define SRAM_END   0x20008000
+
 //-----------------------------------------------------------------------------
 // Global variables
 //-----------------------------------------------------------------------------
 
+// uDMA channel control table (primary structures only)
+// 4 words per channel: source end, destination end, control, unused
+#pragma DATA_ALIGN(dmaControlTable, 1024)
+volatile uint32_t dmaControlTable[128];
+
+bool spi0DmaEnabled = false;
+// Kept in SRAM (not const, which would place it in flash) for the uDMA to read
+volatile uint8_t dmaTxFill = 0;
+uint8_t dmaRxDiscard;
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
@@ -103,3 +132,101 @@ uint32_t readSpi0Data()
 {
     return SSI0_DR_R;
 }
+
+// Enable uDMA transfers on SSI0 for the buffer functions
+void initSpi0Dma()
+{
+    SYSCTL_RCGCDMA_R |= SYSCTL_RCGCDMA_R0;
+    _delay_cycles(3);
+    UDMA_CFG_R = UDMA_CFG_MASTEN;                      // enable controller
+    UDMA_CTLBASE_R = (uint32_t)dmaControlTable;
+    UDMA_CHMAP1_R &= ~(UDMA_CHMAP1_CH10SEL_M | UDMA_CHMAP1_CH11SEL_M); // select SSI0 rx and tx
+    UDMA_ALTCLR_R = DMA_SSI0RX_MASK | DMA_SSI0TX_MASK;      // use primary control structures
+    UDMA_USEBURSTCLR_R = DMA_SSI0RX_MASK | DMA_SSI0TX_MASK; // respond to single and burst requests
+    UDMA_REQMASKCLR_R = DMA_SSI0RX_MASK | DMA_SSI0TX_MASK;  // allow peripheral requests
+    UDMA_PRIOSET_R = DMA_SSI0RX_MASK;                       // drain rx ahead of tx to avoid overrun
+    spi0DmaEnabled = true;
+}
+
+// Full-duplex transfer of size bytes with the uDMA
+// A null rx discards received data and a null tx sends zeros
+// Blocks until the last byte has been received
+void transferSpi0Dma(uint8_t rx[], const uint8_t tx[], uint16_t size)
+{
+    uint16_t count;
+    volatile uint32_t* rxCtl = &dmaControlTable[DMA_CH_SSI0RX * 4];
+    volatile uint32_t* txCtl = &dmaControlTable[DMA_CH_SSI0TX * 4];
+    while (size > 0)
+    {
+        count = (size > DMA_MAX_TRANSFER) ? DMA_MAX_TRANSFER : size;
+        rxCtl[0] = (uint32_t)&SSI0_DR_R;
+        rxCtl[1] = rx ? (uint32_t)&rx[count - 1] : (uint32_t)&dmaRxDiscard;
+        rxCtl[2] = (rx ? UDMA_CHCTL_DSTINC_8 : UDMA_CHCTL_DSTINC_NONE) | UDMA_CHCTL_DSTSIZE_8
+                 | UDMA_CHCTL_SRCINC_NONE | UDMA_CHCTL_SRCSIZE_8 | UDMA_CHCTL_ARBSIZE_4
+                 | ((count - 1) << UDMA_CHCTL_XFERSIZE_S) | UDMA_CHCTL_XFERMODE_BASIC;
+        txCtl[0] = tx ? (uint32_t)&tx[count - 1] : (uint32_t)&dmaTxFill;
+        txCtl[1] = (uint32_t)&SSI0_DR_R;
+        txCtl[2] = UDMA_CHCTL_DSTINC_NONE | UDMA_CHCTL_DSTSIZE_8
+                 | (tx ? UDMA_CHCTL_SRCINC_8 : UDMA_CHCTL_SRCINC_NONE) | UDMA_CHCTL_SRCSIZE_8
+                 | UDMA_CHCTL_ARBSIZE_4 | ((count - 1) << UDMA_CHCTL_XFERSIZE_S)
+                 | UDMA_CHCTL_XFERMODE_BASIC;
+        UDMA_ENASET_R = DMA_SSI0RX_MASK | DMA_SSI0TX_MASK;
+        SSI0_DMACTL_R = SSI_DMACTL_RXDMAE | SSI_DMACTL_TXDMAE;
+        // rx channel is disabled by hardware when its last byte has arrived
+        while (UDMA_ENASET_R & DMA_SSI0RX_MASK);
+        SSI0_DMACTL_R = 0;
+        UDMA_CHIS_R = DMA_SSI0RX_MASK | DMA_SSI0TX_MASK;
+        if (rx) rx += count;
+        if (tx) tx += count;
+        size -= count;
+    }
+}
+
+// Full-duplex transfer of size bytes by the CPU, streaming through the FIFOs
+// The tx FIFO is kept full while the rx FIFO is drained as data arrives, so
+// there are no gaps on the line between bytes
+// At most SSI_FIFO_DEPTH bytes are in flight, so the rx FIFO cannot overrun
+void transferSpi0Fifo(uint8_t rx[], const uint8_t tx[], uint16_t size)
+{
+    uint16_t sent = 0, received = 0;
+    uint8_t data;
+    while (received < size)
+    {
+        while (sent < size && (sent - received) < SSI_FIFO_DEPTH && (SSI0_SR_R & SSI_SR_TNF))
+        {
+            SSI0_DR_R = tx ? tx[sent] : 0;
+            sent++;
+        }
+        while (SSI0_SR_R & SSI_SR_RNE)
+        {
+            data = SSI0_DR_R;
+            if (rx) rx[received] = data;
+            received++;
+        }
+    }
+}
+
+// Reads size bytes into buffer, clocking out zeros
+void readSpi0Buffer(uint8_t buffer[], uint16_t size)
+{
+    if (spi0DmaEnabled && size >= DMA_MIN_TRANSFER)
+        transferSpi0Dma(buffer, 0, size);
+    else
+        transferSpi0Fifo(buffer, 0, size);
+}
+
+// Returns true if the uDMA can read all size bytes of buffer
+bool isSpi0DmaBuffer(const uint8_t buffer[], uint16_t size)
+{
+    return (uint32_t)buffer >= SRAM_START && (uint32_t)buffer + size <= SRAM_END;
+}
+
+// Writes size bytes from buffer, discarding received data
+// A buffer in flash, such as a const table, is sent through the FIFOs
+void writeSpi0Buffer(const uint8_t buffer[], uint16_t size)
+{
+    if (spi0DmaEnabled && size >= DMA_MIN_TRANSFER && isSpi0DmaBuffer(buffer, size))
+        transferSpi0Dma(0, buffer, size);
+    else
+        transferSpi0Fifo(0, buffer, size);
+}
@@ -35,5 +35,8 @@ void setSpi0BaudRate(uint32_t clockRate, uint32_t fcyc);
 void setSpi0Mode(uint8_t polarity, uint8_t phase);
 void writeSpi0Data(uint32_t data);
 uint32_t readSpi0Data();
+void initSpi0Dma();
+void readSpi0Buffer(uint8_t buffer[], uint16_t size);
+void writeSpi0Buffer(const uint8_t buffer[], uint16_t size);
 
 #endif
@@ -0,0 +1,137 @@
+// Statistics Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz
+
+// Packet counters and per-stage cycle counts
+// Counters are plain increments so they are cheap enough to leave in the
+// packet path; stage times come from the DWT cycle counter (25 ns per cycle)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "tm4c123gh6pm.h"
+#include "uart0.h"
+#include "packet.h"
+#include "stats.h"
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+volatile uint32_t stats[NUM_STATS];
+cycleStats stages[NUM_STAGES];
+uint8_t packetCountHighWater;
+
+const char* statNames[NUM_STATS] = {
+	"rx frames", "rx arp", "rx icmp", "rx udp", "rx tcp", "rx dhcp", "rx dropped",
+	"tx frames", "tx aborts", "rx overflows", "checksum errors", "rx early drops",
+	"pool failures"
+};
+
+const char* stageNames[NUM_STAGES] = {
+	"rx", "classify", "tx", "arp reply", "ping reply", "udp reply", "wake to rx",
+#ifdef BENCHMARK
+	"tick isr"
+#endif
+};
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Starts the cycle counter and clears everything
+void initStats() {
+	CORE_DEMCR_R |= CORE_DEMCR_TRCENA;
+	DWT_CYCCNT_R = 0;
+	DWT_CTRL_R |= DWT_CTRL_CYCCNTENA;
+	resetStats();
+}
+
+void resetStats() {
+	uint8_t i;
+	for (i = 0; i < NUM_STATS; i++)
+		stats[i] = 0;
+	for (i = 0; i < NUM_STAGES; i++)
+		clearCycles(&stages[i]);
+	packetCountHighWater = 0;
+}
+
+void clearCycles(cycleStats* s) {
+	s->count = 0;
+	s->total = 0;
+	s->min = 0xFFFFFFFF;
+	s->max = 0;
+}
+
+void addCycles(cycleStats* s, uint32_t cycles) {
+	s->count++;
+	s->total += cycles;
+	if (cycles < s->min)
+		s->min = cycles;
+	if (cycles > s->max)
+		s->max = cycles;
+}
+
+// Writes cycles per call as min/avg/max (calls)
+void putCyclesUart0(cycleStats* s) {
+	if (s->count == 0) {
+		putsUart0("-");
+		return;
+	}
+	putUintUart0(s->min);
+	putcUart0('/');
+	putUintUart0(s->total / s->count);
+	putcUart0('/');
+	putUintUart0(s->max);
+	putsUart0(" (");
+	putUintUart0(s->count);
+	putsUart0(" calls)");
+}
+
+// Adds the cycles since start (a getCycles value) to a stage
+void recordCycles(uint8_t stage, uint32_t start) {
+	addCycles(&stages[stage], getCycles() - start);
+}
+
+// Tracks the most packets seen waiting in the controller at once
+void recordPacketCount(uint8_t count) {
+	if (count > packetCountHighWater)
+		packetCountHighWater = count;
+}
+
+void displayStats() {
+	uint8_t i;
+	for (i = 0; i < NUM_STATS; i++) {
+		putsUart0((char*) statNames[i]);
+		putsUart0(": ");
+		putUintUart0(stats[i]);
+		putsUart0("\r\n");
+	}
+	putsUart0("epktcnt high water: ");
+	putUintUart0(packetCountHighWater);
+	putsUart0("\r\n");
+	putsUart0("pool free small/large: ");
+	putUintUart0(getFreePackets(PACKET_CLASS_SMALL));
+	putsUart0("/");
+	putUintUart0(getFreePackets(PACKET_CLASS_LARGE));
+	putsUart0(" (low water ");
+	putUintUart0(getMinFreePackets(PACKET_CLASS_SMALL));
+	putsUart0("/");
+	putUintUart0(getMinFreePackets(PACKET_CLASS_LARGE));
+	putsUart0(")\r\n");
+	for (i = 0; i < NUM_STAGES; i++) {
+		putsUart0((char*) stageNames[i]);
+		putsUart0(" cycles: ");
+		putCyclesUart0(&stages[i]);
+		putsUart0("\r\n");
+	}
+}
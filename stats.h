@@ -0,0 +1,86 @@
+// Statistics Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Counters
+#define STAT_RX_FRAMES      0
+#define STAT_RX_ARP         1
+#define STAT_RX_ICMP        2
+#define STAT_RX_UDP         3
+#define STAT_RX_TCP         4
+#define STAT_RX_DHCP        5
+#define STAT_RX_DROPPED     6
+#define STAT_TX_FRAMES      7
+#define STAT_TX_ABORTS      8
+#define STAT_RX_OVERFLOWS   9
+#define STAT_CHECKSUM_ERRORS 10
+#define STAT_RX_EARLY_DROPS 11
+#define STAT_POOL_FAILURES  12
+#define NUM_STATS           13
+
+// Timed stages
+// Reply stages run from the start of reading the request to the reply being queued
+// Wake to rx runs from the end of a sleep to the first frame being handled
+#define STAGE_RX         0
+#define STAGE_CLASSIFY   1
+#define STAGE_TX         2
+#define STAGE_ARP_REPLY  3
+#define STAGE_PING_REPLY 4
+#define STAGE_UDP_REPLY  5
+#define STAGE_WAKE       6
+#ifdef BENCHMARK
+#define STAGE_TICK       7
+#define NUM_STAGES       8
+#else
+#define NUM_STAGES       7
+#endif
+
+// Cortex-M4 DWT cycle counter
+#define CORE_DEMCR_R   (*((volatile uint32_t *)0xE000EDFC))
+#define DWT_CTRL_R     (*((volatile uint32_t *)0xE0001000))
+#define DWT_CYCCNT_R   (*((volatile uint32_t *)0xE0001004))
+#define CORE_DEMCR_TRCENA 0x01000000
+#define DWT_CTRL_CYCCNTENA 0x00000001
+
+typedef struct _cycleStats {
+	uint32_t count;
+	uint32_t total;
+	uint32_t min;
+	uint32_t max;
+} cycleStats;
+
+extern volatile uint32_t stats[NUM_STATS];
+
+#define countStat(stat) (stats[stat]++)
+#define getCycles() (DWT_CYCCNT_R)
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initStats();
+void resetStats();
+void clearCycles(cycleStats* s);
+void addCycles(cycleStats* s, uint32_t cycles);
+void putCyclesUart0(cycleStats* s);
+void recordCycles(uint8_t stage, uint32_t start);
+void recordPacketCount(uint8_t count);
+void displayStats();
+
+#endif
@@ -0,0 +1,174 @@
+// Telnet Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz
+
+// Remote console
+// Each connection on TELNET_PORT builds command lines the way the serial
+// terminal does and hands them to the same dispatcher, with the console
+// redirected into the connection's send buffer while the command runs
+// The command's output is flushed once it returns, so the TCP layer can send
+// it as a few full-size segments instead of a segment per write
+// Options are refused, which leaves the client in NVT mode with local echo
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "eth0.h"
+#include "uart0.h"
+#include "telnet.h"
+
+// Telnet commands (RFC 854)
+#define TELNET_SE   240
+#define TELNET_SB   250
+#define TELNET_WILL 251
+#define TELNET_WONT 252
+#define TELNET_DO   253
+#define TELNET_DONT 254
+#define TELNET_IAC  255
+
+// Receive states
+#define TELNET_DATA          0
+#define TELNET_COMMAND       1
+#define TELNET_OPTION        2
+#define TELNET_SUBOPTION     3
+#define TELNET_SUBOPTION_IAC 4
+
+typedef struct _telnetSession {
+	uint8_t state;
+	uint8_t command;
+	bool cr;
+	USER_DATA line;
+} telnetSession;
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+telnetSession telnetSessions[TCP_MAX_CONNECTIONS];
+_commandHandler telnetHandler = NULL;
+uint8_t telnetOutput = TCP_NO_CONNECTION;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Sets the dispatcher that runs the command lines of every connection
+void initTelnet(_commandHandler handler) {
+	uint8_t i;
+	telnetHandler = handler;
+	for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+		openTelnet(i);
+}
+
+// Starts a new session on a connection that has just been established
+void openTelnet(uint8_t connection) {
+	telnetSession* session;
+	if (connection >= TCP_MAX_CONNECTIONS)
+		return;
+	session = &telnetSessions[connection];
+	session->state = TELNET_DATA;
+	session->cr = false;
+	session->line.charCount = 0;
+}
+
+// Console output of a command run from a connection
+// Only goes into the send buffer; processTelnet flushes it afterwards
+void putcTelnet(char c) {
+	uint8_t data = c;
+	etherTcpWrite(telnetOutput, &data, 1);
+}
+
+// Answers an option the client asked for with a refusal
+void refuseTelnetOption(uint8_t connection, uint8_t command, uint8_t option) {
+	uint8_t reply[3];
+	// a client that disables an option needs no answer, since it is
+	// already off here
+	if (command != TELNET_WILL && command != TELNET_DO)
+		return;
+	reply[0] = TELNET_IAC;
+	reply[1] = command == TELNET_WILL ? TELNET_DONT : TELNET_WONT;
+	reply[2] = option;
+	etherTcpWrite(connection, reply, 3);
+}
+
+// Runs a complete line with the console sent to its connection
+void runTelnetLine(uint8_t connection, USER_DATA* line) {
+	telnetOutput = connection;
+	redirectUart0(putcTelnet);
+	parseFields(line);
+	(*telnetHandler)(line);
+	redirectUart0(NULL);
+	telnetOutput = TCP_NO_CONNECTION;
+	line->charCount = 0;
+}
+
+// Adds a data byte to the line of a connection, running the line once it is
+// complete; a line ends in CR LF or CR NUL, so the byte after a CR is dropped
+void addTelnetData(uint8_t connection, telnetSession* session, uint8_t c) {
+	if (session->cr && (c == 10 || c == 0)) {
+		session->cr = false;
+		return;
+	}
+	session->cr = (c == 13);
+	if (editLine(&session->line, c, false) && telnetHandler != NULL)
+		runTelnetLine(connection, &session->line);
+}
+
+// Takes a data segment of a Telnet connection: strips the Telnet commands,
+// runs each complete line and then sends the output and the ack together
+void processTelnet(etherPacketInfo* info) {
+	uint8_t connection = etherTcpGetConnection(info);
+	telnetSession* session;
+	uint16_t i, size;
+	uint8_t c;
+
+	if (connection == TCP_NO_CONNECTION)
+		return;
+	session = &telnetSessions[connection];
+	size = etherTcpReceive(info);
+	for (i = 0; i < size; i++) {
+		c = info->payload[i];
+		switch (session->state) {
+		case TELNET_DATA:
+			if (c == TELNET_IAC)
+				session->state = TELNET_COMMAND;
+			else
+				addTelnetData(connection, session, c);
+			break;
+		case TELNET_COMMAND:
+			session->state = TELNET_DATA;
+			if (c >= TELNET_WILL && c <= TELNET_DONT) {
+				session->command = c;
+				session->state = TELNET_OPTION;
+			} else if (c == TELNET_SB) {
+				session->state = TELNET_SUBOPTION;
+			} else if (c == TELNET_IAC) {
+				// IAC IAC is a data byte of 255, which only delimits fields
+				addTelnetData(connection, session, c);
+			}
+			break;
+		case TELNET_OPTION:
+			refuseTelnetOption(connection, session->command, c);
+			session->state = TELNET_DATA;
+			break;
+		case TELNET_SUBOPTION:
+			if (c == TELNET_IAC)
+				session->state = TELNET_SUBOPTION_IAC;
+			break;
+		case TELNET_SUBOPTION_IAC:
+			session->state = c == TELNET_SE ? TELNET_DATA : TELNET_SUBOPTION;
+			break;
+		}
+	}
+	etherTcpFlush(connection);
+}
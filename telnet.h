@@ -0,0 +1,36 @@
+// Telnet Library
+// Saeed Jassani
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef TELNET_H_
+#define TELNET_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+#include "uart0.h"
+
+#define TELNET_PORT 23
+
+// Runs one complete command line; console output is sent on the connection
+typedef void (*_commandHandler)(USER_DATA* data);
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initTelnet(_commandHandler handler);
+void openTelnet(uint8_t connection);
+void processTelnet(etherPacketInfo* info);
+
+#endif
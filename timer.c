@@ -22,128 +22,413 @@
 #include <stdbool.h>
 #include "tm4c123gh6pm.h"
 #include "timer.h"
+#include "scheduler.h"
+#include "stats.h"
+
+// Timers are kept in a hashed wheel: a timer due in n ticks sits in slot
+// (now + n) % WHEEL_SIZE and waits out (n - 1) / WHEEL_SIZE full turns, so
+// starting and stopping are O(1) and a tick only looks at one slot
+#define NUM_TIMERS 32
+#define WHEEL_SIZE 256
+
+#define TIMER_CLOCK 40000000
+
+// Longest stretched tick in tickless mode; the load must fit in 32 bits at
+// TIMER_CLOCK
+#define TICKLESS_MAX_TICKS (60 * TIMER_TICKS_PER_SECOND)
+
+#define TIMER_FREE    0
+#define TIMER_ARMED   1
+#define TIMER_EXPIRED 2
+
+typedef struct _timerNode {
+	struct _timerNode* next;
+	struct _timerNode* prev;
+	struct _timerNode** list;
+	_callback fn;
+	uint32_t period;
+	uint32_t rounds;
+	uint8_t state;
+	uint8_t generation;
+	bool reload;
+} timerNode;
 
 //-----------------------------------------------------------------------------
 // Global variables
 //-----------------------------------------------------------------------------
 
-#define NUM_TIMERS 10
-
-_callback fn[NUM_TIMERS];
-uint32_t period[NUM_TIMERS];
-uint32_t ticks[NUM_TIMERS];
-bool reload[NUM_TIMERS];
+timerNode timers[NUM_TIMERS];
+timerNode* wheel[WHEEL_SIZE];
+timerNode* expired = NULL;
+volatile uint32_t tickCount = 0;
+uint32_t tickClock = TIMER_CLOCK;
+uint32_t tickStep = 1;
+bool tickless = false;
 
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
-void initTimer() {
+// The wheel is shared with tickIsr, so it is only changed with the tick masked
+void maskTick() {
+	NVIC_DIS2_R = 1 << (INT_TIMER4A - 80);
+}
+
+void unmaskTick() {
+	NVIC_EN2_R = 1 << (INT_TIMER4A - 80);
+}
+
+void linkTimer(timerNode** list, timerNode* node) {
+	node->list = list;
+	node->prev = NULL;
+	node->next = *list;
+	if (*list != NULL)
+		(*list)->prev = node;
+	*list = node;
+}
+
+void unlinkTimer(timerNode* node) {
+	if (node->prev != NULL)
+		node->prev->next = node->next;
+	else
+		*node->list = node->next;
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	node->list = NULL;
+}
+
+// Places a timer in the wheel to expire ticks from now (at least one tick)
+void armTimer(timerNode* node, uint32_t ticks) {
+	if (ticks == 0)
+		ticks = 1;
+	node->rounds = (ticks - 1) / WHEEL_SIZE;
+	node->state = TIMER_ARMED;
+	linkTimer(&wheel[(tickCount + ticks) % WHEEL_SIZE], node);
+}
+
+// Returns the node of a live handle, or NULL if it has expired or been stopped
+timerNode* getTimerNode(timerHandle handle) {
+	timerNode* node;
+	uint8_t index = handle & 0xFF;
+	if (index == 0 || index > NUM_TIMERS)
+		return NULL;
+	node = &timers[index - 1];
+	if (node->state == TIMER_FREE || node->generation != (handle >> 8))
+		return NULL;
+	return node;
+}
+
+void freeTimer(timerNode* node) {
+	node->state = TIMER_FREE;
+	node->fn = NULL;
+	node->generation++;
+}
+
+// Loads Timer 4 for a time-out every tickStep ticks at tickClock
+void loadTick() {
+	TIMER4_TAILR_R = tickClock / TIMER_TICKS_PER_SECOND * tickStep;
+}
+
+// Returns the ticks until the soonest armed timer is due, or max if none is
+// due before then
+uint32_t getTicksToNextTimer(uint32_t max) {
+	uint32_t ticks, next = max;
 	uint8_t i;
+	if (expired != NULL)
+		return 1;
+	for (i = 0; i < NUM_TIMERS; i++) {
+		if (timers[i].state != TIMER_ARMED)
+			continue;
+		ticks = (timers[i].list - wheel + WHEEL_SIZE - tickCount % WHEEL_SIZE) % WHEEL_SIZE;
+		if (ticks == 0)
+			ticks = WHEEL_SIZE;
+		ticks += timers[i].rounds * WHEEL_SIZE;
+		if (ticks < next)
+			next = ticks;
+	}
+	return next;
+}
+
+// Counts a tick and moves the timers due in its slot to the expired list
+void advanceTick() {
+	timerNode* node;
+	timerNode* next;
+	tickCount++;
+	node = wheel[tickCount % WHEEL_SIZE];
+	while (node != NULL) {
+		next = node->next;
+		if (node->rounds == 0) {
+			unlinkTimer(node);
+			node->state = TIMER_EXPIRED;
+			linkTimer(&expired, node);
+			postEvent(EVENT_TIMER);
+		} else
+			node->rounds--;
+		node = next;
+	}
+}
+
+// Counts the whole ticks of a stretched tick that have gone by so far
+// A time-out that has not been serviced yet is counted here instead of by
+// tickIsr, since the step is about to change
+// Call with the tick masked
+void catchUpTicks() {
+	uint32_t load = TIMER4_TAILR_R;
+	uint32_t elapsed = 0;
+	if (tickStep == 1)
+		return;
+	if (TIMER4_RIS_R & TIMER_RIS_TATORIS) {
+		TIMER4_ICR_R = TIMER_ICR_TATOCINT;
+		NVIC_UNPEND2_R = 1 << (INT_TIMER4A - 80);
+		elapsed = tickStep;
+	}
+	elapsed += (load - TIMER4_TAV_R) / (load / tickStep);
+	while (elapsed-- > 0)
+		advanceTick();
+}
+
+// Stretches the next time-out to the soonest timer in tickless mode, or
+// goes back to one tick per time-out
+// Call with the tick masked
+void stretchTick() {
+	tickStep = tickless ? getTicksToNextTimer(TICKLESS_MAX_TICKS) : 1;
+	loadTick();
+}
+
+// Rounds up without overflowing for any ms
+uint32_t msToTicks(uint32_t ms) {
+	return ms / TIMER_TICK_MS + (ms % TIMER_TICK_MS != 0);
+}
+
+// Saturates at the longest time the wheel can count
+uint32_t secondsToTicks(uint32_t seconds) {
+	if (seconds > 0xFFFFFFFF / TIMER_TICKS_PER_SECOND)
+		return 0xFFFFFFFF;
+	return seconds * TIMER_TICKS_PER_SECOND;
+}
+
+void initTimer() {
+	uint16_t i;
 
 	// Enable clocks
 	SYSCTL_RCGCTIMER_R |= SYSCTL_RCGCTIMER_R4;
 	_delay_cycles(3);
-	// Configure Timer 4 for 1 sec tick
+	// Configure Timer 4 for the wheel tick
 	TIMER4_CTL_R &= ~TIMER_CTL_TAEN;                 // turn-off timer before reconfiguring
 	TIMER4_CFG_R = TIMER_CFG_32_BIT_TIMER;           // configure as 32-bit timer (A+B)
 	TIMER4_TAMR_R = TIMER_TAMR_TAMR_PERIOD;          // configure for periodic mode (count down)
-	TIMER4_TAILR_R = 40000000;                       // set load value (1 Hz rate)
+	tickClock = TIMER_CLOCK;
+	tickStep = 1;
+	tickless = false;
+	loadTick();                                      // set load value (TIMER_TICKS_PER_SECOND rate)
 	TIMER4_CTL_R |= TIMER_CTL_TAEN;                  // turn-on timer
 	TIMER4_IMR_R |= TIMER_IMR_TATOIM;                // turn-on interrupt
 	NVIC_EN2_R |= 1 << (INT_TIMER4A - 80);             // turn-on interrupt 86 (TIMER4A)
 
+	for (i = 0; i < WHEEL_SIZE; i++)
+		wheel[i] = NULL;
+	expired = NULL;
 	for (i = 0; i < NUM_TIMERS; i++) {
-		period[i] = 0;
-		ticks[i] = 0;
-		fn[i] = NULL;
-		reload[i] = false;
+		timers[i].state = TIMER_FREE;
+		timers[i].fn = NULL;
+		timers[i].list = NULL;
+		timers[i].generation = 1;
 	}
 }
 
-bool startOneshotTimer(_callback callback, uint32_t seconds) {
+// Starts a timer that calls callback from processTimers after ticks ticks,
+// and again every ticks ticks if periodic
+// Returns TIMER_INVALID if all timers are in use
+timerHandle startTimerTicks(_callback callback, uint32_t ticks, bool periodic) {
+	timerNode* node = NULL;
+	timerHandle handle;
 	uint8_t i = 0;
-	bool found = false;
-	while (i < NUM_TIMERS && !found) {
-		found = fn[i] == NULL;
-		if (found) {
-			period[i] = seconds;
-			ticks[i] = seconds;
-			fn[i] = callback;
-			reload[i] = false;
-		}
-		i++;
+	maskTick();
+	while (i < NUM_TIMERS && node == NULL) {
+		if (timers[i].state == TIMER_FREE)
+			node = &timers[i];
+		else
+			i++;
 	}
-	return found;
+	if (node == NULL) {
+		unmaskTick();
+		return TIMER_INVALID;
+	}
+	// a stretched tick could run past the new timer, so cut it short
+	if (tickless)
+		catchUpTicks();
+	node->fn = callback;
+	node->period = ticks;
+	node->reload = periodic;
+	armTimer(node, node->period);
+	if (tickless)
+		stretchTick();
+	handle = ((timerHandle) node->generation << 8) | (i + 1);
+	unmaskTick();
+	return handle;
 }
 
-bool startPeriodicTimer(_callback callback, uint32_t seconds) {
-	uint8_t i = 0;
-	bool found = false;
-	while (i < NUM_TIMERS && !found) {
-		found = fn[i] == NULL;
-		if (found) {
-			period[i] = seconds;
-			ticks[i] = seconds;
-			fn[i] = callback;
-			reload[i] = true;
-		}
-		i++;
+// Starts a timer that calls callback from processTimers after ms milliseconds,
+// and again every ms milliseconds if periodic
+// Returns TIMER_INVALID if all timers are in use
+timerHandle startTimer(_callback callback, uint32_t ms, bool periodic) {
+	return startTimerTicks(callback, msToTicks(ms), periodic);
+}
+
+// Stops a timer, including one that has expired but not yet been processed
+// Returns false if the handle is no longer live
+bool cancelTimer(timerHandle handle) {
+	timerNode* node;
+	maskTick();
+	node = getTimerNode(handle);
+	if (node != NULL) {
+		unlinkTimer(node);
+		freeTimer(node);
 	}
-	return found;
+	unmaskTick();
+	return node != NULL;
 }
 
-bool stopTimer(_callback callback) {
-	uint8_t i = 0;
-	bool found = false;
-	while (i < NUM_TIMERS && !found) {
-		found = fn[i] == callback;
-		if (found)
-			ticks[i] = 0;
-		i++;
+// Starts a live timer over with its full period
+bool resetTimer(timerHandle handle) {
+	timerNode* node;
+	maskTick();
+	node = getTimerNode(handle);
+	if (node != NULL) {
+		unlinkTimer(node);
+		armTimer(node, node->period);
 	}
-	return found;
+	unmaskTick();
+	return node != NULL;
+}
+
+// Returns true while a timer is running or waiting for its callback
+bool isTimerActive(timerHandle handle) {
+	return getTimerNode(handle) != NULL;
+}
+
+// Second timers are counted in ticks directly, so long leases do not
+// overflow a count of ms
+timerHandle startOneshotTimer(_callback callback, uint32_t seconds) {
+	return startTimerTicks(callback, secondsToTicks(seconds), false);
+}
+
+timerHandle startPeriodicTimer(_callback callback, uint32_t seconds) {
+	return startTimerTicks(callback, secondsToTicks(seconds), true);
 }
 
 void stopAllTimers() {
-	uint8_t i = 0;
+	uint16_t i;
+	maskTick();
+	for (i = 0; i < WHEEL_SIZE; i++)
+		wheel[i] = NULL;
+	expired = NULL;
 	for (i = 0; i < NUM_TIMERS; i++) {
-		period[i] = 0;
-		ticks[i] = 0;
-		fn[i] = NULL;
-		reload[i] = false;
+		if (timers[i].state != TIMER_FREE)
+			freeTimer(&timers[i]);
+		timers[i].list = NULL;
 	}
+	unmaskTick();
 }
 
-bool restartTimer(_callback callback) {
-	uint8_t i = 0;
-	bool found = false;
-	while (i < NUM_TIMERS && !found) {
-		found = fn[i] == callback;
-		if (found)
-			ticks[i] = period[i];
-		i++;
+// Runs the callbacks of expired timers
+// Call from the main loop (it is the EVENT_TIMER handler); callbacks never
+// run in interrupt context
+void processTimers() {
+	timerNode* node;
+	_callback fn;
+	while (expired != NULL) {
+		maskTick();
+		node = expired;
+		if (node == NULL) {
+			unmaskTick();
+			break;
+		}
+		unlinkTimer(node);
+		fn = node->fn;
+		if (node->reload)
+			armTimer(node, node->period);
+		else
+			freeTimer(node);
+		unmaskTick();
+		(*fn)();
 	}
-	return found;
 }
 
+// Moves the timers due since the last time-out to the expired list
 void tickIsr() {
-	uint8_t i;
-	for (i = 0; i < NUM_TIMERS; i++) {
-		if (ticks[i] != 0) {
-			ticks[i]--;
-			if (ticks[i] == 0) {
-				if (reload[i])
-					ticks[i] = period[i];
-				(*fn[i])();
-			}
-		}
-	}
+	uint32_t i;
+#ifdef BENCHMARK
+	uint32_t start = getCycles();
+#endif
+	for (i = 0; i < tickStep; i++)
+		advanceTick();
+	if (tickless)
+		stretchTick();
 	TIMER4_ICR_R = TIMER_ICR_TATOCINT;
+#ifdef BENCHMARK
+	recordCycles(STAGE_TICK, start);
+#endif
+}
+
+// Reloads the tick for a new Timer 4 clock (the power library runs it from
+// PIOSC in deep sleep)
+// The reload restarts the count, so the ticks of a stretched tick that have
+// gone by are counted first
+// Call with interrupts masked (see idle)
+void setTickClock(uint32_t clock) {
+	catchUpTicks();
+	tickClock = clock;
+	stretchTick();
+}
+
+// Tickless mode stretches each Timer 4 time-out to the next timer that is
+// due, up to TICKLESS_MAX_TICKS, so a long idle such as standby only wakes for
+// its timers and interrupts
+void startTickless() {
+	maskTick();
+	tickless = true;
+	stretchTick();
+	unmaskTick();
+}
+
+// Counts the part of the stretched tick that has gone by and goes back to
+// one tick per time-out
+void stopTickless() {
+	maskTick();
+	catchUpTicks();
+	tickless = false;
+	stretchTick();
+	unmaskTick();
+}
+
+// Seconds since initTimer, unaffected by stopAllTimers
+uint32_t getUptime() {
+	return tickCount / TIMER_TICKS_PER_SECOND;
+}
+
+// Milliseconds since initTimer, from the tick count and the Timer 4 count
+// A time-out that has not been serviced yet counts as the next tickStep ticks
+// The count is scaled by the current load, which setTickClock changes for a
+// deep sleep and tickless mode stretches
+uint32_t getMilliseconds() {
+	uint32_t ticks, value, load, step;
+	bool timeout;
+	do {
+		ticks = tickCount;
+		step = tickStep;
+		load = TIMER4_TAILR_R;
+		value = TIMER4_TAV_R;
+		timeout = (TIMER4_RIS_R & TIMER_RIS_TATORIS) != 0;
+	} while (ticks != tickCount);
+	if (value > load)
+		value = load;
+	if (timeout && value > load / 2)
+		ticks += step;
+	return ticks * TIMER_TICK_MS + (load - value) / (load / (TIMER_TICK_MS * step));
 }
 
 // Placeholder random number function
 uint32_t random32() {
 	return TIMER4_TAV_R;
 }
-
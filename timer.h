@@ -26,16 +26,35 @@
 
 typedef void (*_callback)();
 
+// Opaque timer handle, stale once its timer expires (one-shot) or is cancelled
+typedef uint16_t timerHandle;
+#define TIMER_INVALID 0
+
+// Wheel tick period; must divide 1000
+#ifndef TIMER_TICK_MS
+#define TIMER_TICK_MS 10
+#endif
+#define TIMER_TICKS_PER_SECOND (1000 / TIMER_TICK_MS)
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
 void initTimer();
-bool startOneshotTimer(_callback callback, uint32_t seconds);
-bool startPeriodicTimer(_callback callback, uint32_t seconds);
-bool stopTimer(_callback callback);
+timerHandle startTimer(_callback callback, uint32_t ms, bool periodic);
+bool cancelTimer(timerHandle handle);
+bool resetTimer(timerHandle handle);
+bool isTimerActive(timerHandle handle);
+timerHandle startOneshotTimer(_callback callback, uint32_t seconds);
+timerHandle startPeriodicTimer(_callback callback, uint32_t seconds);
 void stopAllTimers();
-bool restartTimer(_callback callback);
+void processTimers();
 void tickIsr();
+uint32_t getUptime();
+uint32_t getMilliseconds();
+uint32_t random32();
+void setTickClock(uint32_t clock);
+void startTickless();
+void stopTickless();
 
 #endif
@@ -21,17 +21,33 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "tm4c123gh6pm.h"
 #include "uart0.h"
+#include "scheduler.h"
 
 // PortA masks
 #define UART_TX_MASK 2
 #define UART_RX_MASK 1
 
+// Characters are moved between these rings and the hardware FIFOs by
+// uart0Isr, so writing a line or typing a command never holds up the main loop
+#define RX_BUFFER_SIZE 64
+#define TX_BUFFER_SIZE 256
+
 //-----------------------------------------------------------------------------
 // Global variables
 //-----------------------------------------------------------------------------
 
+char rxBuffer[RX_BUFFER_SIZE];
+volatile uint8_t rxHead = 0;
+volatile uint8_t rxCount = 0;
+volatile uint32_t rxOverflows = 0;
+char txBuffer[TX_BUFFER_SIZE];
+volatile uint16_t txHead = 0;
+volatile uint16_t txCount = 0;
+_putcHandler outputRedirect = NULL;
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
@@ -62,12 +78,37 @@ void initUart0() {
 
 	// Configure UART0 to 115200 baud, 8N1 format
 	UART0_CTL_R = 0;                                    // turn-off UART0 to allow safe programming
-	UART0_CC_R = UART_CC_CS_SYSCLK;                     // use system clock (40 MHz)
-	UART0_IBRD_R = 21;                               // r = 40 MHz / (Nx115.2kHz), set floor(r)=21, where N=16
-	UART0_FBRD_R = 45;                                  // round(fract(r)*64)=45
+	UART0_CC_R = UART_CC_CS_PIOSC;                      // use PIOSC (16 MHz), which also runs in deep sleep
+	UART0_IBRD_R = 8;                                   // r = 16 MHz / (Nx115.2kHz), set floor(r)=8, where N=16
+	UART0_FBRD_R = 44;                                  // round(fract(r)*64)=44
 	UART0_LCRH_R = UART_LCRH_WLEN_8 | UART_LCRH_FEN;    // configure for 8N1 w/ 16-level FIFO
 	UART0_CTL_R = UART_CTL_TXE | UART_CTL_RXE | UART_CTL_UARTEN;
 	// enable TX, RX, and module
+
+	// The TX interrupt is unmasked whenever characters are queued; RX waits
+	// for enableUart0RxInterrupt
+	rxHead = rxCount = 0;
+	txHead = txCount = 0;
+	UART0_IM_R = 0;
+	NVIC_EN0_R |= 1 << (INT_UART0 - 16);
+}
+
+// The rings are shared with uart0Isr, so they are only changed with it masked
+void maskUart0() {
+	NVIC_DIS0_R = 1 << (INT_UART0 - 16);
+}
+
+void unmaskUart0() {
+	NVIC_EN0_R = 1 << (INT_UART0 - 16);
+}
+
+// Moves queued characters into the TX FIFO until either runs out
+void fillUart0TxFifo() {
+	while (txCount > 0 && !(UART0_FR_R & UART_FR_TXFF)) {
+		UART0_DR_R = txBuffer[txHead];
+		txHead = (txHead + 1) % TX_BUFFER_SIZE;
+		txCount--;
+	}
 }
 
 // Set baud rate as function of instruction cycle frequency
@@ -78,77 +119,219 @@ void setUart0BaudRate(uint32_t baudRate, uint32_t fcyc) {
 	UART0_FBRD_R = ((divisorTimes128 + 1)) >> 1 & 63;    // set fractional value to round(fract(r)*64)
 }
 
-// Blocking function that writes a serial character when the UART buffer is not full
+// Sends console output somewhere other than the serial port, such as the
+// Telnet session a command came in on; NULL goes back to the serial port
+void redirectUart0(_putcHandler handler) {
+	outputRedirect = handler;
+}
+
+// Queues a serial character for uart0Isr to send
+// Only waits if the TX ring is full, and then feeds the FIFO itself
 void putcUart0(char c) {
-	while (UART0_FR_R & UART_FR_TXFF)
-		;               // wait if uart0 tx fifo full
-	UART0_DR_R = c;                                  // write character to fifo
+	if (outputRedirect != NULL) {
+		(*outputRedirect)(c);
+		return;
+	}
+	maskUart0();
+	if (txCount == 0 && !(UART0_FR_R & UART_FR_TXFF)) {
+		UART0_DR_R = c;                              // nothing queued ahead of it
+	} else {
+		while (txCount == TX_BUFFER_SIZE) {
+			while (UART0_FR_R & UART_FR_TXFF)
+				;
+			fillUart0TxFifo();
+		}
+		txBuffer[(txHead + txCount) % TX_BUFFER_SIZE] = c;
+		txCount++;
+		UART0_IM_R |= UART_IM_TXIM;                  // refill when the FIFO drains
+	}
+	unmaskUart0();
 }
 
-// Blocking function that writes a string when the UART buffer is not full
+// Queues a string for uart0Isr to send
 void putsUart0(char* str) {
 	uint8_t i = 0;
 	while (str[i] != '\0')
 		putcUart0(str[i++]);
 }
 
+// Formatted output
+// These write straight into the TX ring, so status dumps need no string
+// buffers and none of the libc printf machinery
+
+// Writes value in decimal
+void putUintUart0(uint32_t value) {
+	char digits[10];
+	uint8_t i = 0;
+	do {
+		digits[i++] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+	while (i > 0)
+		putcUart0(digits[--i]);
+}
+
+// Writes value in decimal, with a leading '-' if it is negative
+void putIntUart0(int32_t value) {
+	if (value < 0) {
+		putcUart0('-');
+		putUintUart0(-(uint32_t) value);
+	} else
+		putUintUart0(value);
+}
+
+// Writes the low count nibbles of value as lowercase hex, zero padded
+void putHexUart0(uint32_t value, uint8_t count) {
+	uint8_t nibble;
+	while (count > 0) {
+		count--;
+		nibble = (value >> (count * 4)) & 0xF;
+		putcUart0(nibble < 10 ? '0' + nibble : 'a' + nibble - 10);
+	}
+}
+
+// Writes an address in w.x.y.z form
+void putIpUart0(const uint8_t ip[4]) {
+	uint8_t i;
+	for (i = 0; i < 4; i++) {
+		putUintUart0(ip[i]);
+		if (i < 4 - 1)
+			putcUart0('.');
+	}
+}
+
+// Writes an address in 02:03:04:05:06:88 form
+void putMacUart0(const uint8_t mac[6]) {
+	uint8_t i;
+	for (i = 0; i < 6; i++) {
+		putHexUart0(mac[i], 2);
+		if (i < 6 - 1)
+			putcUart0(':');
+	}
+}
+
 // Blocking function that returns with serial data once the buffer is not empty
 char getcUart0() {
-	while (UART0_FR_R & UART_FR_RXFE)
-		;               // wait if uart0 rx fifo empty
-	return UART0_DR_R & 0xFF;                        // get character from fifo
+	char c;
+	while (rxCount == 0)
+		;               // wait for uart0Isr to receive a character
+	maskUart0();
+	c = rxBuffer[rxHead];
+	rxHead = (rxHead + 1) % RX_BUFFER_SIZE;
+	rxCount--;
+	unmaskUart0();
+	return c;
 }
 
 // Returns the status of the receive buffer
 bool kbhitUart0() {
-	return !(UART0_FR_R & UART_FR_RXFE);
+	return rxCount > 0;
 }
 
-void getsUart0(USER_DATA* data) {
+// Returns the number of characters dropped because the RX ring was full
+uint32_t getUart0RxOverflows() {
+	return rxOverflows;
+}
 
-	data->charCount = 0;
-	char c;
-	while ((c = getcUart0())) {
+// Starts receiving into the RX ring, posting EVENT_UART as characters arrive
+void enableUart0RxInterrupt() {
+	UART0_ICR_R = UART_ICR_RXIC | UART_ICR_RTIC;
+	UART0_IM_R |= UART_IM_RXIM | UART_IM_RTIM;
+	NVIC_EN0_R |= 1 << (INT_UART0 - 16);
+}
 
-		// Handle Backspace
-		if (c == 127) {
-			if (data->charCount > 0) {
-				data->charCount--;
-				putsUart0("<bs>"); // Display <bs> when backspace is pressed on keyboard
-			}
-			continue;
+// UART0 handler
+// Drains the RX FIFO into the RX ring (posting EVENT_UART) and refills the
+// TX FIFO from the TX ring, masking TX once the ring is empty
+void uart0Isr() {
+	bool received = false;
+	UART0_ICR_R = UART_ICR_RXIC | UART_ICR_RTIC | UART_ICR_TXIC;
+	while (!(UART0_FR_R & UART_FR_RXFE)) {
+		char c = UART0_DR_R & 0xFF;
+		if (rxCount < RX_BUFFER_SIZE) {
+			rxBuffer[(rxHead + rxCount) % RX_BUFFER_SIZE] = c;
+			rxCount++;
+		} else
+			rxOverflows++;
+		received = true;
+	}
+	fillUart0TxFifo();
+	if (txCount == 0)
+		UART0_IM_R &= ~UART_IM_TXIM;
+	if (received)
+		postEvent(EVENT_UART);
+}
+
+// Line editor
+// Adds c to the line being built in data, echoing it if echo is set, and
+// returns true once Enter (or MAX_CHARS) completes the line
+// Clear charCount to start the next line
+bool editLine(USER_DATA* data, char c, bool echo) {
+	// Handle Backspace
+	if (c == 8 || c == 127) {
+		if (data->charCount > 0) {
+			data->charCount--;
+			if (echo)
+				putsUart0("\b \b"); // Erase the character from the terminal
 		}
+		return false;
+	}
 
-		// Handle new line and carriage return
-		if (c == 10 || c == 13) {
-			data->buffer[data->charCount] = '\0';
+	// Handle new line and carriage return
+	if (c == 10 || c == 13) {
+		data->buffer[data->charCount] = '\0';
+		if (echo)
 			putsUart0("\r\n");
-			return;
-		}
+		return true;
+	}
 
-		// Save into buffer if alphabets
-		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
-			if (c >= 'A' && c <= 'Z')
-				c += 32; // Converting uppercase letter to lowercase
-			data->buffer[data->charCount++] = c;
+	// Save into buffer if alphabets
+	if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+		if (c >= 'A' && c <= 'Z')
+			c += 32; // Converting uppercase letter to lowercase
+		data->buffer[data->charCount++] = c;
+		if (echo)
 			putcUart0(c);
-			if (data->charCount == MAX_CHARS) {
-				data->buffer[data->charCount] = '\0';
-				putsUart0("\r\n");
-				return;
-			}
-		} else {
+	} else {
+		if (echo)
 			putcUart0(' '); // All delimeters are displayed as space and are stored as null terminator
-			data->buffer[data->charCount++] = '\0';
-		}
+		data->buffer[data->charCount++] = '\0';
+	}
+	if (data->charCount == MAX_CHARS) {
+		data->buffer[data->charCount] = '\0';
+		if (echo)
+			putsUart0("\r\n");
+		return true;
 	}
+	return false;
+}
+
+// Consumes the characters received so far into data, echoing them, and
+// returns true once Enter (or MAX_CHARS) completes the line
+// The line is built over as many calls as it takes; clear charCount to
+// start the next one
+bool editLineUart0(USER_DATA* data) {
+	while (kbhitUart0()) {
+		if (editLine(data, getcUart0(), true))
+			return true;
+	}
+	return false;
+}
+
+// Blocking function that reads a whole line
+void getsUart0(USER_DATA* data) {
+	data->charCount = 0;
+	while (!editLineUart0(data))
+		;
 }
 
+// Splits the line in data into fields at its null terminators
+// Fields past MAX_FIELDS are ignored, since a Telnet peer can send any line
 void parseFields(USER_DATA* data) {
 
 	data->fieldCount = 0;
 	int i;
-	for (i = 0; i < data->charCount;) {
+	for (i = 0; i < data->charCount && data->fieldCount < MAX_FIELDS;) {
 		if (data->buffer[i] != '\0') {
 			data->fieldPosition[data->fieldCount] = i;
 
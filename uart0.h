@@ -23,6 +23,10 @@
 
 #define MAX_CHARS 80
 #define MAX_FIELDS 7
+
+// UART0 is clocked from PIOSC, so pass this to setUart0BaudRate
+#define UART0_CLOCK 16000000
+
 typedef struct _USER_DATA {
     char buffer[MAX_CHARS+1];
     uint8_t fieldCount;
@@ -31,16 +35,29 @@ typedef struct _USER_DATA {
     char fieldType[MAX_FIELDS];
 } USER_DATA;
 
+typedef void (*_putcHandler)(char c);
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
 void initUart0();
 void setUart0BaudRate(uint32_t baudRate, uint32_t fcyc);
+void redirectUart0(_putcHandler handler);
 void putcUart0(char c);
 void putsUart0(char* str);
+void putUintUart0(uint32_t value);
+void putIntUart0(int32_t value);
+void putHexUart0(uint32_t value, uint8_t count);
+void putIpUart0(const uint8_t ip[4]);
+void putMacUart0(const uint8_t mac[6]);
 char getcUart0();
 bool kbhitUart0();
+uint32_t getUart0RxOverflows();
+void enableUart0RxInterrupt();
+void uart0Isr();
+bool editLine(USER_DATA* data, char c, bool echo);
+bool editLineUart0(USER_DATA* data);
 void getsUart0(USER_DATA* data);
 void parseFields(USER_DATA* data);
 char* getFieldString(USER_DATA* data, uint8_t fieldNumber);